@@ -1,8 +1,10 @@
+#include <unistd.h>
 #include <cppformat/format.h>
 
 #include "acceptor.hpp"
 #include "proxy.hpp"
 #include "stats.hpp"
+#include "handoff.hpp"
 #include "utils/logging.hpp"
 #include "except/exceptions.hpp"
 #include "syscalls/fctl.h"
@@ -11,30 +13,83 @@
 using namespace cerb;
 
 Acceptor::Acceptor(Proxy* p, int listen_port)
-    : Connection(fctl::new_stream_socket())
+    : Connection(cerb::take_inherited_listener())
     , _proxy(p)
     , _accepting(false)
+    , _unix_socket(false)
 {
+    if (this->fd != -1) {
+        LOG(INFO) << "Listen to socket taken over - " << this->str();
+        return;
+    }
+    if (listen_port == 0) {
+        return;
+    }
+    this->fd = fctl::new_stream_socket();
     fctl::set_nonblocking(this->fd);
     fctl::bind_to(this->fd, listen_port);
 }
 
 void Acceptor::turn_on_accepting()
 {
-    if (!this->_accepting) {
+    if (!this->_accepting && !this->closed()) {
         this->_accepting = true;
-        this->_proxy->poll_add_ro(this);
+        if (this->_unix_socket) {
+            /* shared by all the threads, of which one is woken for a connection */
+            this->_proxy->poll_add_exclusive(this);
+        } else {
+            this->_proxy->poll_add_ro(this);
+        }
         LOG(INFO) << "Start accepting - " << this->str();
     }
 }
 
+Acceptor::Acceptor(Proxy* p, int listen_fd, bool unix_socket)
+    : Connection(listen_fd)
+    , _proxy(p)
+    , _accepting(false)
+    , _unix_socket(unix_socket)
+{}
+
+Acceptor* Acceptor::of_unix_listener(Proxy* p, int listen_fd)
+{
+    /* each thread closes its own copy as it retires */
+    int fd = ::dup(listen_fd);
+    if (fd < 0) {
+        throw SystemError("dup unix listener", errno);
+    }
+    return new Acceptor(p, fd, true);
+}
+
+void Acceptor::shut()
+{
+    if (this->closed()) {
+        return;
+    }
+    /*
+     * The process taking over shares the socket, and so do the other
+     * threads the unix socket; either accepts what is queued
+     */
+    if (!cerb::handing_off() && !this->_unix_socket) {
+        this->on_events(0);
+    }
+    if (this->_accepting) {
+        this->_accepting = false;
+        this->_proxy->poll_del(this);
+    }
+    LOG(INFO) << "Stop accepting - " << this->str();
+    this->close();
+}
+
 void Acceptor::on_events(int)
 {
     int cfd;
     while ((cfd = cio::accept(this->fd)) > 0)
     {
         fctl::set_nonblocking(cfd);
-        fctl::set_tcpnodelay(cfd);
+        if (!this->_unix_socket) {
+            fctl::set_tcpnodelay(cfd);
+        }
         this->_proxy->new_client(cfd);
     }
     if (cfd == -1) {
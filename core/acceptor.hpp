@@ -13,9 +13,21 @@ namespace cerb {
     {
         util::sref<Proxy> const _proxy;
         bool _accepting;
+        bool const _unix_socket;
+
+        Acceptor(Proxy* p, int listen_fd, bool unix_socket);
     public:
+        /* a port of 0 listens to no TCP port, unless a socket is taken over */
         Acceptor(Proxy* p, int listen_port);
+        /* Accept from the unix socket that the acceptors of all threads share */
+        static Acceptor* of_unix_listener(Proxy* p, int listen_fd);
+
         void turn_on_accepting();
+        /*
+         * take the connections queued and close, so the others in the reuseport
+         * group get new ones; those queued on the unix socket are left to the others
+         */
+        void shut();
 
         void on_events(int);
         void on_error() {}
@@ -0,0 +1,83 @@
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#include "background.hpp"
+#include "utils/logging.hpp"
+
+using namespace cerb;
+
+namespace {
+
+    struct Job {
+        BackgroundTask task;
+        std::shared_ptr<ControlMailbox> reply_to;
+    };
+
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cond;
+    std::deque<Job> jobs;
+    int workers_count = 0;
+
+    std::atomic<long> tasks(0);
+    std::atomic<long> queue_depth(0);
+    std::atomic<long long> task_ns(0);
+    std::atomic<long long> max_task_ns(0);
+
+    void work()
+    {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                jobs_cond.wait(lock, []() { return !jobs.empty(); });
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            --queue_depth;
+            Time start = Clock::now();
+            ControlAction action(job.task());
+            long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start).count();
+            task_ns += ns;
+            long long m = max_task_ns.load();
+            while (m < ns && !max_task_ns.compare_exchange_weak(m, ns))
+                ;
+            ++tasks;
+            job.reply_to->post(std::move(action));
+        }
+    }
+
+}
+
+void cerb::start_background_workers(int threads)
+{
+    ::workers_count = threads;
+    for (int i = 0; i < threads; ++i) {
+        std::thread(::work).detach();
+    }
+}
+
+void cerb::run_in_background(Proxy* p, BackgroundTask task)
+{
+    std::shared_ptr<ControlMailbox> mailbox(ControlMailbox::of_this_thread());
+    if (::workers_count == 0 || mailbox == nullptr) {
+        return task()(p);
+    }
+    {
+        std::lock_guard<std::mutex> _(::jobs_mutex);
+        ::jobs.push_back(Job{std::move(task), mailbox});
+    }
+    ++::queue_depth;
+    ::jobs_cond.notify_one();
+}
+
+BackgroundStat cerb::background_stat()
+{
+    long n = ::tasks.load();
+    return BackgroundStat{
+        n, ::queue_depth.load(),
+        Interval(n == 0 ? 0 : ::task_ns.load() / 1e9 / n),
+        Interval(::max_task_ns.load() / 1e9)};
+}
@@ -0,0 +1,35 @@
+#ifndef __CERBERUS_BACKGROUND_HPP__
+#define __CERBERUS_BACKGROUND_HPP__
+
+#include <functional>
+
+#include "common.hpp"
+#include "concurrence.hpp"
+
+namespace cerb {
+
+    /* Runs off the event loop; the action it returns runs back on the loop */
+    typedef std::function<ControlAction()> BackgroundTask;
+
+    struct BackgroundStat {
+        long tasks;
+        long queue_depth;
+        Interval task_elapse;
+        Interval max_task_elapse;
+    };
+
+    /* Start threads for background tasks; none is started by default */
+    void start_background_workers(int threads);
+
+    /*
+     * Run the task on a worker and the action it returns on the listen thread
+     * calling this; both run at once if there is no worker or the caller is
+     * not a listen thread
+     */
+    void run_in_background(Proxy* p, BackgroundTask task);
+
+    BackgroundStat background_stat();
+
+}
+
+#endif /* __CERBERUS_BACKGROUND_HPP__ */
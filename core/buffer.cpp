@@ -1,4 +1,5 @@
 #include <climits>
+#include <cstring>
 #include <algorithm>
 
 #include "buffer.hpp"
@@ -41,13 +42,78 @@ void cerb::flush_string(int fd, std::string const& s)
     ::flush_mem(fd, reinterpret_cast<byte const*>(s.data()), s.size());
 }
 
+Buffer::Buffer(char const* s)
+    : Buffer()
+{
+    this->_append(reinterpret_cast<byte const*>(s), std::strlen(s));
+}
+
+void Buffer::_release()
+{
+    if (this->_on_heap()) {
+        BufferStatAllocator().deallocate(this->_data, this->_capacity);
+        this->_data = this->_inline;
+        this->_capacity = INLINE_SIZE;
+    }
+    this->_size = 0;
+}
+
+void Buffer::_steal(Buffer& rhs)
+{
+    if (rhs._on_heap()) {
+        this->_data = rhs._data;
+        this->_capacity = rhs._capacity;
+        rhs._data = rhs._inline;
+        rhs._capacity = INLINE_SIZE;
+    } else {
+        std::memcpy(this->_inline, rhs._inline, rhs._size);
+    }
+    this->_size = rhs._size;
+    rhs._size = 0;
+}
+
+void Buffer::_reserve(size_type n)
+{
+    if (n <= this->_capacity) {
+        return;
+    }
+    size_type capacity = std::max(n, this->_capacity * 2);
+    byte* data = BufferStatAllocator().allocate(capacity);
+    std::memcpy(data, this->_data, this->_size);
+    if (this->_on_heap()) {
+        BufferStatAllocator().deallocate(this->_data, this->_capacity);
+    }
+    this->_data = data;
+    this->_capacity = capacity;
+}
+
+void Buffer::_append(byte const* first, size_type n)
+{
+    this->_reserve(this->_size + n);
+    std::memcpy(this->_data + this->_size, first, n);
+    this->_size += n;
+}
+
+void Buffer::swap(Buffer& another)
+{
+    if (this->_on_heap() && another._on_heap()) {
+        std::swap(this->_data, another._data);
+        std::swap(this->_size, another._size);
+        std::swap(this->_capacity, another._capacity);
+        return;
+    }
+    Buffer t(std::move(another));
+    another = std::move(*this);
+    *this = std::move(t);
+}
+
 int Buffer::read(int fd)
 {
     byte local[BUFFER_SIZE];
     int n = 0, nread;
     while ((nread = cio::read(fd, local, BUFFER_SIZE)) > 0) {
         n += nread;
-        this->_buffer.insert(this->_buffer.end(), local, local + nread);
+        this->_append(local, nread);
     }
     if (nread == -1) {
         on_error("buffer read");
@@ -57,44 +123,57 @@ int Buffer::read(int fd)
 
 int Buffer::write(int fd) const
 {
-    ::flush_mem(fd, this->_buffer.data(), this->_buffer.size());
-    return this->_buffer.size();
+    ::flush_mem(fd, this->_data, this->_size);
+    return this->_size;
 }
 
 void Buffer::truncate_from_begin(iterator i)
 {
-    this->_buffer.erase(_buffer.begin(), i);
+    this->_size = this->end() - i;
+    std::memmove(this->_data, i, this->_size);
 }
 
 void Buffer::buffer_ready(std::vector<cio::iovec>& iov)
 {
-    if (!_buffer.empty()) {
-        cio::iovec v = {_buffer.data(), size_t(_buffer.size())};
-        LOG(DEBUG) << "Push iov " << reinterpret_cast<void*>(_buffer.data()) << ' ' << _buffer.size();
+    if (!this->empty()) {
+        cio::iovec v = {this->_data, size_t(this->_size)};
+        LOG(DEBUG) << "Push iov " << reinterpret_cast<void*>(this->_data) << ' ' << this->_size;
         iov.push_back(v);
     }
 }
 
 void Buffer::append_from(const_iterator first, const_iterator last)
 {
-    _buffer.insert(_buffer.end(), first, last);
+    this->_append(first, last - first);
+}
+
+void Buffer::append_header(char prefix, rint value)
+{
+    byte digits[24];
+    byte* p = digits + sizeof digits;
+    *--p = '\n';
+    *--p = '\r';
+    unsigned long long u = value < 0 ? 0ULL - static_cast<unsigned long long>(value)
+                                     : static_cast<unsigned long long>(value);
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    *--p = prefix;
+    this->_append(p, digits + sizeof digits - p);
 }
 
 std::string Buffer::to_string() const
 {
-    return std::string(reinterpret_cast<char const*>(_buffer.data()), size());
+    return std::string(reinterpret_cast<char const*>(this->_data), this->_size);
 }
 
 bool Buffer::same_as_string(std::string const& s) const
 {
-    if (size() != s.size()) {
-        return false;
-    }
-    std::string::size_type i = 0;
-    return cend() == std::find_if(cbegin(), cend(), [&](byte b)
-                                                    {
-                                                        return b != s[i++];
-                                                    });
+    return this->_size == s.size() && std::memcmp(this->_data, s.data(), this->_size) == 0;
 }
 
 static int write_single(int fd, byte const* buf, int buf_len, int* offset)
@@ -111,6 +190,13 @@ static int write_single(int fd, byte const* buf, int buf_len, int* offset)
     return 1;
 }
 
+int Buffer::try_write(int fd)
+{
+    int offset = 0;
+    ::write_single(fd, this->_data, this->_size, &offset);
+    return offset;
+}
+
 static int write_vec(int fd, int iovcnt, cio::iovec* iov, ssize_t total, int* first_offset)
 {
     if (1 == iovcnt) {
@@ -181,3 +267,14 @@ bool BufferSet::writev(int fd)
     }
     return true;
 }
+
+void BufferSet::drain_to(std::string& out)
+{
+    int offset = this->_1st_buf_offset;
+    for (auto const& b: this->_buf_arr) {
+        out.append(reinterpret_cast<char const*>(b->begin()) + offset, b->size() - offset);
+        offset = 0;
+    }
+    this->_buf_arr.clear();
+    this->_1st_buf_offset = 0;
+}
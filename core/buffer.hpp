@@ -13,92 +13,135 @@ namespace cerb {
 
     void flush_string(int fd, std::string const& s);
 
+    /*
+     * Byte buffer that keeps up to INLINE_SIZE bytes in the object itself,
+     * so tiny requests and replies (+OK, :1, $-1, short bulks) never touch
+     * the heap. Iterators are invalidated by moving or swapping an inline
+     * buffer.
+     */
     class Buffer {
-        typedef std::vector<byte, BufferStatAllocator> ContainerType;
-        ContainerType _buffer;
     public:
-        typedef ContainerType::size_type size_type;
-        typedef ContainerType::value_type value_type;
-        typedef ContainerType::iterator iterator;
-        typedef ContainerType::const_iterator const_iterator;
+        typedef std::size_t size_type;
+        typedef byte value_type;
+        typedef byte* iterator;
+        typedef byte const* const_iterator;
+
+        static size_type const INLINE_SIZE = 64;
+    private:
+        byte* _data;
+        size_type _size;
+        size_type _capacity;
+        byte _inline[INLINE_SIZE];
+
+        bool _on_heap() const
+        {
+            return this->_data != this->_inline;
+        }
 
-        Buffer() = default;
+        void _release();
+        void _steal(Buffer& rhs);
+        void _reserve(size_type n);
+        void _append(byte const* first, size_type n);
+    public:
+        Buffer()
+            : _data(_inline)
+            , _size(0)
+            , _capacity(INLINE_SIZE)
+        {}
 
         Buffer(std::string const& s)
-            : _buffer(s.begin(), s.end())
-        {}
+            : Buffer()
+        {
+            this->_append(reinterpret_cast<byte const*>(s.data()), s.size());
+        }
+
+        Buffer(char const* s);
 
         Buffer(Buffer const&) = delete;
 
         Buffer(Buffer&& rhs)
-            : _buffer(std::move(rhs._buffer))
-        {}
+            : Buffer()
+        {
+            this->_steal(rhs);
+        }
 
-        Buffer(iterator first, iterator last)
-            : _buffer(first, last)
-        {}
+        Buffer(const_iterator first, const_iterator last)
+            : Buffer()
+        {
+            this->_append(first, last - first);
+        }
+
+        ~Buffer()
+        {
+            this->_release();
+        }
 
         Buffer& operator=(Buffer&& rhs)
         {
-            _buffer = std::move(rhs._buffer);
+            if (this != &rhs) {
+                this->_release();
+                this->_steal(rhs);
+            }
             return *this;
         }
 
         iterator begin()
         {
-            return _buffer.begin();
+            return _data;
         }
 
         iterator end()
         {
-            return _buffer.end();
+            return _data + _size;
         }
 
         const_iterator cbegin() const
         {
-            return _buffer.cbegin();
+            return _data;
         }
 
         const_iterator cend() const
         {
-            return _buffer.cend();
+            return _data + _size;
         }
 
         size_type size() const
         {
-            return _buffer.size();
+            return _size;
         }
 
         bool empty() const
         {
-            return _buffer.empty();
+            return _size == 0;
         }
 
-        void swap(Buffer& another)
-        {
-            this->_buffer.swap(another._buffer);
-        }
+        void swap(Buffer& another);
 
         void swap(Buffer&& another)
         {
-            this->_buffer.swap(another._buffer);
+            this->swap(another);
         }
 
         void clear()
         {
-            _buffer.clear();
+            _size = 0;
         }
 
         void* data()
         {
-            return this->_buffer.data();
+            return this->_data;
         }
 
         int read(int fd);
         int write(int fd) const;
+        int try_write(int fd);
         void truncate_from_begin(iterator i);
         void buffer_ready(std::vector<cio::iovec>& iov);
         void append_from(const_iterator first, const_iterator last);
+
+        /* Append a RESP line like `*3\r\n` or `:-1\r\n` without going through a string */
+        void append_header(char prefix, rint value);
+
         std::string to_string() const;
         bool same_as_string(std::string const& s) const;
     };
@@ -129,6 +172,9 @@ namespace cerb {
         }
 
         bool writev(int fd);
+
+        /* append the bytes not written yet to out and clear */
+        void drain_to(std::string& out);
     };
 
 }
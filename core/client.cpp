@@ -12,11 +12,18 @@ using namespace cerb;
 
 static msize_t const MAX_PIPE = 64;
 static msize_t const MAX_RESPONSES = 256;
+static bool fast_path = true;
+
+void Client::set_fast_path(bool enabled)
+{
+    ::fast_path = enabled;
+}
 
 Client::Client(int fd, Proxy* p)
     : ProxyConnection(fd)
     , _proxy(p)
     , _awaiting_count(0)
+    , _fast_path(util::mkref(*this))
 {
     p->poll_add_ro(this);
 }
@@ -45,6 +52,9 @@ void Client::on_events(int events)
             this->_write_response();
         }
         if (this->_output_buffer_set.empty()) {
+            if (this->_idle() && this->_proxy->take_client_migration()) {
+                return this->_migrate();
+            }
             this->_proxy->set_conn_poll_ro(this);
         } else {
             this->_proxy->set_conn_poll_rw(this);
@@ -59,7 +69,7 @@ void Client::on_events(int events)
     }
 }
 
-void Client::after_events(std::set<Connection*>&)
+void Client::after_events()
 {
     if (this->closed()) {
         delete this;
@@ -121,13 +131,69 @@ void Client::_write_response()
 void Client::_read_request()
 {
     int n = this->_buffer.read(this->fd);
+    if (n != 0 && this->_forward_fast_path()) {
+        return;
+    }
     LOG(DEBUG) << "Read from " << this->str() << " current buffer size: "
                << this->_buffer.size() << " read returns " << n;
     if (n == 0) {
         return this->close();
     }
     ::split_client_command(this->_buffer, util::mkref(*this));
-    if (this->_awaiting_groups.empty()) {
+    if (this->_awaiting_groups.empty() && !this->_fast_path.in_flight) {
+        this->_process();
+    }
+}
+
+bool Client::_forward_fast_path()
+{
+    if (!::fast_path || this->_fast_path.in_flight || !this->_parsed_groups.empty()
+        || !this->_awaiting_groups.empty() || !this->_ready_groups.empty()
+        || !this->_output_buffer_set.empty())
+    {
+        return false;
+    }
+    slot key_slot;
+    bool readonly;
+    bool bulk;
+    if (!::parse_single_key_command(this->_buffer, key_slot, readonly, bulk)
+        || this->_proxy->get_server_by_slot(key_slot) == nullptr)
+    {
+        return false;
+    }
+    FastPathCommand& cmd = this->_fast_path.command;
+    cmd.key_slot = key_slot;
+    cmd.readonly = readonly;
+    cmd.bulk = bulk;
+    cmd.buffer->swap(this->_buffer);
+    this->_buffer.clear();
+    this->_fast_path.creation = Clock::now();
+    this->_fast_path.in_flight = true;
+    this->_proxy->set_conn_poll_rw(cmd.select_server(this->_proxy));
+    return true;
+}
+
+void Client::_fast_path_responsed()
+{
+    this->_fast_path.in_flight = false;
+    FastPathCommand& cmd = this->_fast_path.command;
+    this->_proxy->stat_proccessed(Clock::now() - this->_fast_path.creation, cmd.remote_cost());
+    if (this->closed()) {
+        return;
+    }
+    try {
+        int n = cmd.buffer->try_write(this->fd);
+        if (Buffer::size_type(n) < cmd.buffer->size()) {
+            cmd.buffer->truncate_from_begin(cmd.buffer->begin() + n);
+            this->_output_buffer_set.append(cmd.buffer);
+            this->_proxy->set_conn_poll_rw(this);
+            return;
+        }
+    } catch (IOErrorBase& e) {
+        LOG(DEBUG) << "IOError: " << e.what() << " :: Close " << this->str();
+        return this->close();
+    }
+    if (!this->_parsed_groups.empty()) {
         this->_process();
     }
 }
@@ -186,10 +252,46 @@ void Client::group_responsed()
 
 void Client::add_peer(Server* svr)
 {
-    this->_peers.insert(svr);
+    /* mostly the same server as the last command */
+    if (std::find(this->_peers.rbegin(), this->_peers.rend(), svr) == this->_peers.rend()) {
+        this->_peers.push_back(svr);
+    }
 }
 
 void Client::push_command(util::sptr<CommandGroup> g)
 {
     this->_parsed_groups.push_back(std::move(g));
 }
+
+bool Client::_idle() const
+{
+    return this->_parsed_groups.empty() && this->_awaiting_groups.empty()
+        && this->_ready_groups.empty() && !this->_fast_path.in_flight
+        && this->_output_buffer_set.empty();
+}
+
+void Client::_migrate()
+{
+    LOG(DEBUG) << "Migrate " << this->str();
+    this->_proxy->poll_del(this);
+    int client_fd = this->fd;
+    /* handed over instead of closed, and this is deleted after events as closed */
+    this->fd = -1;
+    this->_proxy->migrate_client(client_fd, this->_buffer.to_string());
+}
+
+bool Client::migrate_if_idle()
+{
+    if (!this->_idle()) {
+        return false;
+    }
+    this->_migrate();
+    return true;
+}
+
+void Client::restore_buffer(std::string const& buffered)
+{
+    if (!buffered.empty()) {
+        Buffer(buffered).swap(this->_buffer);
+    }
+}
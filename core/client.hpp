@@ -14,33 +14,92 @@ namespace cerb {
     class Client
         : public ProxyConnection
     {
+        class FastPathGroup
+            : public CommandGroup
+        {
+        public:
+            FastPathCommand command;
+            Time creation;
+            bool in_flight;
+
+            explicit FastPathGroup(util::sref<Client> cli)
+                : CommandGroup(cli)
+                , command(util::mkref(*this))
+                , in_flight(false)
+            {}
+
+            bool wait_remote() const
+            {
+                return true;
+            }
+
+            void select_remote(Proxy* proxy)
+            {
+                this->command.select_server(proxy);
+            }
+
+            void append_buffer_to(BufferSet& b)
+            {
+                b.append(this->command.buffer);
+            }
+
+            int total_buffer_size() const
+            {
+                return this->command.buffer->size();
+            }
+
+            void command_responsed()
+            {
+                this->client->_fast_path_responsed();
+            }
+        };
+
         void _write_response();
         void _read_request();
 
         Proxy* const _proxy;
-        std::set<Server*> _peers;
+        /* servers with commands of this queued; cleared without freeing, so no allocation once grown */
+        std::vector<Server*> _peers;
         std::vector<util::sptr<CommandGroup>> _parsed_groups;
         std::vector<util::sptr<CommandGroup>> _awaiting_groups;
         std::vector<util::sptr<CommandGroup>> _ready_groups;
         int _awaiting_count;
         Buffer _buffer;
         BufferSet _output_buffer_set;
+        FastPathGroup _fast_path;
 
         void _process();
+        bool _forward_fast_path();
+        void _fast_path_responsed();
         void _send_buffer_set();
         void _push_awaitings_to_ready();
+        bool _idle() const;
+        void _migrate();
     public:
         Client(int fd, Proxy* p);
         ~Client();
 
+        /* whether single commands of clients with nothing in flight skip command groups */
+        static void set_fast_path(bool enabled);
+
         void on_events(int events);
-        void after_events(std::set<Connection*>&);
+        void after_events();
         std::string str() const;
 
         void group_responsed();
         void add_peer(Server* svr);
+
+        std::vector<Server*> const& peers() const
+        {
+            return this->_peers;
+        }
+
         void reactivate(util::sref<Command> cmd);
         void push_command(util::sptr<CommandGroup> g);
+        /* bytes read by the thread it migrated from but not parsed yet */
+        void restore_buffer(std::string const& buffered);
+        /* hand it over to another thread unless a command is in flight */
+        bool migrate_if_idle();
     };
 
 }
@@ -8,6 +8,7 @@
 #include "server.hpp"
 #include "subscription.hpp"
 #include "stats.hpp"
+#include "background.hpp"
 #include "slot_calc.hpp"
 #include "globals.hpp"
 #include "except/exceptions.hpp"
@@ -19,19 +20,28 @@ using namespace cerb;
 
 namespace {
 
-    std::string const RSP_OK_STR("+OK\r\n");
-    std::shared_ptr<Buffer> const RSP_OK(new Buffer(RSP_OK_STR));
+    /*
+     * Constant replies shared by every command; buffers in BufferSet are never modified.
+     * Replies from nodes, such as $-1, :0, :1 or -CLUSTERDOWN, and the -CLUSTERDOWN
+     * of a failed slot map update are not shared this way: they are swapped into the
+     * buffer of their command, which is written over by its next request on the fast
+     * path, and they fit in the inline storage of that buffer anyway.
+     */
+    std::shared_ptr<Buffer> const RSP_OK(std::make_shared<Buffer>("+OK\r\n"));
+    std::shared_ptr<Buffer> const RSP_PONG(std::make_shared<Buffer>("+PONG\r\n"));
+    std::shared_ptr<Buffer> const RSP_UNKNOWN_COMMAND(std::make_shared<Buffer>(
+        "-ERR Unknown command or command key not specified\r\n"));
 
     Server* select_server_for(Proxy* proxy, DataCommand* cmd, slot key_slot)
     {
-        Server* svr = proxy->get_server_by_slot(key_slot);
+        Server* svr = cmd->readonly ? proxy->get_read_server_by_slot(key_slot)
+                                    : proxy->get_server_by_slot(key_slot);
         if (svr == nullptr) {
             LOG(DEBUG) << "Cluster slot not covered " << key_slot;
             proxy->retry_move_ask_command_later(util::mkref(*cmd));
             return nullptr;
         }
-        svr->push_client_command(util::mkref(*cmd));
-        return svr;
+        return svr->push_client_command(util::mkref(*cmd));
     }
 
     class OneSlotCommand
@@ -88,6 +98,10 @@ namespace {
                 : Command(std::move(b), g)
             {}
 
+            DirectCommand(std::shared_ptr<Buffer> b, util::sref<CommandGroup> g)
+                : Command(std::move(b), g)
+            {}
+
             Server* select_server(Proxy*)
             {
                 return nullptr;
@@ -101,6 +115,11 @@ namespace {
             , command(new DirectCommand(std::move(b), util::mkref(*this)))
         {}
 
+        DirectCommandGroup(util::sref<Client> client, std::shared_ptr<Buffer> const& b)
+            : CommandGroup(client)
+            , command(new DirectCommand(b, util::mkref(*this)))
+        {}
+
         DirectCommandGroup(util::sref<Client> client, char const* r)
             : DirectCommandGroup(client, Buffer(r))
         {}
@@ -129,6 +148,70 @@ namespace {
         void command_responsed() {}
     };
 
+    /* Responded by a string made by a background worker */
+    class BackgroundCommandGroup
+        : public CommandGroup
+    {
+        std::function<std::string()> _make_rsp;
+        std::shared_ptr<Buffer> _rsp;
+        /* set false on destruction, as the client may be closed before responded */
+        std::shared_ptr<bool> _alive;
+
+        void _respond(std::string const& r)
+        {
+            Buffer(r).swap(*this->_rsp);
+            this->client->group_responsed();
+        }
+    public:
+        BackgroundCommandGroup(util::sref<Client> client, std::function<std::string()> m)
+            : CommandGroup(client)
+            , _make_rsp(std::move(m))
+            , _rsp(new Buffer)
+            , _alive(new bool(true))
+        {}
+
+        ~BackgroundCommandGroup()
+        {
+            *this->_alive = false;
+        }
+
+        bool wait_remote() const
+        {
+            return true;
+        }
+
+        void select_remote(Proxy* proxy)
+        {
+            std::function<std::string()> make_rsp(std::move(this->_make_rsp));
+            std::shared_ptr<bool> alive(this->_alive);
+            BackgroundCommandGroup* self = this;
+            cerb::run_in_background(
+                proxy,
+                [make_rsp, alive, self]() -> ControlAction
+                {
+                    std::string r(make_rsp());
+                    return [r, alive, self](Proxy*)
+                    {
+                        if (*alive) {
+                            self->_respond(r);
+                        }
+                    };
+                });
+        }
+
+        void append_buffer_to(BufferSet& b)
+        {
+            b.append(this->_rsp);
+        }
+
+        int total_buffer_size() const
+        {
+            return this->_rsp->size();
+        }
+
+        void command_responsed() {}
+    };
+
     class StatsCommandGroup
         : public CommandGroup
     {
@@ -222,8 +305,8 @@ namespace {
         void command_responsed()
         {
             if (--this->awaiting_count == 0) {
-                this->arr_payload->swap(Buffer(
-                    fmt::format("*{}\r\n", this->commands.size())));
+                this->arr_payload->clear();
+                this->arr_payload->append_header('*', this->commands.size());
                 this->client->group_responsed();
                 this->complete = true;
             }
@@ -303,9 +386,111 @@ namespace {
 
     void notify_each_thread_update_slot_map()
     {
-        for (auto& t: cerb_global::all_threads) {
-            t.get_proxy()->update_slot_map();
+        for (auto const& t: cerb_global::listen_threads()) {
+            t->post([](Proxy* p) { p->update_slot_map(); });
+        }
+    }
+
+    std::set<std::string> STD_COMMANDS({
+        "DUMP", "EXISTS", "TTL", "PTTL", "TYPE",
+        "GET", "BITCOUNT", "GETBIT", "GETRANGE", "STRLEN",
+        "HGET", "HGETALL", "HKEYS", "HVALS", "HLEN", "HEXISTS", "HMGET", "HSCAN",
+        "LINDEX", "LLEN", "LRANGE",
+        "SCARD", "SISMEMBER", "SRANDMEMBER", "SMEMBERS", "SSCAN",
+
+        "ZCARD", "ZSCAN", "ZCOUNT", "ZLEXCOUNT", "ZRANGE",
+        "ZRANGEBYLEX", "ZREVRANGEBYLEX", "ZRANGEBYSCORE", "ZRANK",
+        "ZREVRANGE", "ZREVRANGEBYSCORE", "ZREVRANK", "ZSCORE",
+    });
+
+    /* commands a read-slave proxy supports, which slaves could serve */
+    std::set<std::string> const READ_COMMANDS(
+        []()
+        {
+            std::set<std::string> r(STD_COMMANDS);
+            r.insert("MGET");
+            return r;
+        }());
+    std::set<std::string> MASTER_READ_COMMANDS;
+    std::vector<std::string> MASTER_READ_KEY_PREFIXES;
+
+    bool read_from_slave(std::string const& command)
+    {
+        return READ_COMMANDS.find(command) != READ_COMMANDS.end()
+            && MASTER_READ_COMMANDS.find(command) == MASTER_READ_COMMANDS.end();
+    }
+
+    std::set<std::string> BULK_COMMANDS({
+        "HGETALL", "HKEYS", "HVALS", "LRANGE", "SMEMBERS",
+        "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE",
+    });
+
+    bool bulk_reply(std::string const& command)
+    {
+        return BULK_COMMANDS.find(command) != BULK_COMMANDS.end();
+    }
+
+    template <typename Iterator>
+    bool key_read_from_master(Iterator begin, Iterator end)
+    {
+        return std::any_of(
+            MASTER_READ_KEY_PREFIXES.begin(), MASTER_READ_KEY_PREFIXES.end(),
+            [&](std::string const& prefix)
+            {
+                return std::size_t(end - begin) >= prefix.size() && std::equal(
+                    prefix.begin(), prefix.end(), begin,
+                    [](char c, byte b) { return byte(c) == b; });
+            });
+    }
+
+    struct FastPathCommandName {
+        std::string name;
+        bool readonly;
+        bool bulk;
+    };
+
+    std::vector<FastPathCommandName> index_fast_path_commands()
+    {
+        std::vector<FastPathCommandName> r;
+        for (std::string const& c: STD_COMMANDS) {
+            r.push_back(FastPathCommandName{c, ::read_from_slave(c), ::bulk_reply(c)});
         }
+        return r;
+    }
+
+    /* STD_COMMANDS sorted, so that the fast path looks a command up without copying its name */
+    std::vector<FastPathCommandName> FAST_PATH_COMMANDS(::index_fast_path_commands());
+
+    /* compare name to the bytes in upper case */
+    int compare_command_name(std::string const& name, Buffer::const_iterator begin,
+                             Buffer::const_iterator end)
+    {
+        std::size_t i = 0;
+        for (; i < name.size() && begin != end; ++i, ++begin) {
+            int b = std::toupper(*begin);
+            if (byte(name[i]) != b) {
+                return byte(name[i]) < b ? -1 : 1;
+            }
+        }
+        if (i < name.size()) {
+            return 1;
+        }
+        return begin == end ? 0 : -1;
+    }
+
+    FastPathCommandName const* find_fast_path_command(Buffer::const_iterator begin,
+                                                      Buffer::const_iterator end)
+    {
+        auto i = std::lower_bound(
+            FAST_PATH_COMMANDS.begin(), FAST_PATH_COMMANDS.end(), begin,
+            [&](FastPathCommandName const& c, Buffer::const_iterator b)
+            {
+                return ::compare_command_name(c.name, b, end) < 0;
+            });
+        if (i == FAST_PATH_COMMANDS.end() || ::compare_command_name(i->name, begin, end) != 0) {
+            return nullptr;
+        }
+        return &*i;
     }
 
     class SpecialCommandParser {
@@ -330,7 +515,7 @@ namespace {
         util::sptr<CommandGroup> spawn_commands(util::sref<Client> c, Buffer::iterator)
         {
             if (this->msg.empty()) {
-                return util::mkptr(new DirectCommandGroup(c, "+PONG\r\n"));
+                return util::mkptr(new DirectCommandGroup(c, RSP_PONG));
             }
             return util::mkptr(new DirectCommandGroup(c, fmt::format(
                             "${}\r\n{}\r\n", this->msg.size(), this->msg)));
@@ -351,7 +536,7 @@ namespace {
         util::sptr<CommandGroup> spawn_commands(
             util::sref<Client> c, Buffer::iterator)
         {
-            return util::mkptr(new DirectCommandGroup(c, stats_string()));
+            return util::mkptr(new BackgroundCommandGroup(c, stats_string));
         }
 
         void on_str(Buffer::iterator, Buffer::iterator) {}
@@ -366,7 +551,7 @@ namespace {
         util::sptr<CommandGroup> spawn_commands(util::sref<Client> c, Buffer::iterator)
         {
             ::notify_each_thread_update_slot_map();
-            return util::mkptr(new DirectCommandGroup(c, RSP_OK_STR));
+            return util::mkptr(new DirectCommandGroup(c, RSP_OK));
         }
 
         void on_str(Buffer::iterator, Buffer::iterator) {}
@@ -397,7 +582,7 @@ namespace {
             }
             cerb_global::set_remotes(std::move(this->remotes));
             ::notify_each_thread_update_slot_map();
-            return util::mkptr(new DirectCommandGroup(c, RSP_OK_STR));
+            return util::mkptr(new DirectCommandGroup(c, RSP_OK));
         }
 
         void on_str(Buffer::iterator begin, Buffer::iterator end)
@@ -415,12 +600,45 @@ namespace {
         }
     };
 
+    class SetThreadsCommandParser
+        : public SpecialCommandParser
+    {
+        int thread_count;
+        int arg_count;
+    public:
+        SetThreadsCommandParser()
+            : thread_count(0)
+            , arg_count(0)
+        {}
+
+        util::sptr<CommandGroup> spawn_commands(util::sref<Client> c, Buffer::iterator)
+        {
+            if (this->arg_count != 1 || this->thread_count <= 0) {
+                return util::mkptr(new DirectCommandGroup(
+                    c, "-ERR wrong arguments for 'THREADS' command\r\n"));
+            }
+            if (!cerb::scale_listen_threads(this->thread_count)) {
+                return util::mkptr(new DirectCommandGroup(
+                    c, "-ERR threads pinned to CPUs are not scaled\r\n"));
+            }
+            return util::mkptr(new DirectCommandGroup(c, RSP_OK));
+        }
+
+        void on_str(Buffer::iterator begin, Buffer::iterator end)
+        {
+            ++this->arg_count;
+            this->thread_count = util::atoi(std::string(begin, end));
+        }
+    };
+
     class EachKeyCommandParser
         : public SpecialCommandParser
     {
         std::string const command_name;
+        bool const readonly;
         std::vector<Buffer::iterator> keys_split_points;
         std::vector<slot> keys_slots;
+        std::vector<bool> keys_readonly;
 
         virtual Buffer command_header() const = 0;
 
@@ -429,14 +647,16 @@ namespace {
             return util::mkptr(new MultipleCommandsGroup(c));
         }
     public:
-        EachKeyCommandParser(Buffer::iterator arg_begin, std::string cmd)
+        EachKeyCommandParser(Buffer::iterator arg_begin, std::string cmd, bool r)
             : command_name(std::move(cmd))
+            , readonly(r)
         {
             keys_split_points.push_back(arg_begin);
         }
 
         void on_str(Buffer::iterator begin, Buffer::iterator end)
         {
+            this->keys_readonly.push_back(this->readonly && !::key_read_from_master(begin, end));
             KeySlotCalc slot_calc;
             for (; begin != end; ++begin) {
                 slot_calc.next_byte(*begin);
@@ -456,8 +676,10 @@ namespace {
             for (unsigned i = 0; i < keys_slots.size(); ++i) {
                 Buffer b(command_header());
                 b.append_from(this->keys_split_points[i], this->keys_split_points[i + 1]);
-                g->append_command(util::mkptr(
-                    new OneSlotCommand(std::move(b), *g, this->keys_slots[i])));
+                util::sptr<DataCommand> cmd(
+                    new OneSlotCommand(std::move(b), *g, this->keys_slots[i]));
+                cmd->readonly = this->keys_readonly[i];
+                g->append_command(std::move(cmd));
             }
             return std::move(g);
         }
@@ -472,7 +694,7 @@ namespace {
         }
     public:
         explicit MGetCommandParser(Buffer::iterator arg_begin)
-            : EachKeyCommandParser(arg_begin, "mget")
+            : EachKeyCommandParser(arg_begin, "mget", ::read_from_slave("MGET"))
         {}
     };
 
@@ -493,7 +715,8 @@ namespace {
                 for (auto const& c: this->commands) {
                     count += std::find(c->buffer->begin(), c->buffer->end(), '1') == c->buffer->end() ? 0 : 1;
                 }
-                this->arr_payload->swap(Buffer(":" + util::str(count) + "\r\n"));
+                this->arr_payload->clear();
+                this->arr_payload->append_header(':', count);
                 b.append(this->arr_payload);
             }
 
@@ -514,7 +737,7 @@ namespace {
         }
     public:
         explicit DelCommandParser(Buffer::iterator arg_begin)
-            : EachKeyCommandParser(arg_begin, "del")
+            : EachKeyCommandParser(arg_begin, "del", false)
         {}
     };
 
@@ -642,7 +865,7 @@ namespace {
                 this->on_rsp =
                     [this](Buffer, bool)
                     {
-                        this->buffer->swap(Buffer(RSP_OK_STR));
+                        this->buffer->swap(Buffer("+OK\r\n"));
                         this->responsed();
                     };
                 this->group->client->reactivate(util::mkref(*this));
@@ -940,6 +1163,11 @@ namespace {
             {
                 return util::mkptr(new SetRemotesCommandParser);
             }},
+        {"THREADS",
+            [](Buffer::iterator, Buffer::iterator) -> CmdPtr
+            {
+                return util::mkptr(new SetThreadsCommandParser);
+            }},
         {"MGET",
             [](Buffer::iterator, Buffer::iterator arg_start) -> CmdPtr
             {
@@ -957,17 +1185,35 @@ namespace {
             }},
     });
 
-    std::set<std::string> STD_COMMANDS({
-        "DUMP", "EXISTS", "TTL", "PTTL", "TYPE",
-        "GET", "BITCOUNT", "GETBIT", "GETRANGE", "STRLEN",
-        "HGET", "HGETALL", "HKEYS", "HVALS", "HLEN", "HEXISTS", "HMGET", "HSCAN",
-        "LINDEX", "LLEN", "LRANGE",
-        "SCARD", "SISMEMBER", "SRANDMEMBER", "SMEMBERS", "SSCAN",
+    bool read_length(Buffer::const_iterator& i, Buffer::const_iterator end,
+                     byte prefix, cerb::rint& length)
+    {
+        if (i == end || *i != prefix) {
+            return false;
+        }
+        length = 0;
+        for (++i; i != end && '0' <= *i && *i <= '9'; ++i) {
+            length = length * 10 + (*i - '0');
+        }
+        if (end - i < msg::LENGTH_OF_CR_LF || *i != '\r') {
+            return false;
+        }
+        i += msg::LENGTH_OF_CR_LF;
+        return true;
+    }
 
-        "ZCARD", "ZSCAN", "ZCOUNT", "ZLEXCOUNT", "ZRANGE",
-        "ZRANGEBYLEX", "ZREVRANGEBYLEX", "ZRANGEBYSCORE", "ZRANK",
-        "ZREVRANGE", "ZREVRANGEBYSCORE", "ZREVRANK", "ZSCORE",
-    });
+    bool read_bulk(Buffer::const_iterator& i, Buffer::const_iterator end,
+                   Buffer::const_iterator& bulk_begin, Buffer::const_iterator& bulk_end)
+    {
+        cerb::rint length;
+        if (!::read_length(i, end, '$', length) || end - i < length + msg::LENGTH_OF_CR_LF) {
+            return false;
+        }
+        bulk_begin = i;
+        bulk_end = i + length;
+        i = bulk_end + msg::LENGTH_OF_CR_LF;
+        return true;
+    }
 
     class ClientCommandSplitter
         : public cerb::msg::MessageSplitterBase<
@@ -990,6 +1236,9 @@ namespace {
         {
             s.last_command_is_bad = false;
             s._on_str = ClientCommandSplitter::on_string_nop;
+            if (s.last_command_readonly && ::key_read_from_master(begin, end)) {
+                s.last_command_readonly = false;
+            }
             std::for_each(begin, end, [&](byte b) { s.slot_calc.next_byte(b); });
         }
 
@@ -1001,6 +1250,8 @@ namespace {
         Iterator last_command_begin;
         KeySlotCalc slot_calc;
         bool last_command_is_bad;
+        bool last_command_readonly;
+        bool last_command_bulk;
         util::sptr<SpecialCommandParser> special_parser;
         util::sref<Client> client;
 
@@ -1014,6 +1265,8 @@ namespace {
             , _on_str(ClientCommandSplitter::on_command_head)
             , last_command_begin(i)
             , last_command_is_bad(false)
+            , last_command_readonly(false)
+            , last_command_bulk(false)
             , special_parser(nullptr)
             , client(cli)
         {}
@@ -1024,6 +1277,8 @@ namespace {
             , last_command_begin(rhs.last_command_begin)
             , slot_calc(std::move(rhs.slot_calc))
             , last_command_is_bad(rhs.last_command_is_bad)
+            , last_command_readonly(rhs.last_command_readonly)
+            , last_command_bulk(rhs.last_command_bulk)
             , special_parser(std::move(rhs.special_parser))
             , client(rhs.client)
         {}
@@ -1035,6 +1290,8 @@ namespace {
                 return false;
             }
             this->last_command_is_bad = true;
+            this->last_command_readonly = ::read_from_slave(command);
+            this->last_command_bulk = ::bulk_reply(command);
             this->_on_str = ClientCommandSplitter::on_command_key;
             return true;
         }
@@ -1061,10 +1318,13 @@ namespace {
             this->_on_str = ClientCommandSplitter::on_command_head;
             if (this->last_command_is_bad) {
                 this->client->push_command(util::mkptr(new DirectCommandGroup(
-                    client, "-ERR Unknown command or command key not specified\r\n")));
+                    client, RSP_UNKNOWN_COMMAND)));
             } else if (this->special_parser.nul()) {
-                this->client->push_command(util::mkptr(new SingleCommandGroup(
-                    client, Buffer(this->last_command_begin, i), this->slot_calc.get_slot())));
+                util::sptr<SingleCommandGroup> g(new SingleCommandGroup(
+                    client, Buffer(this->last_command_begin, i), this->slot_calc.get_slot()));
+                g->command->readonly = this->last_command_readonly;
+                g->command->bulk = this->last_command_bulk;
+                this->client->push_command(std::move(g));
             } else {
                 this->client->push_command(this->special_parser->spawn_commands(this->client, i));
                 this->special_parser.reset();
@@ -1072,6 +1332,8 @@ namespace {
             this->last_command_begin = i;
             this->slot_calc.reset();
             this->last_command_is_bad = false;
+            this->last_command_readonly = false;
+            this->last_command_bulk = false;
         }
 
         void on_array(cerb::rint size)
@@ -1118,6 +1380,51 @@ void cerb::split_client_command(Buffer& buffer, util::sref<Client> cli)
     }
 }
 
+bool cerb::parse_single_key_command(Buffer const& buffer, slot& key_slot,
+                                    bool& readonly, bool& bulk)
+{
+    Buffer::const_iterator i = buffer.cbegin();
+    Buffer::const_iterator end = buffer.cend();
+    Buffer::const_iterator bulk_begin;
+    Buffer::const_iterator bulk_end;
+    cerb::rint argc;
+    if (!::read_length(i, end, '*', argc) || argc < 2) {
+        return false;
+    }
+
+    if (!::read_bulk(i, end, bulk_begin, bulk_end)) {
+        return false;
+    }
+    FastPathCommandName const* command = ::find_fast_path_command(bulk_begin, bulk_end);
+    if (command == nullptr) {
+        return false;
+    }
+
+    if (!::read_bulk(i, end, bulk_begin, bulk_end)) {
+        return false;
+    }
+    readonly = command->readonly && !::key_read_from_master(bulk_begin, bulk_end);
+    bulk = command->bulk;
+    KeySlotCalc slot_calc;
+    std::for_each(bulk_begin, bulk_end, [&](byte b) { slot_calc.next_byte(b); });
+
+    for (cerb::rint a = 2; a < argc; ++a) {
+        if (!::read_bulk(i, end, bulk_begin, bulk_end)) {
+            return false;
+        }
+    }
+    if (i != end) {
+        return false;
+    }
+    key_slot = slot_calc.get_slot();
+    return true;
+}
+
+Server* FastPathCommand::select_server(Proxy* proxy)
+{
+    return ::select_server_for(proxy, this, this->key_slot);
+}
+
 void Command::allow_write_commands()
 {
     static std::set<std::string> const WRITE_COMMANDS({
@@ -1138,6 +1445,7 @@ void Command::allow_write_commands()
     for (std::string const& c: WRITE_COMMANDS) {
         STD_COMMANDS.insert(c);
     }
+    FAST_PATH_COMMANDS = ::index_fast_path_commands();
     static std::map<std::string, CmdCreateFn> const SPECIAL_WRITE_COMMAND(
     {
         {"DEL",
@@ -1186,3 +1494,27 @@ void Command::allow_write_commands()
         SPECIAL_RSP.insert(c);
     }
 }
+
+void Command::set_bulk_commands(std::vector<std::string> const& commands)
+{
+    BULK_COMMANDS.clear();
+    for (std::string const& c: commands) {
+        std::string cmd;
+        std::for_each(c.begin(), c.end(), [&](char b) { cmd += std::toupper(b); });
+        BULK_COMMANDS.insert(cmd);
+    }
+    FAST_PATH_COMMANDS = ::index_fast_path_commands();
+}
+
+void Command::read_from_master(std::vector<std::string> const& commands,
+                               std::vector<std::string> const& key_prefixes)
+{
+    MASTER_READ_COMMANDS.clear();
+    for (std::string const& c: commands) {
+        std::string cmd;
+        std::for_each(c.begin(), c.end(), [&](char b) { cmd += std::toupper(b); });
+        MASTER_READ_COMMANDS.insert(cmd);
+    }
+    MASTER_READ_KEY_PREFIXES = key_prefixes;
+    FAST_PATH_COMMANDS = ::index_fast_path_commands();
+}
@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "utils/pointer.h"
+#include "utils/arena.hpp"
 #include "buffer.hpp"
 
 namespace cerb {
@@ -27,18 +28,40 @@ namespace cerb {
         void responsed();
 
         Command(Buffer b, util::sref<CommandGroup> g)
-            : buffer(new Buffer(std::move(b)))
+            : buffer(std::allocate_shared<Buffer>(util::arena_allocator<Buffer>(), std::move(b)))
             , group(g)
         {}
 
         explicit Command(util::sref<CommandGroup> g)
-            : buffer(new Buffer)
+            : buffer(std::allocate_shared<Buffer>(util::arena_allocator<Buffer>()))
+            , group(g)
+        {}
+
+        Command(std::shared_ptr<Buffer> b, util::sref<CommandGroup> g)
+            : buffer(std::move(b))
             , group(g)
         {}
 
         Command(Command const&) = delete;
 
+        static void* operator new(std::size_t size)
+        {
+            return util::arena::allocate(size);
+        }
+
+        static void operator delete(void* p)
+        {
+            util::arena::release(p);
+        }
+
         static void allow_write_commands();
+
+        /* commands that tend to have large replies, sent over the bulk lane of a node */
+        static void set_bulk_commands(std::vector<std::string> const& commands);
+
+        /* reading these commands, or keys starting with these prefixes, never goes to slaves */
+        static void read_from_master(std::vector<std::string> const& commands,
+                                     std::vector<std::string> const& key_prefixes);
     };
 
     class DataCommand
@@ -47,14 +70,33 @@ namespace cerb {
     public:
         DataCommand(Buffer b, util::sref<CommandGroup> g)
             : Command(std::move(b), g)
+            , redirections(0)
+            , readonly(false)
+            , bulk(false)
+            , hedged_from(nullptr)
+            , hedged_to(nullptr)
         {}
 
         explicit DataCommand(util::sref<CommandGroup> g)
             : Command(g)
+            , redirections(0)
+            , readonly(false)
+            , bulk(false)
+            , hedged_from(nullptr)
+            , hedged_to(nullptr)
         {}
 
         Time sent_time;
         Time resp_time;
+        /* MOVED, ASK, TRYAGAIN or CLUSTERDOWN replies it got */
+        int redirections;
+        /* a reading command that a slave of the master may serve */
+        bool readonly;
+        /* its reply is expected to be large, so it goes to the bulk lane if any */
+        bool bulk;
+        /* a slow reading command is also sent to another server; the first reply wins */
+        Server* hedged_from;
+        Server* hedged_to;
 
         Interval remote_cost() const
         {
@@ -62,6 +104,20 @@ namespace cerb {
         }
     };
 
+    class FastPathCommand
+        : public DataCommand
+    {
+    public:
+        slot key_slot;
+
+        explicit FastPathCommand(util::sref<CommandGroup> g)
+            : DataCommand(g)
+            , key_slot(0)
+        {}
+
+        Server* select_server(Proxy* proxy);
+    };
+
     class CommandGroup {
     public:
         util::sref<Client> const client;
@@ -73,6 +129,17 @@ namespace cerb {
         CommandGroup(CommandGroup const&) = delete;
         virtual ~CommandGroup() = default;
 
+        /* Groups parsed from one read are released together after flushed */
+        static void* operator new(std::size_t size)
+        {
+            return util::arena::allocate(size);
+        }
+
+        static void operator delete(void* p)
+        {
+            util::arena::release(p);
+        }
+
         virtual bool long_connection() const
         {
             return false;
@@ -89,6 +156,13 @@ namespace cerb {
 
     void split_client_command(Buffer& buffer, util::sref<Client> cli);
 
+    /*
+     * Check whether the buffer holds exactly one complete single key command,
+     * without allocating; the slot of its key is stored in key_slot if so,
+     * whether a slave may serve it in readonly, and whether its reply is expected large in bulk.
+     */
+    bool parse_single_key_command(Buffer const& buffer, slot& key_slot, bool& readonly, bool& bulk);
+
 }
 
 #endif /* __CERBERUS_COMMAND_HPP__ */
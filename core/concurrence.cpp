@@ -1,28 +1,141 @@
+#include <mutex>
+#include <future>
+#include <cstring>
+#include <pthread.h>
+#include <cppformat/format.h>
+
 #include "concurrence.hpp"
 #include "globals.hpp"
+#include "server.hpp"
 #include "except/exceptions.hpp"
 #include "utils/logging.hpp"
+#include "syscalls/cio.h"
+#include "syscalls/fctl.h"
 
 using namespace cerb;
 
-ListenThread::ListenThread(int listen_port)
-    : _proxy(new Proxy(listen_port))
-    , _thread(nullptr)
+static thread_local std::shared_ptr<ControlMailbox> this_thread_mailbox;
+
+static int const RETIRED_LINGER_MS = 1000;
+static int const RETIRED_POLL_MS = 100;
+
+static void pin_this_thread(std::vector<int> const& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        CPU_SET(cpu, &set);
+    }
+    int e = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (e != 0) {
+        LOG(WARNING) << "Fail to set CPU affinity: " << strerror(e);
+    }
+}
+
+ControlMailbox::ControlMailbox(Proxy* p)
+    : Connection(fctl::new_event_fd())
+    , _proxy(p)
+    , _notified(false)
+{
+    p->poll_add_ro(this);
+}
+
+ControlMailbox::~ControlMailbox()
+{
+    ControlAction* a;
+    while (this->_actions.pop(a)) {
+        delete a;
+    }
+}
+
+void ControlMailbox::post(ControlAction action)
+{
+    this->_actions.push(new ControlAction(std::move(action)));
+    if (!this->_notified.exchange(true)) {
+        uint64_t one = 1;
+        cio::write(this->fd, &one, sizeof one);
+    }
+}
+
+void ControlMailbox::on_events(int)
+{
+    uint64_t n;
+    cio::read(this->fd, &n, sizeof n);
+    /* actions posted from now on wake the thread again */
+    this->_notified.store(false);
+    ControlAction* a;
+    while (this->_actions.pop(a)) {
+        std::unique_ptr<ControlAction> action(a);
+        (*action)(this->_proxy);
+    }
+}
+
+std::shared_ptr<ControlMailbox> ControlMailbox::of_this_thread()
+{
+    return ::this_thread_mailbox;
+}
+
+void ControlMailbox::bind_to_this_thread(std::shared_ptr<ControlMailbox> mailbox)
+{
+    ::this_thread_mailbox = std::move(mailbox);
+}
+
+std::string ControlMailbox::str() const
+{
+    return fmt::format("ControlMailbox({}@{})", this->fd, static_cast<void const*>(this));
+}
+
+ListenThread::ListenThread(int listen_port, std::vector<int> cpus)
+    : _proxy(cpus.empty() ? new Proxy(listen_port) : nullptr)
+    , _mailbox(cpus.empty() ? std::make_shared<ControlMailbox>(_proxy.operator->()) : nullptr)
     , _mem_buffer_stat(nullptr)
+    , _cpus(std::move(cpus))
+    , _retiring(false)
+    , listen_port(listen_port)
 {}
 
 void ListenThread::run()
 {
-    this->_thread.reset(new std::thread(
-        [this]()
+    std::shared_ptr<ListenThread> self(this->shared_from_this());
+    std::promise<void> built;
+    std::future<void> proxy_built(built.get_future());
+    std::thread(
+        [self, &built]()
         {
-            _mem_buffer_stat = &cerb_global::allocated_buffer;
+            try {
+                if (!self->_cpus.empty()) {
+                    ::pin_this_thread(self->_cpus);
+                    self->_proxy = util::mkptr(new Proxy(self->listen_port));
+                    self->_mailbox = std::make_shared<ControlMailbox>(self->_proxy.operator->());
+                }
+            } catch (std::runtime_error& e) {
+                LOG(ERROR) << "Fail to start thread: " << e.what();
+                exit(1);
+            }
+            built.set_value();
+            self->_mem_buffer_stat = &cerb_global::allocated_buffer;
+            ControlMailbox::bind_to_this_thread(self->_mailbox);
+            Proxy* proxy = self->_proxy.operator->();
             try {
                 poll::pevent events[poll::MAX_EVENTS];
-                while (true) {
-                    int nfds = poll::poll_wait(this->_proxy->epfd, events, poll::MAX_EVENTS, -1);
-                    this->_proxy->handle_events(events, nfds);
+                while (!proxy->drained()) {
+                    int nfds = poll::poll_wait(proxy->epfd, events, poll::MAX_EVENTS,
+                                               proxy->poll_timeout());
+                    proxy->handle_events(events, nfds);
                 }
+                cerb_global::remove_listen_thread(self.operator->());
+                LOG(INFO) << "Thread retired, stop polling in " << RETIRED_LINGER_MS << "ms";
+                /*
+                 * Threads that picked this one to hand clients over to before it
+                 * retired may still post to it; it passes them on in the meantime
+                 */
+                Time linger_end = Clock::now() + std::chrono::milliseconds(RETIRED_LINGER_MS);
+                while (Clock::now() < linger_end) {
+                    int nfds = poll::poll_wait(proxy->epfd, events, poll::MAX_EVENTS,
+                                               RETIRED_POLL_MS);
+                    proxy->handle_events(events, nfds);
+                }
+                Server::delete_all();
             } catch (SystemError& e) {
                 LOG(ERROR) << "Unexpected error";
                 LOG(ERROR) << e.stack_trace;
@@ -32,10 +145,54 @@ void ListenThread::run()
                 LOG(FATAL) << "Terminated by runtime error: " << e.what();
                 exit(1);
             }
-        }));
+            ControlMailbox::bind_to_this_thread(nullptr);
+            self->_mem_buffer_stat = nullptr;
+        }).detach();
+    proxy_built.wait();
 }
 
-void ListenThread::join()
+void ListenThread::retire()
+{
+    if (this->_retiring.exchange(true)) {
+        return;
+    }
+    Interval drain_timeout(cerb_global::thread_drain_timeout);
+    this->post(
+        [drain_timeout](Proxy* p)
+        {
+            p->retire(drain_timeout);
+        });
+}
+
+static std::mutex scaling_mutex;
+
+bool cerb::scale_listen_threads(int count)
 {
-    this->_thread->join();
+    std::lock_guard<std::mutex> _(::scaling_mutex);
+    std::vector<std::shared_ptr<ListenThread>> live;
+    for (auto const& t: cerb_global::listen_threads()) {
+        /* the CPUs and the reuseport program are set for the threads started with */
+        if (!t->cpus().empty()) {
+            return false;
+        }
+        if (!t->retiring()) {
+            live.push_back(t);
+        }
+    }
+    if (live.empty()) {
+        return false;
+    }
+    int listen_port = live[0]->listen_port;
+    for (int i = int(live.size()); i < count; ++i) {
+        /* like at startup, it accepts after the warm up, if one is configured */
+        std::shared_ptr<ListenThread> t(std::make_shared<ListenThread>(listen_port));
+        cerb_global::add_listen_thread(t);
+        t->run();
+    }
+    /* retired after new ones are added, so there is always a thread to hand clients over to */
+    for (int i = count; i < int(live.size()); ++i) {
+        live[i]->retire();
+    }
+    LOG(INFO) << "Scale listen threads from " << live.size() << " to " << count;
+    return true;
 }
@@ -1,30 +1,94 @@
 #ifndef __CERBERUS_CONCURRENCE_HPP__
 #define __CERBERUS_CONCURRENCE_HPP__
 
+#include <atomic>
+#include <memory>
 #include <thread>
+#include <vector>
+#include <functional>
 
 #include "common.hpp"
 #include "proxy.hpp"
 #include "utils/pointer.h"
+#include "utils/mpsc_queue.hpp"
 
 namespace cerb {
 
-    class ListenThread {
+    typedef std::function<void(Proxy*)> ControlAction;
+
+    /*
+     * Actions other threads post to a listen thread, run by the thread
+     * itself once the eventfd in its poll is written
+     */
+    class ControlMailbox
+        : public Connection
+    {
+        Proxy* const _proxy;
+        util::mpsc_queue<ControlAction*> _actions;
+        std::atomic<bool> _notified;
+    public:
+        explicit ControlMailbox(Proxy* p);
+        ~ControlMailbox();
+
+        void post(ControlAction action);
+
+        /* the mailbox of the listen thread calling this, or nullptr */
+        static std::shared_ptr<ControlMailbox> of_this_thread();
+        static void bind_to_this_thread(std::shared_ptr<ControlMailbox> mailbox);
+
+        void on_events(int events);
+        void on_error() {}
+        std::string str() const;
+    };
+
+    class ListenThread
+        : public std::enable_shared_from_this<ListenThread>
+    {
         util::sptr<Proxy> _proxy;
-        util::sptr<std::thread> _thread;
-        msize_t const* _mem_buffer_stat;
+        /* shared with background jobs, which may post to it after the thread retires */
+        std::shared_ptr<ControlMailbox> _mailbox;
+        std::atomic<msize_t const*> _mem_buffer_stat;
+        /* CPUs the thread runs on, any if empty */
+        std::vector<int> _cpus;
+        std::atomic<bool> _retiring;
     public:
-        explicit ListenThread(int listen_port);
-        ListenThread(ListenThread const&) = delete;
+        int const listen_port;
 
-        ListenThread(ListenThread&& rhs)
-            : _proxy(std::move(rhs._proxy))
-            , _thread(std::move(rhs._thread))
-            , _mem_buffer_stat(rhs._mem_buffer_stat)
-        {}
+        /*
+         * A thread pinned to CPUs builds its proxy on run, after pinned, so
+         * that the slot map and buffers are allocated on the local NUMA node
+         */
+        explicit ListenThread(int listen_port, std::vector<int> cpus = std::vector<int>());
+        ListenThread(ListenThread const&) = delete;
 
+        /*
+         * Returns once the proxy is built. The thread keeps itself alive until
+         * it is retired and drained; then it leaves the list of threads and
+         * exits on its own
+         */
         void run();
-        void join();
+
+        /*
+         * Stop accepting, hand idle clients over to the other threads, and
+         * close those still busy after the drain timeout
+         */
+        void retire();
+
+        bool retiring() const
+        {
+            return this->_retiring.load();
+        }
+
+        std::vector<int> const& cpus() const
+        {
+            return this->_cpus;
+        }
+
+        /* thread safe; the action runs on this thread in its next poll */
+        void post(ControlAction action)
+        {
+            this->_mailbox->post(std::move(action));
+        }
 
         util::sref<Proxy const> get_proxy() const
         {
@@ -38,10 +102,17 @@ namespace cerb {
 
         msize_t buffer_allocated() const
         {
-            return *_mem_buffer_stat;
+            msize_t const* stat = this->_mem_buffer_stat.load();
+            return stat == nullptr ? 0 : *stat;
         }
     };
 
+    /*
+     * Start or retire listen threads until count of them are not retiring;
+     * false if it is not allowed, as threads are pinned to CPUs
+     */
+    bool scale_listen_threads(int count);
+
 }
 
 #endif /* __CERBERUS_CONCURRENCE_HPP__ */
@@ -2,6 +2,19 @@
 
 using namespace cerb;
 
+void ConnectionLink::unlink()
+{
+    if (!this->linked()) {
+        return;
+    }
+    *this->pprev = this->next;
+    if (this->next != nullptr) {
+        this->next->pprev = this->pprev;
+    }
+    this->next = nullptr;
+    this->pprev = nullptr;
+}
+
 void ProxyConnection::on_error()
 {
     this->close();
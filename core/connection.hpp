@@ -1,29 +1,136 @@
 #ifndef __CERBERUS_CONNECTION_HPP__
 #define __CERBERUS_CONNECTION_HPP__
 
-#include <set>
 #include <string>
 
 #include "fdutil.hpp"
 
 namespace cerb {
 
+    class Connection;
+
+    /* Link of a connection in a ConnectionList; unlinked when the connection is destroyed */
+    struct ConnectionLink {
+        Connection* const owner;
+        ConnectionLink* next;
+        ConnectionLink** pprev;
+
+        explicit ConnectionLink(Connection* c)
+            : owner(c)
+            , next(nullptr)
+            , pprev(nullptr)
+        {}
+
+        ConnectionLink(ConnectionLink const&) = delete;
+
+        bool linked() const
+        {
+            return this->pprev != nullptr;
+        }
+
+        void unlink();
+    };
+
+    /*
+     * Intrusive list of connections touched in one event loop pass.
+     * Pushing a connection already linked is a no-op, so it is both a
+     * list and a set, and it never allocates.
+     */
+    template <ConnectionLink Connection::*Link>
+    class ConnectionList {
+        ConnectionLink* _head;
+    public:
+        ConnectionList()
+            : _head(nullptr)
+        {}
+
+        ConnectionList(ConnectionList const&) = delete;
+
+        ~ConnectionList()
+        {
+            while (this->pop() != nullptr)
+                ;
+        }
+
+        bool empty() const
+        {
+            return this->_head == nullptr;
+        }
+
+        void push(Connection* conn);
+        Connection* pop();
+    };
+
     class Connection
         : public FDWrapper
     {
     public:
+        enum PollInterest {
+            POLL_NONE,
+            POLL_RO,
+            POLL_RW
+        };
+
         explicit Connection(int fd)
             : FDWrapper(fd)
+            , poll_interest(POLL_NONE)
+            , write_wanted(false)
+            , closed_generation(0)
+            , active_link(this)
+            , dirty_link(this)
         {}
 
-        virtual ~Connection() {}
+        virtual ~Connection()
+        {
+            this->active_link.unlink();
+            this->dirty_link.unlink();
+        }
 
         virtual void on_events(int events) = 0;
-        virtual void after_events(std::set<Connection*>&) {}
+        virtual void after_events() {}
         virtual void on_error() = 0;
         virtual std::string str() const = 0;
+
+        /* what is registered in epoll now, so that unchanged interests cost no syscall */
+        PollInterest poll_interest;
+        /* whether any handler asked for writable events while it is in the dirty list */
+        bool write_wanted;
+        /* the event loop pass in which it was closed, whose later events are skipped */
+        unsigned long closed_generation;
+
+        ConnectionLink active_link;
+        ConnectionLink dirty_link;
     };
 
+    typedef ConnectionList<&Connection::active_link> ActiveConnections;
+    typedef ConnectionList<&Connection::dirty_link> DirtyConnections;
+
+    template <ConnectionLink Connection::*Link>
+    void ConnectionList<Link>::push(Connection* conn)
+    {
+        ConnectionLink& link = conn->*Link;
+        if (link.linked()) {
+            return;
+        }
+        link.next = this->_head;
+        link.pprev = &this->_head;
+        if (this->_head != nullptr) {
+            this->_head->pprev = &link.next;
+        }
+        this->_head = &link;
+    }
+
+    template <ConnectionLink Connection::*Link>
+    Connection* ConnectionList<Link>::pop()
+    {
+        if (this->_head == nullptr) {
+            return nullptr;
+        }
+        Connection* conn = this->_head->owner;
+        this->_head->unlink();
+        return conn;
+    }
+
     class ProxyConnection
         : public Connection
     {
@@ -32,7 +139,7 @@ namespace cerb {
             : Connection(fd)
         {}
 
-        void after_events(std::set<Connection*>& conns) = 0;
+        void after_events() = 0;
         void on_error();
     };
 
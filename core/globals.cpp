@@ -1,13 +1,54 @@
 #include <atomic>
 #include <mutex>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
 
 #include "globals.hpp"
+#include "slot_map.hpp"
+#include "utils/random.hpp"
+#include "utils/logging.hpp"
 
-std::vector<cerb::ListenThread> cerb_global::all_threads;
 thread_local cerb::msize_t cerb_global::allocated_buffer(0);
 
 thread_local cerb::Time cerb_global::poll_start;
 cerb::Interval cerb_global::slow_poll_elapse;
+cerb::Interval cerb_global::warm_up_timeout(0);
+cerb::Interval cerb_global::replication_probe_interval(0);
+long cerb_global::replica_max_lag_bytes(0);
+long cerb_global::replica_max_lag_seconds(0);
+double cerb_global::hedge_read_budget(0);
+cerb::Interval cerb_global::hedge_min_delay(0);
+bool cerb_global::balance_threads(false);
+cerb::Interval cerb_global::thread_drain_timeout(0);
+int cerb_global::unix_listen_fd(-1);
+
+static std::mutex listen_threads_mutex;
+static std::vector<std::shared_ptr<cerb::ListenThread>> listen_threads;
+
+std::vector<std::shared_ptr<cerb::ListenThread>> cerb_global::listen_threads()
+{
+    std::lock_guard<std::mutex> _(::listen_threads_mutex);
+    return ::listen_threads;
+}
+
+void cerb_global::add_listen_thread(std::shared_ptr<cerb::ListenThread> t)
+{
+    std::lock_guard<std::mutex> _(::listen_threads_mutex);
+    ::listen_threads.push_back(std::move(t));
+}
+
+void cerb_global::remove_listen_thread(cerb::ListenThread const* t)
+{
+    std::lock_guard<std::mutex> _(::listen_threads_mutex);
+    ::listen_threads.erase(std::remove_if(
+        ::listen_threads.begin(), ::listen_threads.end(),
+        [t](std::shared_ptr<cerb::ListenThread> const& x)
+        {
+            return x.get() == t;
+        }), ::listen_threads.end());
+}
 
 static std::mutex remote_addrs_mutex;
 static std::set<util::Address> remote_addrs;
@@ -46,3 +87,204 @@ bool cerb_global::cluster_ok()
 {
     return ::cluster_ok;
 }
+
+static std::atomic_bool slot_map_updating(false);
+static std::atomic<unsigned long> slot_map_version(0);
+static std::shared_ptr<cerb::SlotMapSnapshot const> slot_map;
+
+bool cerb_global::acquire_slot_map_updating()
+{
+    return !::slot_map_updating.exchange(true);
+}
+
+void cerb_global::release_slot_map_updating()
+{
+    ::slot_map_updating = false;
+}
+
+static std::string slot_map_file;
+static std::mutex slot_map_file_mutex;
+static unsigned long saved_slot_map_version(0);
+
+bool cerb_global::saves_slot_map()
+{
+    return !::slot_map_file.empty();
+}
+
+void cerb_global::save_slot_map(std::vector<cerb::RedisNode> const& nodes, unsigned long version)
+{
+    /* saves may run on several workers, a late one never overwrites a newer map */
+    std::lock_guard<std::mutex> _(::slot_map_file_mutex);
+    if (version <= ::saved_slot_map_version) {
+        return;
+    }
+    ::saved_slot_map_version = version;
+    /* written aside then renamed, so a crash never leaves half a file */
+    std::string tmp_path(::slot_map_file + ".tmp");
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out << cerb::encode_slot_map(nodes);
+        if (!out.good()) {
+            LOG(ERROR) << "Fail to save slot map to " << tmp_path;
+            return;
+        }
+    }
+    if (::rename(tmp_path.data(), ::slot_map_file.data()) != 0) {
+        LOG(ERROR) << "Fail to save slot map to " << ::slot_map_file;
+    }
+}
+
+static unsigned long publish_snapshot(std::vector<cerb::RedisNode> nodes, bool ok, bool unverified)
+{
+    unsigned long version = ::slot_map_version + 1;
+    std::atomic_store(&::slot_map, std::shared_ptr<cerb::SlotMapSnapshot const>(
+        new cerb::SlotMapSnapshot(version, ok, unverified, std::move(nodes))));
+    ::slot_map_version = version;
+    return version;
+}
+
+unsigned long cerb_global::publish_slot_map(std::vector<cerb::RedisNode> nodes, bool ok)
+{
+    return ::publish_snapshot(std::move(nodes), ok, false);
+}
+
+bool cerb_global::load_slot_map(std::string const& data, std::string const& origin)
+{
+    std::vector<cerb::RedisNode> nodes;
+    try {
+        nodes = cerb::decode_slot_map(data);
+    } catch (std::runtime_error& e) {
+        LOG(ERROR) << "Discard slot map " << origin << " because " << e.what();
+        return false;
+    }
+    if (nodes.empty()) {
+        return false;
+    }
+    std::set<util::Address> remotes(cerb_global::get_remotes());
+    for (cerb::RedisNode const& node: nodes) {
+        remotes.insert(node.addr);
+    }
+    cerb_global::set_remotes(std::move(remotes));
+    cerb_global::set_cluster_ok(true);
+    ::publish_snapshot(std::move(nodes), true, true);
+    return true;
+}
+
+bool cerb_global::load_slot_map_file(std::string const& path)
+{
+    ::slot_map_file = path;
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) {
+        LOG(INFO) << "No slot map saved in " << path;
+        return false;
+    }
+    std::stringstream data;
+    data << in.rdbuf();
+    return cerb_global::load_slot_map(data.str(), "saved in " + path);
+}
+
+unsigned long cerb_global::slot_map_version()
+{
+    return ::slot_map_version;
+}
+
+std::shared_ptr<cerb::SlotMapSnapshot const> cerb_global::latest_slot_map()
+{
+    return std::atomic_load(&::slot_map);
+}
+
+/* interval and jitter are set before threads start; the digest is only touched by the prober */
+static cerb::Interval topology_probe_interval(0);
+static cerb::Interval topology_probe_jitter(0);
+static std::atomic<cerb::Clock::rep> next_topology_probe(0);
+static std::atomic_bool topology_probing(false);
+static std::size_t topology_digest(0);
+
+static void schedule_topology_probe(cerb::Time now, cerb::Interval wait)
+{
+    ::next_topology_probe = (now + std::chrono::duration_cast<cerb::Clock::duration>(wait))
+        .time_since_epoch().count();
+}
+
+void cerb_global::set_topology_probe(cerb::Interval interval, cerb::Interval jitter)
+{
+    ::topology_probe_interval = interval;
+    ::topology_probe_jitter = jitter;
+    ::schedule_topology_probe(cerb::Clock::now(), interval);
+}
+
+bool cerb_global::acquire_topology_probe(cerb::Time now)
+{
+    if (::topology_probe_interval.count() <= 0 ||
+        now.time_since_epoch().count() < ::next_topology_probe) {
+        return false;
+    }
+    if (::topology_probing.exchange(true)) {
+        return false;
+    }
+    /* another thread may have finished a probe just before */
+    if (now.time_since_epoch().count() < ::next_topology_probe) {
+        ::topology_probing = false;
+        return false;
+    }
+    return true;
+}
+
+bool cerb_global::finish_topology_probe(cerb::Time now, std::size_t digest,
+                                        bool master_failing)
+{
+    /* look closer while a master is failing, so its replica is used once promoted */
+    cerb::Interval wait(master_failing ? ::topology_probe_interval / 4
+                                       : ::topology_probe_interval);
+    wait += ::topology_probe_jitter * (util::randint(0, 1000) / 1000.0);
+    ::schedule_topology_probe(now, wait);
+    /* the first probe only learns the topology the slot map was loaded with */
+    bool changed = digest != 0 && ::topology_digest != 0 && digest != ::topology_digest;
+    if (digest != 0) {
+        ::topology_digest = digest;
+    }
+    ::topology_probing = false;
+    return changed;
+}
+
+int cerb_global::topology_probe_wait_ms()
+{
+    if (::topology_probe_interval.count() <= 0 || ::topology_probing) {
+        return -1;
+    }
+    cerb::Clock::duration wait(
+        ::next_topology_probe - cerb::Clock::now().time_since_epoch().count());
+    if (wait.count() <= 0) {
+        return 0;
+    }
+    return int(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count()) + 1;
+}
+
+static std::mutex replica_lags_mutex;
+static std::map<util::Address, cerb::ReplicaLag> replica_lags;
+
+void cerb_global::set_replica_lags(util::Address const& master, std::vector<cerb::ReplicaLag> lags)
+{
+    std::lock_guard<std::mutex> _(::replica_lags_mutex);
+    for (auto i = ::replica_lags.begin(); i != ::replica_lags.end();) {
+        if (i->second.master == master) {
+            i = ::replica_lags.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    for (cerb::ReplicaLag& g: lags) {
+        util::Address a(g.addr);
+        ::replica_lags.insert(std::make_pair(std::move(a), std::move(g)));
+    }
+}
+
+std::vector<cerb::ReplicaLag> cerb_global::replica_lags()
+{
+    std::lock_guard<std::mutex> _(::replica_lags_mutex);
+    std::vector<cerb::ReplicaLag> lags;
+    for (auto const& g: ::replica_lags) {
+        lags.push_back(g.second);
+    }
+    return lags;
+}
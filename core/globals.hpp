@@ -3,6 +3,7 @@
 
 #include <set>
 #include <vector>
+#include <memory>
 
 #include "common.hpp"
 #include "concurrence.hpp"
@@ -11,11 +12,32 @@
 
 namespace cerb_global {
 
-    extern std::vector<cerb::ListenThread> all_threads;
+    /* Threads are added and retired while running, so the others get a copy of the list */
+    std::vector<std::shared_ptr<cerb::ListenThread>> listen_threads();
+    void add_listen_thread(std::shared_ptr<cerb::ListenThread> t);
+    void remove_listen_thread(cerb::ListenThread const* t);
+
     extern thread_local cerb::msize_t allocated_buffer;
 
     extern thread_local cerb::Time poll_start;
     extern cerb::Interval slow_poll_elapse;
+    /* how long a new proxy waits for the slot map and backend connections before accepting */
+    extern cerb::Interval warm_up_timeout;
+    /* how often each thread asks masters for INFO replication, zero to turn off */
+    extern cerb::Interval replication_probe_interval;
+    /* slaves lagging more than these are not read from; zero for no limit */
+    extern long replica_max_lag_bytes;
+    extern long replica_max_lag_seconds;
+    /* extra reading commands hedged, as a ratio of the reading commands responded; zero to turn off */
+    extern double hedge_read_budget;
+    /* a reading command is not hedged before this long even if its server responses faster */
+    extern cerb::Interval hedge_min_delay;
+    /* threads much busier than the average hand clients over to the least busy one */
+    extern bool balance_threads;
+    /* how long a retiring thread waits for its busy clients before closing them */
+    extern cerb::Interval thread_drain_timeout;
+    /* the unix socket listened to along with or instead of the TCP port, -1 if none */
+    extern int unix_listen_fd;
 
     void set_remotes(std::set<util::Address> remotes);
     std::set<util::Address> get_remotes();
@@ -26,6 +48,39 @@ namespace cerb_global {
     void set_cluster_ok(bool ok);
     bool cluster_ok();
 
+    /* Only one thread at a time fetches the topology, the others wait for its result */
+    bool acquire_slot_map_updating();
+    void release_slot_map_updating();
+
+    unsigned long publish_slot_map(std::vector<cerb::RedisNode> nodes, bool ok);
+    /*
+     * Each good slot map published is saved to the file, and the one saved
+     * by the last run is published unverified at startup; returns whether it is loaded
+     */
+    bool load_slot_map_file(std::string const& path);
+    bool saves_slot_map();
+    /* blocks on the file, so not called on the event loop; a map older than the saved one is skipped */
+    void save_slot_map(std::vector<cerb::RedisNode> const& nodes, unsigned long version);
+    /* publish a slot map in the form saved to the file, unverified like the one loaded from it */
+    bool load_slot_map(std::string const& data, std::string const& origin);
+    unsigned long slot_map_version();
+    std::shared_ptr<cerb::SlotMapSnapshot const> latest_slot_map();
+
+    /* Latest lag of the slaves of a master, shown in PROXY command output */
+    void set_replica_lags(util::Address const& master, std::vector<cerb::ReplicaLag> lags);
+    std::vector<cerb::ReplicaLag> replica_lags();
+
+    /* Periodic topology probe run by one thread at a time; a zero interval turns it off */
+    void set_topology_probe(cerb::Interval interval, cerb::Interval jitter);
+    bool acquire_topology_probe(cerb::Time now);
+    /*
+     * returns whether the topology changed since the last probe, the first
+     * one never counts as a change; digest 0 means the probe failed
+     */
+    bool finish_topology_probe(cerb::Time now, std::size_t digest, bool master_failing);
+    /* milliseconds before the next probe is due, -1 if none is to be run by this thread */
+    int topology_probe_wait_ms();
+
 }
 
 #endif /* __CERBERUS_GLOBALS_HPP__ */
@@ -0,0 +1,385 @@
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handoff.hpp"
+#include "globals.hpp"
+#include "except/exceptions.hpp"
+#include "utils/logging.hpp"
+#include "syscalls/cio.h"
+
+using namespace cerb;
+
+/*
+ * Records over the SOCK_SEQPACKET connection are:
+ *   old -> new: L (a listening socket) ..., U (the unix socket), m ... M (slot map)
+ *   new -> old: R (threads ready)
+ *   old -> new: b ... C (a client with what it sent but not parsed) ..., E
+ */
+static std::size_t const RECORD_PAYLOAD = 32768;
+static int const HANDOFF_POLL_MS = 100;
+static int const READY_CHECK_MS = 10;
+/* threads retired linger about a second to pass on clients posted to them */
+static int const HANDOFF_LINGER_MS = 1500;
+
+namespace {
+
+    struct HandedClient {
+        int fd;
+        std::string buffered;
+    };
+
+}
+
+static std::mutex inherited_mutex;
+/* in the order the old process listed its threads, which is their index in the reuseport group */
+static std::deque<int> inherited;
+
+static std::atomic<bool> handoff_active(false);
+static bool handoff_clients(false);
+static std::mutex handed_mutex;
+static std::condition_variable handed_cond;
+static std::vector<HandedClient> handed_clients;
+
+static sockaddr_un unix_addr(std::string const& path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        throw SystemError("handoff socket path too long: " + path, ENAMETOOLONG);
+    }
+    std::strcpy(addr.sun_path, path.data());
+    return addr;
+}
+
+void cerb::send_handoff_record(int conn, char type, std::string const& payload, int fd)
+{
+    std::string data(1, type);
+    data += payload;
+    iovec iov = {&data[0], data.size()};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (::sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+        throw IOError("handoff send", errno);
+    }
+}
+
+void cerb::send_handoff_data(int conn, char more, char last, std::string const& data, int fd)
+{
+    std::size_t i = 0;
+    for (; data.size() - i > RECORD_PAYLOAD; i += RECORD_PAYLOAD) {
+        cerb::send_handoff_record(conn, more, data.substr(i, RECORD_PAYLOAD), -1);
+    }
+    cerb::send_handoff_record(conn, last, data.substr(i), fd);
+}
+
+HandoffRecord cerb::recv_handoff_record(int conn)
+{
+    char buffer[RECORD_PAYLOAD + 1];
+    iovec iov = {buffer, sizeof buffer};
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    std::memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    ssize_t n;
+    while ((n = ::recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) {
+        throw IOError("handoff recv", errno);
+    }
+    HandoffRecord r{'\0', std::string(), -1};
+    if (n == 0) {
+        return r;
+    }
+    r.type = buffer[0];
+    r.payload.assign(buffer + 1, buffer + n);
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&r.fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return r;
+}
+
+HandoffRecord cerb::recv_handoff_data(int conn, char more)
+{
+    std::string data;
+    while (true) {
+        HandoffRecord r(cerb::recv_handoff_record(conn));
+        if (r.type != more) {
+            r.payload = data + r.payload;
+            return r;
+        }
+        data += r.payload;
+    }
+}
+
+bool cerb::handoff_peer_trusted(int conn)
+{
+    ucred cred;
+    socklen_t len = sizeof cred;
+    if (::getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        LOG(ERROR) << "Fail to get handoff peer credentials: " << strerror(errno);
+        return false;
+    }
+    return cred.uid == ::geteuid();
+}
+
+int cerb::take_over(std::string const& path)
+{
+    int conn = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        throw SystemError("handoff socket", errno);
+    }
+    sockaddr_un addr(::unix_addr(path));
+    if (::connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+        LOG(INFO) << "No process to take over at " << path;
+        cio::close(conn);
+        return -1;
+    }
+    /* its listening sockets and slot map are used as they come */
+    if (!cerb::handoff_peer_trusted(conn)) {
+        LOG(ERROR) << "Refuse to take over from " << path << " served by another user";
+        cio::close(conn);
+        return -1;
+    }
+    std::string map;
+    try {
+        while (true) {
+            HandoffRecord r(cerb::recv_handoff_record(conn));
+            if (r.type == 'L' && r.fd != -1) {
+                std::lock_guard<std::mutex> _(::inherited_mutex);
+                ::inherited.push_back(r.fd);
+            } else if (r.type == 'U' && r.fd != -1) {
+                /* the file at the unix socket path stays bound to it */
+                cerb_global::unix_listen_fd = r.fd;
+            } else if (r.type == 'm') {
+                map += r.payload;
+            } else if (r.type == 'M') {
+                map += r.payload;
+                break;
+            } else {
+                throw IOError("handoff recv", EPROTO);
+            }
+        }
+    } catch (IOErrorBase& e) {
+        LOG(ERROR) << "Fail to take over from " << path << " because " << e.what();
+        cio::close(conn);
+        return -1;
+    }
+    if (!map.empty() && cerb_global::load_slot_map(map, "handed over")) {
+        LOG(INFO) << "Route by slot map handed over until it is verified";
+    }
+    LOG(INFO) << "Take over " << cerb::inherited_listeners() << " listening sockets from " << path;
+    return conn;
+}
+
+int cerb::inherited_listeners()
+{
+    std::lock_guard<std::mutex> _(::inherited_mutex);
+    return int(::inherited.size());
+}
+
+int cerb::take_inherited_listener()
+{
+    std::lock_guard<std::mutex> _(::inherited_mutex);
+    if (::inherited.empty()) {
+        return -1;
+    }
+    int fd = ::inherited.front();
+    ::inherited.pop_front();
+    return fd;
+}
+
+static bool all_threads_ready()
+{
+    for (auto const& t: cerb_global::listen_threads()) {
+        if (!t->get_proxy()->ready()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cerb::finish_take_over(int conn)
+{
+    /* the old process keeps serving until the threads here accept */
+    while (!::all_threads_ready()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(READY_CHECK_MS));
+    }
+    long adopted = 0;
+    try {
+        cerb::send_handoff_record(conn, 'R', "", -1);
+        while (true) {
+            HandoffRecord r(cerb::recv_handoff_data(conn, 'b'));
+            if (r.type != 'C') {
+                break;
+            }
+            std::string buffered(std::move(r.payload));
+            std::vector<std::shared_ptr<ListenThread>> threads(cerb_global::listen_threads());
+            if (r.fd != -1 && !threads.empty()) {
+                int client_fd = r.fd;
+                threads[adopted++ % long(threads.size())]->post(
+                    [client_fd, buffered](Proxy* p)
+                    {
+                        p->adopt_client(client_fd, buffered);
+                    });
+            }
+        }
+    } catch (IOErrorBase& e) {
+        LOG(ERROR) << "Handoff interrupted because " << e.what();
+    }
+    cio::close(conn);
+    LOG(INFO) << "Took over, " << adopted << " clients handed over";
+}
+
+bool cerb::handing_off()
+{
+    return ::handoff_active.load();
+}
+
+bool cerb::hand_off_client(int client_fd, std::string const& buffered)
+{
+    std::lock_guard<std::mutex> _(::handed_mutex);
+    if (!::handoff_active || !::handoff_clients) {
+        return false;
+    }
+    ::handed_clients.push_back(HandedClient{client_fd, buffered});
+    ::handed_cond.notify_one();
+    return true;
+}
+
+/* returns false once the process taking over is gone, after which the clients are closed */
+static bool send_handed_clients(int conn, bool connected)
+{
+    std::vector<HandedClient> clients;
+    {
+        std::unique_lock<std::mutex> lock(::handed_mutex);
+        ::handed_cond.wait_for(lock, std::chrono::milliseconds(HANDOFF_POLL_MS),
+                               []() { return !::handed_clients.empty(); });
+        clients.swap(::handed_clients);
+    }
+    for (HandedClient const& c: clients) {
+        if (connected) {
+            try {
+                cerb::send_handoff_data(conn, 'b', 'C', c.buffered, c.fd);
+            } catch (IOErrorBase& e) {
+                LOG(ERROR) << "Stop handing clients over because " << e.what();
+                connected = false;
+            }
+        }
+        cio::close(c.fd);
+    }
+    return connected;
+}
+
+static bool hand_over(int conn)
+{
+    for (auto const& t: cerb_global::listen_threads()) {
+        int fd = t->get_proxy()->acceptor.fd;
+        if (fd != -1) {
+            cerb::send_handoff_record(conn, 'L', "", fd);
+        }
+    }
+    if (cerb_global::unix_listen_fd != -1) {
+        cerb::send_handoff_record(conn, 'U', "", cerb_global::unix_listen_fd);
+    }
+    std::shared_ptr<SlotMapSnapshot const> map(cerb_global::latest_slot_map());
+    cerb::send_handoff_data(conn, 'm', 'M', map == nullptr ? "" : encode_slot_map(map->nodes), -1);
+    if (cerb::recv_handoff_record(conn).type != 'R') {
+        LOG(WARNING) << "Process taking over quit before it was ready";
+        return false;
+    }
+
+    LOG(INFO) << "Hand over to the new process; retire all threads";
+    ::handoff_active = true;
+    for (auto const& t: cerb_global::listen_threads()) {
+        t->retire();
+    }
+    bool connected = true;
+    while (!cerb_global::listen_threads().empty()) {
+        connected = ::send_handed_clients(conn, connected);
+    }
+    Time linger_end = Clock::now() + std::chrono::milliseconds(HANDOFF_LINGER_MS);
+    while (Clock::now() < linger_end) {
+        connected = ::send_handed_clients(conn, connected);
+    }
+    if (connected) {
+        cerb::send_handoff_record(conn, 'E', "", -1);
+    }
+    return true;
+}
+
+void cerb::serve_handoff(std::string const& path, bool hand_off_clients)
+{
+    ::handoff_clients = hand_off_clients;
+    int lfd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        throw SystemError("handoff socket", errno);
+    }
+    sockaddr_un addr(::unix_addr(path));
+    /* left by the process this one took over from, or by a crashed one */
+    ::unlink(path.data());
+    if (::bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+        throw SystemError("bind " + path, errno);
+    }
+    /* whoever connects takes the listening sockets, so only the same user may */
+    if (::chmod(path.data(), 0600) < 0) {
+        throw SystemError("chmod " + path, errno);
+    }
+    ::listen(lfd, 1);
+    LOG(INFO) << "Serve handoff at " << path;
+    while (true) {
+        int conn = ::accept(lfd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw SystemError("handoff accept", errno);
+        }
+        if (!cerb::handoff_peer_trusted(conn)) {
+            LOG(ERROR) << "Refuse handoff to a process of another user";
+            cio::close(conn);
+            continue;
+        }
+        LOG(INFO) << "A new process is taking over";
+        try {
+            if (::hand_over(conn)) {
+                LOG(INFO) << "Handed over; exit";
+                /* without static destructors, which would wait for threads blocking on them */
+                ::_exit(0);
+            }
+        } catch (IOErrorBase& e) {
+            LOG(ERROR) << "Handoff failed because " << e.what();
+            if (::handoff_active) {
+                /* threads are retired already, so the old process is done anyway */
+                ::_exit(1);
+            }
+        }
+        cio::close(conn);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __CERBERUS_HANDOFF_HPP__
+#define __CERBERUS_HANDOFF_HPP__
+
+#include <string>
+
+namespace cerb {
+
+    /*
+     * A process started with the handoff socket path of a running one takes
+     * over its listening sockets and slot map, and optionally its idle
+     * clients, through SCM_RIGHTS on that unix socket. The old process keeps
+     * serving until the new one is ready, then retires all its threads and
+     * exits once they are drained.
+     */
+
+    /*
+     * Connect to the process serving path and take its listening sockets
+     * and slot map; returns the connection, or -1 if no process serves it
+     */
+    int take_over(std::string const& path);
+    /* count of the listening sockets taken over and not yet used by an acceptor */
+    int inherited_listeners();
+    /*
+     * a listening socket taken over, in the order they are received, so that
+     * thread i takes the socket of index i in the reuseport group, to which
+     * connections are steered by CPU; -1 if there is none left
+     */
+    int take_inherited_listener();
+    /* Tell the old process the threads are ready, and adopt the clients it hands over until it exits */
+    void finish_take_over(int conn);
+
+    /* Serve the next process taking over at path; never returns, and exits once handed over */
+    void serve_handoff(std::string const& path, bool hand_off_clients);
+    /* whether the listening sockets are shared with the process taking over */
+    bool handing_off();
+    /* Send the client to the process taking over; false if no handoff is ongoing or clients are not handed off */
+    bool hand_off_client(int client_fd, std::string const& buffered);
+
+    /*
+     * Framing over the handoff connection. Each record is a type byte, then
+     * its payload, carrying at most one fd
+     */
+    struct HandoffRecord {
+        char type;
+        std::string payload;
+        int fd;
+    };
+
+    void send_handoff_record(int conn, char type, std::string const& payload, int fd);
+    /* Send data longer than a record as parts of the "more" type before the last one */
+    void send_handoff_data(int conn, char more, char last, std::string const& data, int fd);
+    /* type 0 if the peer closed the connection */
+    HandoffRecord recv_handoff_record(int conn);
+    /* Join the parts of the "more" type to the record after them */
+    HandoffRecord recv_handoff_data(int conn, char more);
+    /* whether the peer of the unix socket runs as the same user as this process */
+    bool handoff_peer_trusted(int conn);
+
+}
+
+#endif /* __CERBERUS_HANDOFF_HPP__ */
@@ -1,3 +1,5 @@
+#include <mutex>
+#include <algorithm>
 #include <cppformat/format.h>
 
 #include "proxy.hpp"
@@ -5,16 +7,34 @@
 #include "client.hpp"
 #include "response.hpp"
 #include "globals.hpp"
+#include "background.hpp"
+#include "handoff.hpp"
 #include "except/exceptions.hpp"
 #include "utils/string.h"
 #include "utils/alg.hpp"
 #include "utils/logging.hpp"
+#include "utils/random.hpp"
 #include "syscalls/poll.h"
 #include "syscalls/cio.h"
 #include "syscalls/fctl.h"
 
 using namespace cerb;
 
+/* Nodes asked for the topology at once; the next ones are tried only if all of them fail */
+static int const MAX_SLOT_UPDATERS = 3;
+static int const TRYAGAIN_DELAY_MS = 5;
+/* How often a warming up proxy checks whether it is timed out */
+static int const WARM_UP_CHECK_MS = 10;
+/* How often reading commands awaiting response are checked for hedging */
+static int const HEDGE_CHECK_MS = 1;
+/* Load of a thread is measured over this long */
+static int const LOAD_WINDOW_MS = 500;
+/* A thread sheds clients if busy for this permille of time and more than the average by the margin */
+static int const SHED_MIN_LOAD = 300;
+static int const SHED_MARGIN_PERCENT = 25;
+/* Idle clients moved to another thread per load window; new clients are all moved */
+static int const MIGRATIONS_PER_WINDOW = 16;
+
 SlotsMapUpdater::SlotsMapUpdater(util::Address a, Proxy* p)
     : Connection(fctl::new_stream_socket())
     , _proxy(p)
@@ -46,11 +66,11 @@ void SlotsMapUpdater::_recv_rsp()
         return this->_await_data();
     }
     if (rsp.size() != 1) {
-        throw BadRedisMessage("Ask cluster nodes returns responses with size=" +
+        throw BadRedisMessage("Ask cluster slots returns responses with size=" +
                               util::str(int(rsp.size())));
     }
     LOG(DEBUG) << "*Updated from " << this->str();
-    this->_nodes = parse_slot_map(rsp[0]->get_buffer().to_string(), this->addr.host);
+    this->_nodes = parse_cluster_slots(rsp[0]->get_buffer(), this->addr.host);
 
     for (RedisNode const& node: this->_nodes) {
         if (node.addr.host.empty()) {
@@ -60,7 +80,7 @@ void SlotsMapUpdater::_recv_rsp()
         }
         for (auto const& begin_end: node.slot_ranges) {
             for (slot s = begin_end.first; s <= begin_end.second; ++s) {
-                this->_covered_slots.insert(s);
+                this->_covered_slots.set(s);
             }
         }
         this->_remotes.insert(node.addr);
@@ -95,7 +115,7 @@ void SlotsMapUpdater::_notify_updated()
     this->close();
     if (!this->_proxy_already_updated) {
         this->_proxy->notify_slot_map_updated(this->get_nodes(), this->_remotes,
-                                              this->_covered_slots.size());
+                                              this->covered_slots());
     }
 }
 
@@ -105,35 +125,214 @@ std::string SlotsMapUpdater::str() const
                        static_cast<void const*>(this), this->addr.str());
 }
 
+TopologyProbe::TopologyProbe(util::Address a, Proxy* p)
+    : Connection(fctl::new_stream_socket())
+    , _proxy(p)
+    , addr(std::move(a))
+{
+    LOG(DEBUG) << "Create " << this->str();
+    fctl::set_nonblocking(fd);
+    fctl::connect_fd(this->addr.host, this->addr.port, this->fd);
+    p->poll_add_rw(this);
+}
+
+TopologyProbe::~TopologyProbe()
+{
+    if (!this->closed()) {
+        cerb_global::finish_topology_probe(Clock::now(), 0, false);
+    }
+}
+
+namespace {
+
+    /* Releases the probe if the action finishing it is dropped by a retired thread */
+    struct ProbeRelease {
+        bool finished;
+
+        ProbeRelease()
+            : finished(false)
+        {}
+
+        ~ProbeRelease()
+        {
+            if (!this->finished) {
+                cerb_global::finish_topology_probe(Clock::now(), 0, false);
+            }
+        }
+    };
+
+}
+
+void TopologyProbe::_recv_rsp()
+{
+    _rsp.read(this->fd);
+    std::vector<util::sptr<Response>> rsp(split_server_response(_rsp));
+    if (rsp.size() == 0) {
+        return;
+    }
+    std::string nodes_info(rsp[0]->get_buffer().to_string());
+    if (rsp.size() != 1 || nodes_info[0] != '$') {
+        throw BadRedisMessage("Unexpected topology probe response " + nodes_info);
+    }
+    LOG(DEBUG) << "*Probed " << this->str();
+    this->close();
+    /* the probe is finished once the digest is made */
+    std::string nodes(nodes_info.substr(nodes_info.find('\n') + 1));
+    cerb::run_in_background(
+        this->_proxy,
+        [nodes]() -> ControlAction
+        {
+            bool master_failing;
+            std::size_t digest = topology_digest(nodes, master_failing);
+            std::shared_ptr<ProbeRelease> release(std::make_shared<ProbeRelease>());
+            return [digest, master_failing, release](Proxy* p)
+            {
+                release->finished = true;
+                p->notify_topology_probed(digest, master_failing);
+            };
+        });
+}
+
+void TopologyProbe::on_events(int events)
+{
+    if (poll::event_is_hup(events)) {
+        LOG(ERROR) << "Failed to probe topology from " << this->str()
+                   << ". Closed because remote hung up.";
+        return this->_finish(0, false);
+    }
+    if (poll::event_is_write(events)) {
+        write_topology_probe_cmd_to(this->fd);
+        return this->_proxy->poll_ro(this);
+    }
+    if (poll::event_is_read(events)) {
+        try {
+            this->_recv_rsp();
+        } catch (BadRedisMessage& e) {
+            LOG(ERROR) << "Receive bad message on probe from "
+                       << this->str() << " because " << e.what();
+            return this->_finish(0, false);
+        }
+    }
+}
+
+void TopologyProbe::_finish(std::size_t digest, bool master_failing)
+{
+    if (!this->closed()) {
+        this->close();
+        this->_proxy->notify_topology_probed(digest, master_failing);
+    }
+}
+
+std::string TopologyProbe::str() const
+{
+    return fmt::format("TopologyProbe({}@{})[{}]", this->fd,
+                       static_cast<void const*>(this), this->addr.str());
+}
+
+static unsigned long initial_slot_map_version()
+{
+    /* a map saved by the last run is applied in the first poll, others wait for an update */
+    std::shared_ptr<SlotMapSnapshot const> m(cerb_global::latest_slot_map());
+    return m != nullptr && m->unverified ? 0 : cerb_global::slot_map_version();
+}
+
 Proxy::Proxy(int listen_port)
     : _clients_count(0)
     , _long_conns_count(0)
+    , _topology_probe(nullptr)
     , _total_cmd_elapse(0)
     , _total_remote_cost(0)
     , _total_cmd(0)
     , _last_cmd_elapse(0)
     , _last_remote_cost(0)
+    , _slow_polls(0)
+    , _max_poll_elapse(0)
     , _slot_map_expired(true)
     , _fd_closed(false)
+    , _warming_up(cerb_global::warm_up_timeout.count() > 0)
+    , _warm_up_deadline(Clock::now() + std::chrono::duration_cast<Clock::duration>(
+          cerb_global::warm_up_timeout))
+    , _warm_up_mapped(false)
+    , _has_replicas(false)
+    , _next_replication_probe(Clock::now())
+    , _hedge_tokens(0)
+    , _hedged_reads(0)
+    , _hedge_wins(0)
+    , _busy(0)
+    , _load_window_start(Clock::now())
+    , _load(0)
+    , _shed_to(nullptr)
+    , _migration_budget(0)
+    , _migrated_clients(0)
+    , _retiring(false)
+    , _drain_timed_out(false)
+    , _drain_deadline(Clock::now())
+    , _updating_slot_map(false)
+    , _slot_map_version(::initial_slot_map_version())
+    , _generation(0)
+    , _shared_replies(nullptr)
     , epfd(poll::poll_create())
     , acceptor(this, listen_port)
+    , unix_acceptor(nullptr)
+{
+    if (cerb::shared_backends_enabled()) {
+        this->_shared_replies = std::make_shared<SharedReplies>(this);
+    }
+    if (cerb_global::unix_listen_fd != -1) {
+        this->unix_acceptor = util::mkptr(
+            Acceptor::of_unix_listener(this, cerb_global::unix_listen_fd));
+    }
+    if (!this->_warming_up) {
+        this->_turn_on_accepting();
+    }
+}
+
+void Proxy::_turn_on_accepting()
 {
     this->acceptor.turn_on_accepting();
+    if (this->unix_acceptor.not_nul()) {
+        this->unix_acceptor->turn_on_accepting();
+    }
 }
 
 Proxy::~Proxy()
 {
+    this->_release_slot_map_updating();
     cio::close(epfd);
 }
 
 void Proxy::_set_slot_map(std::vector<RedisNode> const& map,
                           std::set<util::Address> const& remotes)
 {
-    _server_map.replace_map(map, this);
-    _slot_map_expired = false;
+    this->_slot_map_version = cerb_global::publish_slot_map(map, true);
+    if (cerb_global::saves_slot_map()) {
+        std::shared_ptr<std::vector<RedisNode>> saved(new std::vector<RedisNode>(map));
+        unsigned long version = this->_slot_map_version;
+        /* writing the file blocks, so it's done off the event loop */
+        cerb::run_in_background(
+            this,
+            [saved, version]() -> ControlAction
+            {
+                cerb_global::save_slot_map(*saved, version);
+                return [](Proxy*) {};
+            });
+    }
+    this->_release_slot_map_updating();
     cerb_global::set_remotes(std::move(remotes));
     cerb_global::set_cluster_ok(true);
     LOG(INFO) << "Slot map updated";
+    this->_apply_slot_map(map);
+}
+
+void Proxy::_apply_slot_map(std::vector<RedisNode> const& map)
+{
+    _server_map.replace_map(map, this);
+    _slot_map_expired = false;
+    _has_replicas = std::any_of(_server_map.begin(), _server_map.end(),
+                                [](Server* s) { return s != nullptr && !s->replicas().empty(); });
+    if (this->_warming_up) {
+        this->_track_warm_up_backends();
+    }
     LOG(DEBUG) << "Retry MOVED or ASK: " << this->_retrying_commands.size();
     if (this->_retrying_commands.empty()) {
         return;
@@ -156,6 +355,75 @@ void Proxy::_set_slot_map(std::vector<RedisNode> const& map,
     }
 }
 
+void Proxy::_apply_slot_map_failure()
+{
+    _server_map.clear();
+    this->_warm_up_backends.clear();
+    this->_warm_up_mapped = false;
+    std::vector<util::sref<DataCommand>> cmds(std::move(this->_retrying_commands));
+    for (util::sref<DataCommand> c: cmds) {
+        c->on_remote_responsed(Buffer("-CLUSTERDOWN The cluster is down\r\n"), true);
+    }
+    _slot_map_expired = false;
+}
+
+void Proxy::_sync_slot_map()
+{
+    if (cerb_global::slot_map_version() == this->_slot_map_version) {
+        return;
+    }
+    std::shared_ptr<SlotMapSnapshot const> m(cerb_global::latest_slot_map());
+    LOG(DEBUG) << "Apply slot map version " << m->version;
+    this->_slot_map_version = m->version;
+    if (m->cluster_ok) {
+        this->_apply_slot_map(m->nodes);
+        /* route from a saved map at once but still ask the cluster for the real one */
+        this->_slot_map_expired = m->unverified;
+    } else {
+        this->_apply_slot_map_failure();
+    }
+}
+
+/* Mailboxes of the threads waiting for the slot map another thread is updating */
+static std::mutex slot_map_waiters_mutex;
+static std::vector<std::shared_ptr<ControlMailbox>> slot_map_waiters;
+
+static void wait_for_slot_map()
+{
+    std::shared_ptr<ControlMailbox> mailbox(ControlMailbox::of_this_thread());
+    if (mailbox == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> _(::slot_map_waiters_mutex);
+    if (std::find(::slot_map_waiters.begin(), ::slot_map_waiters.end(), mailbox)
+            == ::slot_map_waiters.end())
+    {
+        ::slot_map_waiters.push_back(std::move(mailbox));
+    }
+}
+
+/* after released, so a waiter woken either finds the map published or takes over the update */
+static void wake_slot_map_waiters()
+{
+    std::vector<std::shared_ptr<ControlMailbox>> waiters;
+    {
+        std::lock_guard<std::mutex> _(::slot_map_waiters_mutex);
+        waiters.swap(::slot_map_waiters);
+    }
+    for (auto const& m: waiters) {
+        m->post([](Proxy*) {});
+    }
+}
+
+void Proxy::_release_slot_map_updating()
+{
+    if (this->_updating_slot_map) {
+        this->_updating_slot_map = false;
+        cerb_global::release_slot_map_updating();
+        ::wake_slot_map_waiters();
+    }
+}
+
 void Proxy::_update_slot_map_failed()
 {
     for (util::sptr<SlotsMapUpdater> const& u: this->_slot_updaters) {
@@ -163,6 +431,9 @@ void Proxy::_update_slot_map_failed()
             return;
         }
     }
+    if (this->_launch_slot_updaters()) {
+        return;
+    }
     LOG(DEBUG) << fmt::format("{} updaters all closed", this->_slot_updaters.size());
 
     if (!cerb_global::cluster_req_full_cov() && !this->_slot_updaters.empty()) {
@@ -185,32 +456,51 @@ void Proxy::_update_slot_map_failed()
     this->_move_closed_slot_updaters();
     cerb_global::set_cluster_ok(false);
     LOG(DEBUG) << "Failed to retrieve slot map, discard all commands.";
-    _server_map.clear();
-    std::vector<util::sref<DataCommand>> cmds(std::move(this->_retrying_commands));
-    for (util::sref<DataCommand> c: cmds) {
-        c->on_remote_responsed(Buffer("-CLUSTERDOWN The cluster is down\r\n"), true);
+    this->_slot_map_version = cerb_global::publish_slot_map(std::vector<RedisNode>(), false);
+    this->_release_slot_map_updating();
+    this->_apply_slot_map_failure();
+}
+
+bool Proxy::_launch_slot_updaters()
+{
+    bool launched = false;
+    while (!launched && !this->_pending_remotes.empty()) {
+        for (int i = 0; i < MAX_SLOT_UPDATERS && !this->_pending_remotes.empty(); ++i) {
+            util::Address addr(std::move(this->_pending_remotes.back()));
+            this->_pending_remotes.pop_back();
+            try {
+                this->_slot_updaters.push_back(
+                    util::mkptr(new SlotsMapUpdater(addr, this)));
+                launched = true;
+            } catch (ConnectionRefused& e) {
+                LOG(INFO) << "Disconnect " << addr.str() << " for " << e.what();
+            } catch (UnknownHost& e) {
+                LOG(ERROR) << "Disconnect " << addr.str() << " for " << e.what();
+            }
+        }
     }
-    _slot_map_expired = false;
+    return launched;
 }
 
 void Proxy::_retrieve_slot_map()
 {
+    if (!this->_updating_slot_map) {
+        /* registered before trying, so the release by the updating thread can't be missed */
+        ::wait_for_slot_map();
+        if (!cerb_global::acquire_slot_map_updating()) {
+            LOG(DEBUG) << "Wait for slot map updated by another thread";
+            return;
+        }
+        this->_updating_slot_map = true;
+    }
     std::set<util::Address> remotes(cerb_global::get_remotes());
     if (remotes.empty()) {
         LOG(ERROR) << "No remotes set";
         return this->_update_slot_map_failed();
     }
-    for (util::Address const& addr: remotes) {
-        try {
-            this->_slot_updaters.push_back(
-                util::mkptr(new SlotsMapUpdater(addr, this)));
-        } catch (ConnectionRefused& e) {
-            LOG(INFO) << "Disconnect " << addr.str() << " for " << e.what();
-        } catch (UnknownHost& e) {
-            LOG(ERROR) << "Disconnect " << addr.str() << " for " << e.what();
-        }
-    };
-    if (_slot_updaters.empty()) {
+    /* popped from the back, so reversed to ask nodes in order */
+    this->_pending_remotes.assign(remotes.rbegin(), remotes.rend());
+    if (!this->_launch_slot_updaters()) {
         this->_update_slot_map_failed();
     }
 }
@@ -231,6 +521,159 @@ void Proxy::update_slot_map()
     _slot_map_expired = true;
 }
 
+int Proxy::poll_timeout() const
+{
+    int timeout = -1;
+    if (!this->_tryagain_commands.empty()) {
+        timeout = TRYAGAIN_DELAY_MS;
+    } else if (this->_warming_up) {
+        timeout = WARM_UP_CHECK_MS;
+    }
+    if (this->_has_replicas && cerb_global::replication_probe_interval.count() > 0) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            this->_next_replication_probe - Clock::now()).count() + 1;
+        wait = std::max(wait, decltype(wait)(0));
+        if (timeout == -1 || wait < timeout) {
+            timeout = int(wait);
+        }
+    }
+    if (this->_has_replicas && cerb_global::hedge_read_budget > 0 && timeout != 0) {
+        bool awaiting = std::any_of(
+            Server::addr_begin(), Server::addr_end(),
+            [](std::pair<util::Address const, Server*> const& s)
+            {
+                return s.second->outstanding() != 0;
+            });
+        if (awaiting && (timeout == -1 || HEDGE_CHECK_MS < timeout)) {
+            timeout = HEDGE_CHECK_MS;
+        }
+    }
+    int probe_wait = cerb_global::topology_probe_wait_ms();
+    if (probe_wait != -1 && (timeout == -1 || probe_wait < timeout)) {
+        timeout = probe_wait;
+    }
+    if (this->_retiring && !this->_drain_timed_out) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            this->_drain_deadline - Clock::now()).count() + 1;
+        wait = std::max(wait, decltype(wait)(0));
+        if (timeout == -1 || wait < timeout) {
+            timeout = int(wait);
+        }
+    }
+    /* an idle thread wakes to publish its load, or its last busy one would stay */
+    if (cerb_global::balance_threads && (timeout == -1 || LOAD_WINDOW_MS < timeout)) {
+        timeout = LOAD_WINDOW_MS;
+    }
+    return timeout;
+}
+
+void Proxy::_probe_topology()
+{
+    if (this->_topology_probe.not_nul()) {
+        if (!this->_topology_probe->closed()) {
+            return;
+        }
+        this->_topology_probe.reset();
+    }
+    Time now = Clock::now();
+    if (!cerb_global::acquire_topology_probe(now)) {
+        return;
+    }
+    std::set<util::Address> remotes(cerb_global::get_remotes());
+    if (remotes.empty()) {
+        cerb_global::finish_topology_probe(now, 0, false);
+        return;
+    }
+    auto remote = remotes.begin();
+    std::advance(remote, util::randint(0, int(remotes.size())));
+    try {
+        this->_topology_probe = util::mkptr(new TopologyProbe(*remote, this));
+    } catch (ConnectionRefused& e) {
+        LOG(INFO) << "Fail to probe topology from " << remote->str() << " for " << e.what();
+        cerb_global::finish_topology_probe(now, 0, false);
+    } catch (UnknownHost& e) {
+        LOG(ERROR) << "Fail to probe topology from " << remote->str() << " for " << e.what();
+        cerb_global::finish_topology_probe(now, 0, false);
+    }
+}
+
+void Proxy::_probe_replication()
+{
+    if (!this->_has_replicas || cerb_global::replication_probe_interval.count() <= 0) {
+        return;
+    }
+    Time now = Clock::now();
+    if (now < this->_next_replication_probe) {
+        return;
+    }
+    this->_next_replication_probe = now + std::chrono::duration_cast<Clock::duration>(
+        cerb_global::replication_probe_interval);
+    Server* last = nullptr;
+    for (Server* s: this->_server_map) {
+        if (s != last && s != nullptr && !s->replicas().empty()) {
+            s->probe_replication();
+        }
+        last = s;
+    }
+}
+
+void Proxy::_hedge_reads()
+{
+    if (!this->_has_replicas || cerb_global::hedge_read_budget <= 0) {
+        return;
+    }
+    Time now = Clock::now();
+    for (auto i = Server::addr_begin(); i != Server::addr_end(); ++i) {
+        i->second->hedge_slow_reads(now);
+    }
+}
+
+void Proxy::_track_warm_up_backends()
+{
+    std::set<Server*> backends;
+    for (Server* s: this->_server_map) {
+        if (s != nullptr) {
+            backends.insert(s);
+            backends.insert(s->replicas().begin(), s->replicas().end());
+        }
+    }
+    this->_warm_up_backends.assign(backends.begin(), backends.end());
+    this->_warm_up_mapped = !backends.empty();
+}
+
+bool Proxy::_backends_connected()
+{
+    /* checked on every poll while warming up, so only the pending ones are looked at */
+    this->_warm_up_backends.erase(
+        std::remove_if(this->_warm_up_backends.begin(), this->_warm_up_backends.end(),
+                       [](Server* s) { return s->connected() || s->closed(); }),
+        this->_warm_up_backends.end());
+    return this->_warm_up_mapped && this->_warm_up_backends.empty();
+}
+
+void Proxy::_check_warmed_up()
+{
+    if (Clock::now() < this->_warm_up_deadline) {
+        if (this->_slot_map_expired || this->_updating_slot_map ||
+            !this->_slot_updaters.empty() || !this->_backends_connected()) {
+            return;
+        }
+        LOG(INFO) << "Warmed up, slot map fetched and backends connected";
+    } else {
+        LOG(WARNING) << "Warm up timed out, start accepting anyway";
+    }
+    this->_warming_up = false;
+    this->_turn_on_accepting();
+}
+
+void Proxy::notify_topology_probed(std::size_t digest, bool master_failing)
+{
+    if (cerb_global::finish_topology_probe(Clock::now(), digest, master_failing)) {
+        LOG(INFO) << "Topology changed, update slot map";
+        this->_slot_map_expired = true;
+    }
+}
+
 bool Proxy::_should_update_slot_map() const
 {
     return this->_slot_updaters.empty() &&
@@ -256,24 +699,94 @@ void Proxy::retry_move_ask_command_later(util::sref<DataCommand> cmd)
     this->_retrying_commands.push_back(cmd);
 }
 
+void Proxy::redirect_command(util::sref<DataCommand> cmd, Redirection const& r)
+{
+    switch (r.kind) {
+    case Redirection::MOVED:
+        {
+            LOG(DEBUG) << "Slot " << r.key_slot << " moved to " << r.addr.str();
+            Server* s = this->_redirection_target(r.addr);
+            if (s == nullptr) {
+                return this->retry_move_ask_command_later(cmd);
+            }
+            this->_server_map.set_by_slot(r.key_slot, s);
+            return this->_dispatch_redirected(cmd);
+        }
+    case Redirection::ASK:
+        {
+            Server* s = this->_redirection_target(r.addr);
+            if (s == nullptr || s->closed()) {
+                return this->retry_move_ask_command_later(cmd);
+            }
+            s->push_asking_command(cmd);
+            return this->set_conn_poll_rw(s);
+        }
+    case Redirection::TRYAGAIN:
+        if (this->_tryagain_commands.empty()) {
+            this->_tryagain_time = Clock::now() + std::chrono::milliseconds(TRYAGAIN_DELAY_MS);
+        }
+        this->_tryagain_commands.push_back(cmd);
+        return;
+    default:
+        return this->retry_move_ask_command_later(cmd);
+    }
+}
+
+/*
+ * Called while the replying server splits its responses, so failing to
+ * connect to the target must not close that server, or the thread
+ */
+Server* Proxy::_redirection_target(util::Address const& addr)
+{
+    try {
+        return Server::get_server(addr, this);
+    } catch (ConnectionRefused& e) {
+        LOG(INFO) << "Fail to follow redirection to " << addr.str() << " for " << e.what();
+    } catch (UnknownHost& e) {
+        LOG(ERROR) << "Fail to follow redirection to " << addr.str() << " for " << e.what();
+    }
+    return nullptr;
+}
+
+void Proxy::_dispatch_redirected(util::sref<DataCommand> cmd)
+{
+    Server* s = cmd->select_server(this);
+    if (s != nullptr) {
+        this->set_conn_poll_rw(s);
+    }
+}
+
+void Proxy::_retry_tryagain_commands()
+{
+    if (this->_tryagain_commands.empty() || Clock::now() < this->_tryagain_time) {
+        return;
+    }
+    std::vector<util::sref<DataCommand>> cmds(std::move(this->_tryagain_commands));
+    this->_tryagain_commands.clear();
+    for (util::sref<DataCommand> c: cmds) {
+        this->_dispatch_redirected(c);
+    }
+}
+
 void Proxy::inactivate_long_conn(Connection* conn)
 {
     this->_inactive_long_connections.insert(conn);
 }
 
-static void poll_ctl(Proxy* p, std::map<Connection*, bool> conn_polls)
+void Proxy::_poll_ctl_dirty_conns()
 {
-    LOG(DEBUG) << "*poll ctl " << conn_polls.size();
-    for (std::pair<Connection*, bool> conn_writable: conn_polls) {
-        Connection* c = conn_writable.first;
+    LOG(DEBUG) << "*poll ctl";
+    Connection* c;
+    while ((c = this->_dirty_conns.pop()) != nullptr) {
+        bool writable = c->write_wanted;
+        c->write_wanted = false;
         if (c->closed()) {
             continue;
         }
-        LOG(DEBUG) << " poll ctl " << c->str();
-        if (conn_writable.second) {
-            p->poll_rw(c);
+        if (writable) {
+            this->poll_rw(c);
         } else {
-            p->poll_ro(c);
+            this->poll_ro(c);
         }
     }
 }
@@ -281,50 +794,67 @@ static void poll_ctl(Proxy* p, std::map<Connection*, bool> conn_polls)
 void Proxy::handle_events(poll::pevent events[], int nfds)
 {
     LOG(DEBUG) << "*poll wait: " << nfds;
-    std::set<Connection*> active_conns;
+    this->_sync_slot_map();
+    this->_retry_tryagain_commands();
+    unsigned long gen = ++this->_generation;
     for (Connection* c: this->_inactive_long_connections) {
         c->close();
+        c->closed_generation = gen;
         this->_fd_closed = true;
     }
-    std::set<Connection*> closed_conns(std::move(this->_inactive_long_connections));
+    this->_inactive_long_connections.clear();
 
     cerb_global::poll_start = Clock::now();
     for (int i = 0; i < nfds; ++i) {
         Connection* conn = static_cast<Connection*>(events[i].data.ptr);
         LOG(DEBUG) << "*poll process " << conn->str();
-        if (closed_conns.find(conn) != closed_conns.end()) {
+        if (conn->closed_generation == gen) {
             continue;
         }
-        active_conns.insert(conn);
+        this->_active_conns.push(conn);
         try {
             conn->on_events(events[i].events);
         } catch (IOErrorBase& e) {
             LOG(ERROR) << "IOError: " << e.what() << " :: " << "Close " << conn->str();
             conn->on_error();
-            closed_conns.insert(conn);
+            conn->closed_generation = gen;
         }
     }
     LOG(DEBUG) << "*poll clean";
 
-    ::poll_ctl(this, std::move(this->_conn_poll_type));
-    for (Connection* c: active_conns) {
-        c->after_events(active_conns);
+    this->_drain();
+    this->_poll_ctl_dirty_conns();
+    /* a connection deleted by another one's after_events unlinks itself */
+    Connection* c;
+    while ((c = this->_active_conns.pop()) != nullptr) {
+        c->after_events();
     }
     this->_finished_slot_updaters.clear();
+    this->_probe_topology();
+    this->_probe_replication();
+    this->_hedge_reads();
+    this->_poll_ctl_dirty_conns();
     if (this->_should_update_slot_map()) {
         LOG(DEBUG) << "Should update slot map";
         this->_retrieve_slot_map();
         /* do it again after try updating slot map
          * because some client may get CLUSTERDOWN message when no available remotes
          */
-        ::poll_ctl(this, std::move(this->_conn_poll_type));
+        this->_poll_ctl_dirty_conns();
     }
-    if (this->_fd_closed) {
+    if (this->_warming_up) {
+        this->_check_warmed_up();
+    } else if (this->_fd_closed) {
         this->_fd_closed = false;
-        this->acceptor.turn_on_accepting();
+        this->_turn_on_accepting();
     }
-    auto poll_elapse = Clock::now() - cerb_global::poll_start;
+    Time now = Clock::now();
+    Interval poll_elapse(now - cerb_global::poll_start);
+    this->_busy += poll_elapse;
+    this->_balance_load(now);
+    this->_max_poll_elapse = std::max(this->_max_poll_elapse, poll_elapse);
     if (cerb_global::slow_poll_elapse < poll_elapse) {
+        ++this->_slow_polls;
         LOG(INFO) << fmt::format(
             "Poll elapse={} events={} clients={} long_clients={} slots_map_updated={}",
             util::str(poll_elapse), nfds, this->_clients_count, this->_long_conns_count,
@@ -339,22 +869,171 @@ Server* Proxy::get_server_by_slot(slot key_slot)
     return (s == nullptr || s->closed()) ? nullptr : s;
 }
 
+Server* Proxy::get_read_server_by_slot(slot key_slot)
+{
+    Server* s = _server_map.get_by_slot(key_slot);
+    if (s == nullptr) {
+        return nullptr;
+    }
+    if (s->closed() || !s->connected()) {
+        Server* r = s->select_for_stale_read();
+        if (r != nullptr) {
+            return r;
+        }
+    }
+    return s->closed() ? nullptr : s->select_for_read();
+}
+
 void Proxy::new_client(int client_fd)
 {
     LOG(DEBUG) << fmt::format("ACCEPT CLIENT fd={}", client_fd);
-    new Client(client_fd, this);
+    if (this->_retiring || this->_shed_to != nullptr) {
+        return this->migrate_client(client_fd, std::string());
+    }
+    this->_clients.insert(new Client(client_fd, this));
     ++this->_clients_count;
 }
 
-void Proxy::pop_client(Client* cli)
+/* clients of a retiring thread are spread over the others */
+static std::shared_ptr<ListenThread> live_thread(long n)
 {
-    LOG(DEBUG) << "Pop " << cli->str();
-    util::erase_if(
-        this->_retrying_commands,
-        [cli](util::sref<DataCommand> cmd)
+    std::vector<std::shared_ptr<ListenThread>> live;
+    for (auto const& t: cerb_global::listen_threads()) {
+        if (!t->retiring()) {
+            live.push_back(t);
+        }
+    }
+    return live.empty() ? nullptr : live[n % long(live.size())];
+}
+
+void Proxy::migrate_client(int client_fd, std::string buffered)
+{
+    LOG(DEBUG) << fmt::format("MIGRATE CLIENT fd={}", client_fd);
+    if (this->_retiring && cerb::hand_off_client(client_fd, buffered)) {
+        ++this->_migrated_clients;
+        return;
+    }
+    std::shared_ptr<ListenThread> to(
+        this->_retiring ? ::live_thread(this->_migrated_clients) : this->_shed_to);
+    if (to == nullptr) {
+        /* all threads retire as the process hands over, without clients */
+        LOG(DEBUG) << "No thread to take client, close fd=" << client_fd;
+        cio::close(client_fd);
+        return;
+    }
+    ++this->_migrated_clients;
+    to->post(
+        [client_fd, buffered](Proxy* p)
         {
-            return cmd->group->client.is(cli);
+            p->adopt_client(client_fd, buffered);
         });
+}
+
+void Proxy::adopt_client(int client_fd, std::string const& buffered)
+{
+    LOG(DEBUG) << fmt::format("ADOPT CLIENT fd={}", client_fd);
+    if (this->_retiring) {
+        /* handed over by a thread that picked this one before it retired */
+        return this->migrate_client(client_fd, buffered);
+    }
+    Client* c = new Client(client_fd, this);
+    this->_clients.insert(c);
+    ++this->_clients_count;
+    c->restore_buffer(buffered);
+}
+
+void Proxy::retire(Interval drain_timeout)
+{
+    LOG(INFO) << "Retire, close clients still busy in " << util::str(drain_timeout);
+    this->_retiring = true;
+    this->_drain_deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+        drain_timeout);
+    this->_shed_to.reset();
+    this->acceptor.shut();
+    if (this->unix_acceptor.not_nul()) {
+        this->unix_acceptor->shut();
+    }
+}
+
+void Proxy::_drain()
+{
+    if (!this->_retiring || this->_drain_timed_out) {
+        return;
+    }
+    bool timed_out = this->_drain_deadline <= Clock::now();
+    for (Client* c: this->_clients) {
+        if (c->closed()) {
+            continue;
+        }
+        if (timed_out) {
+            LOG(DEBUG) << "Drain timed out, close " << c->str();
+            c->close();
+        } else if (!c->migrate_if_idle()) {
+            continue;
+        }
+        /* deleted after events as closed */
+        this->_active_conns.push(c);
+    }
+    if (timed_out) {
+        this->_drain_timed_out = true;
+        if (this->_long_conns_count != 0) {
+            /* long connections attached to servers are closed with them in the next poll */
+            Server::close_all();
+        }
+    }
+}
+
+void Proxy::_balance_load(Time now)
+{
+    Interval window(now - this->_load_window_start);
+    if (window < std::chrono::milliseconds(LOAD_WINDOW_MS)) {
+        return;
+    }
+    int load = int(this->_busy / window * 1000);
+    this->_load.store(load);
+    this->_busy = Interval(0);
+    this->_load_window_start = now;
+    this->_shed_to.reset();
+    if (!cerb_global::balance_threads || this->_retiring || load < SHED_MIN_LOAD) {
+        return;
+    }
+    long total = 0;
+    int live = 0;
+    std::shared_ptr<ListenThread> lightest;
+    int lightest_load = load;
+    for (auto const& t: cerb_global::listen_threads()) {
+        if (t->retiring()) {
+            continue;
+        }
+        int l = t->get_proxy()->load();
+        total += l;
+        ++live;
+        if (l < lightest_load) {
+            lightest = t;
+            lightest_load = l;
+        }
+    }
+    if (lightest == nullptr) {
+        return;
+    }
+    long average = total / live;
+    if (load * 100 > average * (100 + SHED_MARGIN_PERCENT)) {
+        LOG(DEBUG) << "Load " << load << " over average " << average << ", shed clients";
+        this->_shed_to = lightest;
+        this->_migration_budget = MIGRATIONS_PER_WINDOW;
+    }
+}
+
+void Proxy::pop_client(Client* cli)
+{
+    LOG(DEBUG) << "Pop " << cli->str();
+    auto of_client = [cli](util::sref<DataCommand> cmd)
+                     {
+                         return cmd->group->client.is(cli);
+                     };
+    util::erase_if(this->_retrying_commands, of_client);
+    util::erase_if(this->_tryagain_commands, of_client);
+    this->_clients.erase(cli);
     --this->_clients_count;
     this->_fd_closed = true;
 }
@@ -373,6 +1052,7 @@ void Proxy::poll_add_ro(Connection* conn)
     if (poll::poll_add_read(this->epfd, conn->fd, conn)) {
         throw cerb::SystemError("poll r+" + conn->str(), errno);
     }
+    conn->poll_interest = Connection::POLL_RO;
 }
 
 void Proxy::poll_add_rw(Connection* conn)
@@ -380,23 +1060,42 @@ void Proxy::poll_add_rw(Connection* conn)
     if (poll::poll_add_write(this->epfd, conn->fd, conn)) {
         throw cerb::SystemError("poll rw+" + conn->str(), errno);
     }
+    conn->poll_interest = Connection::POLL_RW;
+}
+
+void Proxy::poll_add_exclusive(Connection* conn)
+{
+    if (poll::poll_add_exclusive(this->epfd, conn->fd, conn)) {
+        throw cerb::SystemError("poll rx+" + conn->str(), errno);
+    }
+    conn->poll_interest = Connection::POLL_RO;
 }
 
 void Proxy::poll_ro(Connection* conn)
 {
+    if (conn->poll_interest == Connection::POLL_RO) {
+        return;
+    }
     if (poll::poll_read(this->epfd, conn->fd, conn)) {
         throw cerb::SystemError("poll r*" + conn->str(), errno);
     }
+    conn->poll_interest = Connection::POLL_RO;
 }
 
+/*
+ * Always modified even if write interest is registered already: epoll is edge
+ * triggered, and the connection may have used up its writable edge
+ */
 void Proxy::poll_rw(Connection* conn)
 {
     if (poll::poll_write(this->epfd, conn->fd, conn)) {
         throw cerb::SystemError("poll rw*" + conn->str(), errno);
     }
+    conn->poll_interest = Connection::POLL_RW;
 }
 
 void Proxy::poll_del(Connection* conn)
 {
     poll::poll_del(this->epfd, conn->fd);
+    conn->poll_interest = Connection::POLL_NONE;
 }
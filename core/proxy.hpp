@@ -1,13 +1,19 @@
 #ifndef __CERBERUS_PROXY_HPP__
 #define __CERBERUS_PROXY_HPP__
 
+#include <atomic>
+#include <memory>
 #include <vector>
-#include <map>
+#include <set>
+#include <bitset>
+#include <algorithm>
 
 #include "command.hpp"
+#include "response.hpp"
 #include "slot_map.hpp"
 #include "connection.hpp"
 #include "acceptor.hpp"
+#include "shared_backend.hpp"
 #include "utils/pointer.h"
 #include "syscalls/poll.h"
 
@@ -15,6 +21,7 @@ namespace cerb {
 
     class Proxy;
     class Server;
+    class ListenThread;
 
     class SlotsMapUpdater
         : public Connection
@@ -23,7 +30,7 @@ namespace cerb {
         Buffer _rsp;
         std::vector<RedisNode> _nodes;
         std::set<util::Address> _remotes;
-        std::set<slot> _covered_slots;
+        std::bitset<CLUSTER_SLOT_COUNT> _covered_slots;
         bool _proxy_already_updated;
 
         void _send_cmd();
@@ -55,7 +62,7 @@ namespace cerb {
 
         msize_t covered_slots() const
         {
-            return this->_covered_slots.size();
+            return this->_covered_slots.count();
         }
 
         void proxy_updated()
@@ -64,6 +71,30 @@ namespace cerb {
         }
     };
 
+    /* Asks one node for CLUSTER NODES to tell whether the slot map is to be updated */
+    class TopologyProbe
+        : public Connection
+    {
+        Proxy* _proxy;
+        Buffer _rsp;
+
+        void _recv_rsp();
+        void _finish(std::size_t digest, bool master_failing);
+    public:
+        util::Address const addr;
+
+        TopologyProbe(util::Address addr, Proxy* p);
+        ~TopologyProbe();
+
+        void on_error()
+        {
+            this->_finish(0, false);
+        }
+
+        void on_events(int events);
+        std::string str() const;
+    };
+
     class Proxy {
         int _clients_count;
         int _long_conns_count;
@@ -71,27 +102,84 @@ namespace cerb {
         SlotMap _server_map;
         std::vector<util::sptr<SlotsMapUpdater>> _slot_updaters;
         std::vector<util::sptr<SlotsMapUpdater>> _finished_slot_updaters;
+        util::sptr<TopologyProbe> _topology_probe;
         std::vector<util::sref<DataCommand>> _retrying_commands;
+        std::vector<util::sref<DataCommand>> _tryagain_commands;
+        Time _tryagain_time;
         std::set<Connection*> _inactive_long_connections;
         Interval _total_cmd_elapse;
         Interval _total_remote_cost;
         long _total_cmd;
         Interval _last_cmd_elapse;
         Interval _last_remote_cost;
+        /* polls taking longer than slow-poll-elapse-ms, which stall all clients of the thread */
+        long _slow_polls;
+        Interval _max_poll_elapse;
         bool _slot_map_expired;
         bool _fd_closed;
-        std::map<Connection*, bool> _conn_poll_type;
+        bool _warming_up;
+        Time _warm_up_deadline;
+        /* backends of the slot map not yet connected while warming up */
+        std::vector<Server*> _warm_up_backends;
+        bool _warm_up_mapped;
+        bool _has_replicas;
+        Time _next_replication_probe;
+        /* hedged reads allowed, earned by reading commands responded */
+        double _hedge_tokens;
+        long _hedged_reads;
+        long _hedge_wins;
+        /* time spent in polls of the current load window, published as permille of it */
+        Interval _busy;
+        Time _load_window_start;
+        std::atomic<int> _load;
+        /* set while much busier than the others, to the thread its clients move to */
+        std::shared_ptr<ListenThread> _shed_to;
+        int _migration_budget;
+        long _migrated_clients;
+        /* a retiring proxy accepts no more, and hands all its clients over once idle */
+        bool _retiring;
+        bool _drain_timed_out;
+        Time _drain_deadline;
+        std::set<Client*> _clients;
+        bool _updating_slot_map;
+        unsigned long _slot_map_version;
+        std::vector<util::Address> _pending_remotes;
+        unsigned long _generation;
+        ActiveConnections _active_conns;
+        DirtyConnections _dirty_conns;
+        /* replies from shared backend threads, if they are started */
+        std::shared_ptr<SharedReplies> _shared_replies;
 
         bool _should_update_slot_map() const;
         void _retrieve_slot_map();
         void _set_slot_map(std::vector<RedisNode> const& map,
                            std::set<util::Address> const& remotes);
+        void _apply_slot_map(std::vector<RedisNode> const& map);
+        void _apply_slot_map_failure();
+        void _sync_slot_map();
+        bool _launch_slot_updaters();
+        void _release_slot_map_updating();
         void _update_slot_map_failed();
         void _update_slot_map();
         void _move_closed_slot_updaters();
+        void _poll_ctl_dirty_conns();
+        void _dispatch_redirected(util::sref<DataCommand> cmd);
+        Server* _redirection_target(util::Address const& addr);
+        void _retry_tryagain_commands();
+        void _probe_topology();
+        void _probe_replication();
+        void _hedge_reads();
+        void _track_warm_up_backends();
+        bool _backends_connected();
+        void _check_warmed_up();
+        void _balance_load(Time now);
+        void _drain();
+        void _turn_on_accepting();
     public:
         int epfd;
         Acceptor acceptor;
+        /* set if a unix socket is listened to, by the threads all together */
+        util::sptr<Acceptor> unix_acceptor;
 
         explicit Proxy(int listen_port);
         ~Proxy();
@@ -100,12 +188,13 @@ namespace cerb {
 
         void set_conn_poll_ro(Connection* conn)
         {
-            _conn_poll_type[conn] = _conn_poll_type[conn] || false;
+            _dirty_conns.push(conn);
         }
 
         void set_conn_poll_rw(Connection* conn)
         {
-            _conn_poll_type[conn] = true;
+            _dirty_conns.push(conn);
+            conn->write_wanted = true;
         }
 
         int clients_count() const
@@ -115,7 +204,14 @@ namespace cerb {
 
         bool accepting() const
         {
-            return this->acceptor.accepting();
+            return this->acceptor.accepting()
+                || (this->unix_acceptor.not_nul() && this->unix_acceptor->accepting());
+        }
+
+        /* the slot map is fetched and backends are connected, or the warm up timed out */
+        bool ready() const
+        {
+            return !this->_warming_up;
         }
 
         void incr_long_conn()
@@ -153,30 +249,118 @@ namespace cerb {
             return _last_cmd_elapse;
         }
 
+        int load() const
+        {
+            return _load.load();
+        }
+
+        long migrated_clients() const
+        {
+            return _migrated_clients;
+        }
+
+        /* retired and all clients handed over or closed, so the thread may exit */
+        bool drained() const
+        {
+            return this->_retiring && this->_clients_count == 0
+                && (this->_long_conns_count == 0 || this->_drain_timed_out);
+        }
+
+        long slow_polls() const
+        {
+            return _slow_polls;
+        }
+
+        Interval max_poll_elapse() const
+        {
+            return _max_poll_elapse;
+        }
+
         Interval last_remote_cost() const
         {
             return _last_remote_cost;
         }
 
+        long hedged_reads() const
+        {
+            return this->_hedged_reads;
+        }
+
+        long hedge_wins() const
+        {
+            return this->_hedge_wins;
+        }
+
+        /* ratio of a hedged read earned per reading command; saved up to a burst of 16 */
+        void earn_hedge_budget(double ratio)
+        {
+            this->_hedge_tokens = std::min(this->_hedge_tokens + ratio, 16.0);
+        }
+
+        bool spend_hedge_budget()
+        {
+            if (this->_hedge_tokens < 1) {
+                return false;
+            }
+            this->_hedge_tokens -= 1;
+            ++this->_hedged_reads;
+            return true;
+        }
+
+        void hedge_won()
+        {
+            ++this->_hedge_wins;
+        }
+
         Server* random_addr()
         {
             return _server_map.random_addr();
         }
 
+        std::shared_ptr<SharedReplies> const& shared_replies() const
+        {
+            return this->_shared_replies;
+        }
+
+        int poll_timeout() const;
         Server* get_server_by_slot(slot key_slot);
+        /* the server a reading command goes to, a replica if balanced or for stale reads */
+        Server* get_read_server_by_slot(slot key_slot);
         void notify_slot_map_updated(std::vector<RedisNode> const& nodes,
                                      std::set<util::Address> const& remotes,
                                      msize_t covered_slots);
+        void notify_topology_probed(std::size_t digest, bool master_failing);
         void update_slot_map();
         void retry_move_ask_command_later(util::sref<DataCommand> cmd);
+        void redirect_command(util::sref<DataCommand> cmd, Redirection const& r);
         void inactivate_long_conn(Connection* conn);
         void handle_events(poll::pevent events[], int nfds);
         void new_client(int client_fd);
         void pop_client(Client* cli);
+        /* hand the client over to a less busy thread, with what it sent but not parsed yet */
+        void migrate_client(int client_fd, std::string buffered);
+        void adopt_client(int client_fd, std::string const& buffered);
+        /* clients still busy after drain_timeout are closed */
+        void retire(Interval drain_timeout);
+
+        /* whether an idle client should move to another thread now */
+        bool take_client_migration()
+        {
+            if (this->_retiring) {
+                return true;
+            }
+            if (this->_shed_to == nullptr || this->_migration_budget == 0) {
+                return false;
+            }
+            --this->_migration_budget;
+            return true;
+        }
         void stat_proccessed(Interval cmd_elapse, Interval remote_cost);
 
         void poll_add_ro(Connection* conn);
         void poll_add_rw(Connection* conn);
+        /* read only, and only one of the threads polling it is woken */
+        void poll_add_exclusive(Connection* conn);
         void poll_ro(Connection* conn);
         void poll_rw(Connection* conn);
         void poll_del(Connection* conn);
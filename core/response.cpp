@@ -2,9 +2,9 @@
 #include "command.hpp"
 #include "proxy.hpp"
 #include "message.hpp"
-#include "utils/string.h"
 #include "utils/address.hpp"
 #include "utils/logging.hpp"
+#include "utils/string.h"
 
 using namespace cerb;
 
@@ -58,68 +58,82 @@ namespace {
     };
     Buffer const RetryMovedAskResponse::dump("$ RETRY MOVED OR ASK $");
 
-    class ServerResponseSplitter
-        : public cerb::msg::MessageSplitterBase<
-            Buffer::iterator, ServerResponseSplitter>
-    {
-        typedef Buffer::iterator Iterator;
-        typedef cerb::msg::MessageSplitterBase<Iterator, ServerResponseSplitter> BaseType;
-
-        std::string _last_error;
-
-        void _push_retry_rsp()
-        {
-            this->responses.push_back(util::mkptr(new RetryMovedAskResponse));
-        }
-
-        void _push_normal_rsp(Iterator begin, Iterator end)
-        {
-            this->responses.push_back(util::mkptr(
-                new NormalResponse(Buffer(begin, end), !this->_last_error.empty())));
-        }
-
-        void _push_rsp(Iterator i)
-        {
-            if (!_last_error.empty()) {
-                if (util::stristartswith(_last_error, "MOVED") ||
-                    util::stristartswith(_last_error, "ASK") ||
-                    util::stristartswith(_last_error, "CLUSTERDOWN"))
-                {
-                    LOG(DEBUG) << "Retry due to " << _last_error;
-                    return this->_push_retry_rsp();
-                }
-            }
-            this->_push_normal_rsp(this->_split_points.back(), i);
-        }
-    public:
-        std::vector<util::sptr<Response>> responses;
-
-        explicit ServerResponseSplitter(Iterator i)
-            : BaseType(i)
-        {}
+}
 
-        void on_split_point(Iterator next)
-        {
-            this->_push_rsp(next);
-            this->_last_error.clear();
+bool ResponseScanner::_error_starts_with(Buffer::iterator begin, Buffer::iterator end,
+                                         char const* prefix)
+{
+    for (; *prefix != 0; ++prefix, ++begin) {
+        if (begin == end || std::toupper(*begin) != *prefix) {
+            return false;
         }
+    }
+    return true;
+}
 
-        void on_error(Iterator begin, Iterator end)
-        {
-            this->_last_error = std::string(begin, end);
-        }
-    };
+Buffer::iterator ResponseScanner::on_err(Buffer::iterator begin, Buffer::iterator end)
+{
+    Buffer::iterator next = msg::parse_simple_str(begin, end);
+    --this->missing_elements;
+    this->error = true;
+    this->retry = _error_starts_with(begin, next, "MOVED")
+               || _error_starts_with(begin, next, "ASK")
+               || _error_starts_with(begin, next, "TRYAGAIN")
+               || _error_starts_with(begin, next, "CLUSTERDOWN");
+    if (this->retry) {
+        LOG(DEBUG) << "Retry due to " << std::string(begin, next - msg::LENGTH_OF_CR_LF);
+    }
+    return next;
+}
 
+Redirection::Redirection(Buffer::iterator begin, Buffer::iterator end,
+                         std::string const& default_host)
+    : kind(CLUSTERDOWN)
+    , key_slot(0)
+    , addr(default_host, 0)
+{
+    std::vector<std::string> parts(util::split_str(
+        std::string(begin + 1, end - msg::LENGTH_OF_CR_LF), " ", true));
+    if (parts.empty()) {
+        return;
+    }
+    if (parts[0] == "TRYAGAIN") {
+        this->kind = TRYAGAIN;
+        return;
+    }
+    if (parts.size() != 3 || (parts[0] != "MOVED" && parts[0] != "ASK")) {
+        return;
+    }
+    std::string::size_type colon = parts[2].rfind(':');
+    if (colon == std::string::npos) {
+        return;
+    }
+    int s = util::atoi(parts[1]);
+    if (s < 0 || CLUSTER_SLOT_COUNT <= msize_t(s)) {
+        return;
+    }
+    this->kind = parts[0] == "MOVED" ? MOVED : ASK;
+    this->key_slot = slot(s);
+    if (colon != 0) {
+        this->addr.host = parts[2].substr(0, colon);
+    }
+    this->addr.port = util::atoi(parts[2].substr(colon + 1));
 }
 
 std::vector<util::sptr<Response>> cerb::split_server_response(Buffer& buffer)
 {
-    ServerResponseSplitter r(msg::split_by(
-        buffer.begin(), buffer.end(), ServerResponseSplitter(buffer.begin())));
-    if (r.finished()) {
-        buffer.clear();
-    } else {
-        buffer.truncate_from_begin(r.interrupt_point());
-    }
-    return std::move(r.responses);
+    std::vector<util::sptr<Response>> responses;
+    split_server_response(
+        buffer,
+        [&](Buffer::iterator begin, Buffer::iterator end, bool error, bool retry)
+        {
+            if (retry) {
+                responses.push_back(util::mkptr(new RetryMovedAskResponse));
+            } else {
+                responses.push_back(util::mkptr(
+                    new NormalResponse(Buffer(begin, end), error)));
+            }
+            return true;
+        });
+    return responses;
 }
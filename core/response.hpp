@@ -4,7 +4,9 @@
 #include <vector>
 
 #include "utils/pointer.h"
+#include "utils/address.hpp"
 #include "buffer.hpp"
+#include "message.hpp"
 
 namespace cerb {
 
@@ -27,6 +29,103 @@ namespace cerb {
 
     std::vector<util::sptr<Response>> split_server_response(Buffer& buffer);
 
+    /* What a retry error like "-MOVED 3999 127.0.0.1:6381" asks the proxy to do */
+    struct Redirection {
+        enum Kind {
+            MOVED,
+            ASK,
+            TRYAGAIN,
+            CLUSTERDOWN
+        };
+
+        Kind kind;
+        slot key_slot;
+        util::Address addr;
+
+        /* an empty host in the error means the same host as the replying node */
+        Redirection(Buffer::iterator begin, Buffer::iterator end,
+                    std::string const& default_host);
+    };
+
+    /* Consumer for msg::parse that tells when one whole response is parsed */
+    class ResponseScanner {
+        static bool _error_starts_with(Buffer::iterator begin, Buffer::iterator end,
+                                       char const* prefix);
+    public:
+        rint missing_elements;
+        bool error;
+        bool retry;
+
+        ResponseScanner()
+            : missing_elements(1)
+            , error(false)
+            , retry(false)
+        {}
+
+        Buffer::iterator on_int(rint, Buffer::iterator next)
+        {
+            --this->missing_elements;
+            return next;
+        }
+
+        Buffer::iterator on_sstr(Buffer::iterator begin, Buffer::iterator end)
+        {
+            --this->missing_elements;
+            return msg::parse_simple_str(begin, end);
+        }
+
+        Buffer::iterator on_lstr(rint size, Buffer::iterator begin, Buffer::iterator end)
+        {
+            --this->missing_elements;
+            return msg::parse_str(size, begin, end);
+        }
+
+        void on_arr(rint size, Buffer::iterator)
+        {
+            this->missing_elements += size - 1;
+        }
+
+        Buffer::iterator on_nil(Buffer::iterator next)
+        {
+            --this->missing_elements;
+            return next;
+        }
+
+        Buffer::iterator on_err(Buffer::iterator begin, Buffer::iterator end);
+    };
+
+    /*
+     * Pass each complete response at the front of the buffer to
+     *   on_rsp(begin, end, error, retry_moved_or_ask)
+     * in order, without creating any object for it, then remove them from
+     * the buffer; if on_rsp returns false that response and all following
+     * ones are left in the buffer
+     */
+    template <typename OnResponse>
+    void split_server_response(Buffer& buffer, OnResponse on_rsp)
+    {
+        Buffer::iterator begin = buffer.begin();
+        try {
+            while (begin != buffer.end()) {
+                ResponseScanner s;
+                Buffer::iterator next = msg::parse(begin, buffer.end(), s);
+                if (s.missing_elements != 0) {
+                    break;
+                }
+                if (!on_rsp(begin, next, s.error, s.retry)) {
+                    break;
+                }
+                begin = next;
+            }
+        } catch (msg::MessageInterrupted&) {
+        }
+        if (begin == buffer.end()) {
+            buffer.clear();
+        } else {
+            buffer.truncate_from_begin(begin);
+        }
+    }
+
 }
 
 #endif /* __CERBERUS_RESPONSE_HPP__ */
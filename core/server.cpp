@@ -1,4 +1,5 @@
 #include <map>
+#include <algorithm>
 #include <cppformat/format.h>
 
 #include "command.hpp"
@@ -6,22 +7,51 @@
 #include "client.hpp"
 #include "proxy.hpp"
 #include "response.hpp"
+#include "globals.hpp"
+#include "slot_map.hpp"
+#include "shared_backend.hpp"
 #include "except/exceptions.hpp"
 #include "utils/alg.hpp"
 #include "utils/logging.hpp"
+#include "utils/random.hpp"
 #include "syscalls/poll.h"
 #include "syscalls/fctl.h"
 
 using namespace cerb;
 
+/* stop following redirections, e.g. slots bouncing between two nodes, and reply the error */
+static int const MAX_REDIRECTIONS = 16;
+/* each response moves the latency average by 1/8 of its difference */
+static int const LATENCY_SMOOTHING = 8;
+/* latency floor so that idle servers are still compared by outstanding commands */
+static Interval const MIN_LATENCY(0.0001);
+static bool balance_reads = false;
+static bool balance_with_master = false;
+static bool stale_reads = false;
+static int lanes_count = 1;
+static bool bulk_lane = false;
+static std::size_t bulk_request_bytes = 0;
+static std::shared_ptr<Buffer> const ASKING_CMD(
+    std::make_shared<Buffer>("*1\r\n$6\r\nASKING\r\n"));
+static std::shared_ptr<Buffer> const READONLY_CMD(
+    std::make_shared<Buffer>("*1\r\n$8\r\nREADONLY\r\n"));
+static std::shared_ptr<Buffer> const INFO_REPLICATION_CMD(
+    std::make_shared<Buffer>("*2\r\n$4\r\nINFO\r\n$11\r\nreplication\r\n"));
+
 void Server::on_events(int events)
 {
     if (this->closed()) {
         return;
     }
+    if (cerb::shared_backends_enabled()) {
+        this->_connected = true;
+        this->_forward();
+        return this->_proxy->set_conn_poll_ro(this);
+    }
     if (poll::event_is_hup(events)) {
         return this->close_conn();
     }
+    this->_connected = true;
     if (poll::event_is_read(events)) {
         try {
             this->_recv_from();
@@ -50,45 +80,161 @@ void Server::_push_to_buffer_set()
     for (util::sref<DataCommand> c: this->_commands) {
         this->_sent_commands.push_back(c);
         this->_output_buffer_set.append(c->buffer);
-        c->sent_time = now;
+        /* a hedge still costs from the first sending, as the client waited since then */
+        if (c->hedged_to != this) {
+            c->sent_time = now;
+        }
     }
     this->_commands.clear();
 }
 
+bool Server::_on_response(Buffer::iterator begin, Buffer::iterator end,
+                          bool error, bool retry, Time now)
+{
+    if (this->_sent_commands.empty()) {
+        return false;
+    }
+    util::sref<DataCommand> c = this->_sent_commands.front();
+    this->_sent_commands.pop_front();
+    unsigned long rsp_index = this->_responses++;
+    if (c.nul()) {
+        if (this->_probing_replication && rsp_index == this->_replication_rsp) {
+            this->_on_replication_info(begin, end);
+        }
+        return true;
+    }
+    c->resp_time = now;
+    this->_inflight_bytes -= c->buffer->size();
+    if (c->hedged_to != nullptr) {
+        /* the cost of a hedged command isn't of a single server */
+        this->_settle_hedge(c);
+    } else {
+        /* lanes of a node share its latency */
+        Server* node = this->_lane_of == nullptr ? this : this->_lane_of;
+        Interval cost(c->remote_cost());
+        node->_latency_dev += (Interval(std::abs((cost - node->_latency).count()))
+                               - node->_latency_dev) / LATENCY_SMOOTHING;
+        node->_latency += (cost - node->_latency) / LATENCY_SMOOTHING;
+    }
+    if (c->readonly) {
+        this->_proxy->earn_hedge_budget(cerb_global::hedge_read_budget);
+    }
+    if (retry && ++c->redirections <= MAX_REDIRECTIONS) {
+        this->_proxy->redirect_command(c, Redirection(begin, end, this->addr.host));
+    } else {
+        c->on_remote_responsed(Buffer(begin, end), error);
+    }
+    return true;
+}
+
+void Server::_forward()
+{
+    this->_push_to_buffer_set();
+    if (this->_output_buffer_set.empty()) {
+        return;
+    }
+    std::string data;
+    this->_output_buffer_set.drain_to(data);
+    int replies = int(this->_sent_commands.size() - this->_forwarded);
+    this->_forwarded = this->_sent_commands.size();
+    cerb::forward_to_shared_backend(new SharedRequest{
+        this->_proxy->shared_replies(), this, this->_epoch, this->addr,
+        std::move(data), replies, Clock::now()});
+}
+
+void Server::on_shared_reply(SharedReply const& reply)
+{
+    if (this->closed() || reply.epoch != this->_epoch) {
+        return;
+    }
+    if (reply.hangup) {
+        this->close_conn();
+        return this->_proxy->update_slot_map();
+    }
+    --this->_forwarded;
+    Buffer rsp(reply.data);
+    if (!this->_on_response(rsp.begin(), rsp.end(), reply.error, reply.retry, Clock::now())) {
+        LOG(ERROR) << "+Error on shared backend reply, no command awaiting response from "
+                   << this->str();
+        this->close_conn();
+    }
+}
+
 void Server::_recv_from()
 {
     int n = this->_buffer.read(this->fd);
     if (n == 0) {
         throw ConnectionHungUp();
     }
-    LOG(DEBUG) << "Read " << this->str() << " buffer size " << this->_buffer.size();
-    auto responses(split_server_response(this->_buffer));
-    if (responses.size() > this->_sent_commands.size()) {
-        LOG(ERROR) << "+Error on split, expected size: " << this->_sent_commands.size()
-                   << " actual: " << responses.size() << " dump buffer:";
-        for (util::sptr<Response> const& rsp: responses) {
-            LOG(ERROR) << "::: " << rsp->get_buffer().to_string();
-        }
-        LOG(ERROR) << "Rest buffer: " << this->_buffer.to_string();
+    /* not by str(), which is formatted on the heap even if debug logs are off */
+    LOG(DEBUG) << "Read server " << this->fd << " buffer size " << this->_buffer.size();
+    auto now = Clock::now();
+    bool unexpected_rsp = false;
+    split_server_response(
+        this->_buffer,
+        [&](Buffer::iterator begin, Buffer::iterator end, bool error, bool retry)
+        {
+            if (!this->_on_response(begin, end, error, retry, now)) {
+                unexpected_rsp = true;
+                return false;
+            }
+            return true;
+        });
+    if (unexpected_rsp) {
+        LOG(ERROR) << "+Error on split, no command awaiting response from "
+                   << this->str() << " dump buffer: " << this->_buffer.to_string();
         return this->close_conn();
     }
-    LOG(DEBUG) << "+responses size: " << responses.size();
     LOG(DEBUG) << "+rest buffer: " << this->_buffer.size();
-    auto cmd_it = this->_sent_commands.begin();
-    auto now = Clock::now();
-    for (util::sptr<Response>& rsp: responses) {
-        util::sref<DataCommand> c = *cmd_it++;
-        if (c.not_nul()) {
-            rsp->rsp_to(c, util::mkref(*this->_proxy));
-            c->resp_time = now;
+}
+
+Server* Server::push_client_command(util::sref<DataCommand> cmd)
+{
+    Server* lane = this->_select_lane(cmd);
+    lane->_commands.push_back(cmd);
+    lane->_inflight_bytes += cmd->buffer->size();
+    cmd->group->client->add_peer(lane);
+    return lane;
+}
+
+/*
+ * A client stays on the lane it has commands queued to, or its pipeline could
+ * run out of order; otherwise a bulk one goes to the bulk lane, others to the
+ * lane with the least bytes in flight
+ */
+Server* Server::_select_lane(util::sref<DataCommand> cmd)
+{
+    if (this->_lanes.empty()) {
+        return this;
+    }
+    for (Server* s: cmd->group->client->peers()) {
+        if (s == this || s->_lane_of == this) {
+            return s;
         }
     }
-    this->_sent_commands.erase(this->_sent_commands.begin(), cmd_it);
+    if (this->_bulk_lane != nullptr && (cmd->bulk || (
+            ::bulk_request_bytes != 0 && ::bulk_request_bytes <= cmd->buffer->size())))
+    {
+        return this->_bulk_lane;
+    }
+    Server* lane = this;
+    for (Server* s: this->_lanes) {
+        if (s != this->_bulk_lane && s->_inflight_bytes < lane->_inflight_bytes) {
+            lane = s;
+        }
+    }
+    return lane;
 }
 
-void Server::push_client_command(util::sref<DataCommand> cmd)
+void Server::push_asking_command(util::sref<DataCommand> cmd)
 {
-    _commands.push_back(cmd);
+    /* ASKING only applies to the very next command on this connection */
+    this->_push_to_buffer_set();
+    this->_output_buffer_set.append(::ASKING_CMD);
+    this->_sent_commands.push_back(util::sref<DataCommand>(nullptr));
+    this->_commands.push_back(cmd);
+    this->_inflight_bytes += cmd->buffer->size();
+    this->_push_to_buffer_set();
     cmd->group->client->add_peer(this);
 }
 
@@ -98,13 +244,18 @@ void Server::pop_client(Client* cli)
         this->_commands,
         [&](util::sref<DataCommand> cmd)
         {
-            return cmd->group->client.is(cli);
+            if (cmd->group->client.is(cli)) {
+                this->_inflight_bytes -= cmd->buffer->size();
+                return true;
+            }
+            return false;
         });
     for (util::sref<DataCommand>& cmd: this->_sent_commands) {
         if (cmd.not_nul() &&
             cmd->group.not_nul() &&
             cmd->group->client.not_nul() &&
             cmd->group->client.is(cli)) {
+            this->_inflight_bytes -= cmd->buffer->size();
             cmd.reset();
         }
     }
@@ -112,27 +263,31 @@ void Server::pop_client(Client* cli)
 
 std::vector<util::sref<DataCommand>> Server::deliver_commands()
 {
-    util::erase_if(
-        this->_sent_commands,
-        [](util::sref<DataCommand> cmd)
-        {
-            return cmd.nul();
-        });
-    _commands.insert(_commands.end(), _sent_commands.begin(),
-                     _sent_commands.end());
+    for (util::sref<DataCommand> cmd: this->_sent_commands) {
+        if (cmd.not_nul()) {
+            this->_commands.push_back(cmd);
+        }
+    }
+    this->_sent_commands.clear();
     return std::move(_commands);
 }
 
 static thread_local std::map<util::Address, Server*> servers_map;
 static thread_local std::vector<Server*> servers_pool;
+/* every server the thread allocated, mapped, pooled or an extra lane */
+static thread_local std::vector<util::sptr<Server>> servers_allocated;
 
 static void remove_entry(Server* server)
 {
-    ::servers_map.erase(server->addr);
+    /* an extra lane isn't the entry of its address */
+    auto i = ::servers_map.find(server->addr);
+    if (i != ::servers_map.end() && i->second == server) {
+        ::servers_map.erase(i);
+    }
     ::servers_pool.push_back(server);
 }
 
-void Server::after_events(std::set<Connection*>&)
+void Server::after_events()
 {
     if (this->closed()) {
         this->_proxy->update_slot_map();
@@ -145,6 +300,17 @@ std::string Server::str() const
                        static_cast<void const*>(this), this->addr.str());
 }
 
+/* a hedged command left on the other server only is responded from there */
+static bool unlink_hedge(util::sref<DataCommand> c)
+{
+    if (c->hedged_to == nullptr) {
+        return false;
+    }
+    c->hedged_from = nullptr;
+    c->hedged_to = nullptr;
+    return true;
+}
+
 void Server::close_conn()
 {
     if (!this->closed()) {
@@ -154,23 +320,49 @@ void Server::close_conn()
         this->_output_buffer_set.clear();
 
         for (util::sref<DataCommand> c: this->_commands) {
-            this->_proxy->retry_move_ask_command_later(c);
+            if (!::unlink_hedge(c)) {
+                this->_proxy->retry_move_ask_command_later(c);
+            }
         }
         this->_commands.clear();
 
         for (util::sref<DataCommand> c: this->_sent_commands) {
-            if (c.nul()) {
+            if (c.nul() || ::unlink_hedge(c)) {
                 continue;
             }
             this->_proxy->retry_move_ask_command_later(c);
         }
         this->_sent_commands.clear();
+        this->_inflight_bytes = 0;
+        this->_forwarded = 0;
+        ++this->_epoch;
 
         for (ProxyConnection* conn: this->attached_long_connections) {
             this->_proxy->inactivate_long_conn(conn);
         }
         this->attached_long_connections.clear();
 
+        if (this->_replica_of != nullptr) {
+            this->_replica_of->_detach_replica(this);
+            this->_replica_of = nullptr;
+        }
+        /* replicas are kept for stale reads until this is reused for another node */
+
+        if (this->_lane_of != nullptr) {
+            util::erase_if(this->_lane_of->_lanes, [&](Server* s) { return s == this; });
+            if (this->_lane_of->_bulk_lane == this) {
+                this->_lane_of->_bulk_lane = nullptr;
+            }
+            this->_lane_of = nullptr;
+        }
+        std::vector<Server*> lanes(std::move(this->_lanes));
+        this->_lanes.clear();
+        this->_bulk_lane = nullptr;
+        for (Server* lane: lanes) {
+            lane->_lane_of = nullptr;
+            lane->close_conn();
+        }
+
         ::remove_entry(this);
     }
 }
@@ -185,28 +377,66 @@ std::map<util::Address, Server*>::iterator Server::addr_end()
     return ::servers_map.end();
 }
 
-static std::function<void(int, std::vector<util::sref<DataCommand>>&)> on_server_connected(
-    [](int, std::vector<util::sref<DataCommand>>&) {});
+void Server::close_all()
+{
+    /* each server closed leaves the map */
+    std::vector<Server*> servers;
+    for (auto const& s: ::servers_map) {
+        servers.push_back(s.second);
+    }
+    for (Server* s: servers) {
+        s->close_conn();
+    }
+}
+
+void Server::delete_all()
+{
+    Server::close_all();
+    ::servers_map.clear();
+    ::servers_pool.clear();
+    ::servers_allocated.clear();
+}
 
 void Server::_reconnect(util::Address const& addr, Proxy* p)
 {
-    this->fd = fctl::new_stream_socket();
+    bool shared = cerb::shared_backends_enabled();
+    /*
+     * Commands to a shared backend are forwarded when the eventfd, always
+     * writable, is polled, at the end of the poll they are queued in, as
+     * they are written to a socket
+     */
+    this->fd = shared ? fctl::new_event_fd() : fctl::new_stream_socket();
     this->_proxy = p;
+    this->_connected = false;
+    this->_lane_of = nullptr;
+    this->_lanes.clear();
+    this->_bulk_lane = nullptr;
+    this->_inflight_bytes = 0;
+    this->_readonly = false;
+    this->set_replicas(std::vector<Server*>());
+    this->_lagging = false;
+    this->_latency = Interval(0);
+    this->_latency_dev = Interval(0);
+    this->_responses = 0;
+    this->_probing_replication = false;
     this->addr = addr;
 
-    fctl::set_nonblocking(this->fd);
-    fctl::connect_fd(addr.host, addr.port, this->fd);
+    if (!shared) {
+        fctl::set_nonblocking(this->fd);
+        fctl::connect_fd(addr.host, addr.port, this->fd);
+    }
     LOG(INFO) << "Open " << this->str();
     p->poll_add_rw(this);
-    ::on_server_connected(this->fd, this->_sent_commands);
 }
 
 Server* Server::_alloc_server(util::Address const& addr, Proxy* p)
 {
     if (servers_pool.empty()) {
         for (int i = 0; i < 8; ++i) {
-            servers_pool.push_back(new Server);
-            LOG(DEBUG) << "Allocate Server: " << servers_pool.back();
+            Server* s = new Server;
+            servers_allocated.push_back(util::mkptr(s));
+            servers_pool.push_back(s);
+            LOG(DEBUG) << "Allocate Server: " << s;
         }
     }
     Server* s = servers_pool.back();
@@ -226,19 +456,250 @@ Server* Server::get_server(util::Address addr, Proxy* p)
     if (i == servers_map.end() || i->second->closed()) {
         Server* s = Server::_alloc_server(addr, p);
         servers_map.insert(std::make_pair(std::move(addr), s));
+        s->_open_lanes();
         return s;
     }
     return i->second;
 }
 
-static std::string const READONLY_CMD("READONLY\r\n");
+void Server::_open_lanes()
+{
+    if (cerb::shared_backends_enabled()) {
+        return;
+    }
+    int extra = ::lanes_count - 1 + (::bulk_lane ? 1 : 0);
+    for (int i = 0; i < extra && !this->closed(); ++i) {
+        Server* lane = Server::_alloc_server(this->addr, this->_proxy);
+        if (lane->closed()) {
+            ::servers_pool.push_back(lane);
+            continue;
+        }
+        lane->_lane_of = this;
+        this->_lanes.push_back(lane);
+        if (::bulk_lane && i == extra - 1) {
+            this->_bulk_lane = lane;
+        }
+    }
+}
 
-void Server::send_readonly_for_each_conn()
+void Server::set_lanes(int conns, bool bulk_lane, std::size_t bulk_bytes)
 {
-    ::on_server_connected =
-        [](int fd, std::vector<util::sref<DataCommand>>& cmds)
-        {
-            flush_string(fd, READONLY_CMD);
-            cmds.push_back(util::sref<DataCommand>(nullptr));
-        };
+    ::lanes_count = conns;
+    ::bulk_lane = bulk_lane;
+    ::bulk_request_bytes = bulk_bytes;
+}
+
+void Server::set_read_policy(bool balance, bool include_master, bool stale)
+{
+    ::balance_reads = balance;
+    ::balance_with_master = include_master;
+    ::stale_reads = stale;
+}
+
+void Server::_send_readonly()
+{
+    this->_push_to_buffer_set();
+    this->_output_buffer_set.append(::READONLY_CMD);
+    this->_sent_commands.push_back(util::sref<DataCommand>(nullptr));
+    this->_readonly = true;
+    this->_proxy->set_conn_poll_rw(this);
+    for (Server* lane: this->_lanes) {
+        lane->_send_readonly();
+    }
+}
+
+void Server::set_replicas(std::vector<Server*> replicas)
+{
+    for (Server* r: this->_replicas) {
+        if (r->_replica_of == this) {
+            r->_replica_of = nullptr;
+        }
+    }
+    util::erase_if(replicas, [](Server* r) { return r->closed(); });
+    for (Server* r: replicas) {
+        if (!r->_readonly) {
+            r->_send_readonly();
+        }
+        if (r->_replica_of != nullptr && r->_replica_of != this) {
+            r->_replica_of->_detach_replica(r);
+        }
+        r->_replica_of = this;
+    }
+    this->_replicas = std::move(replicas);
+    this->_read_replicas.clear();
+    for (Server* r: this->_replicas) {
+        if (!r->_lagging) {
+            this->_read_replicas.push_back(r);
+        }
+    }
+}
+
+void Server::_detach_replica(Server* r)
+{
+    util::erase_if(this->_replicas, [&](Server* s) { return s == r; });
+    util::erase_if(this->_read_replicas, [&](Server* s) { return s == r; });
+}
+
+void Server::probe_replication()
+{
+    if (this->closed() || this->_probing_replication) {
+        return;
+    }
+    this->_push_to_buffer_set();
+    this->_output_buffer_set.append(::INFO_REPLICATION_CMD);
+    this->_replication_rsp = this->_responses + this->_sent_commands.size();
+    this->_sent_commands.push_back(util::sref<DataCommand>(nullptr));
+    this->_probing_replication = true;
+    this->_proxy->set_conn_poll_rw(this);
+}
+
+void Server::_on_replication_info(Buffer::iterator begin, Buffer::iterator end)
+{
+    this->_probing_replication = false;
+    std::string rsp(begin, end);
+    if (rsp.empty() || rsp[0] != '$') {
+        LOG(ERROR) << "Unexpected INFO replication response from " << this->str() << " " << rsp;
+        return;
+    }
+    std::vector<ReplicaLag> lags(parse_replication_info(
+        rsp.substr(rsp.find('\n') + 1), this->addr));
+    this->_read_replicas.clear();
+    for (Server* r: this->_replicas) {
+        auto lag = std::find_if(lags.begin(), lags.end(),
+                                [&](ReplicaLag const& g) { return g.addr == r->addr; });
+        bool lagging = lag == lags.end() || !lag->online
+            || (0 < cerb_global::replica_max_lag_bytes &&
+                cerb_global::replica_max_lag_bytes < lag->offset_lag)
+            || (0 < cerb_global::replica_max_lag_seconds &&
+                cerb_global::replica_max_lag_seconds < lag->seconds_lag);
+        if (lagging != r->_lagging) {
+            LOG(INFO) << (lagging ? "Stop" : "Resume") << " reading from lagging replica "
+                      << r->str() << " of " << this->str();
+            r->_lagging = lagging;
+        }
+        if (!lagging) {
+            this->_read_replicas.push_back(r);
+        }
+    }
+    cerb_global::set_replica_lags(this->addr, std::move(lags));
+}
+
+static double load_score(Server* s)
+{
+    return (s->outstanding() + 1) * std::max(s->latency(), ::MIN_LATENCY).count();
+}
+
+/* the less loaded of two random ones among candidates, and the master if given */
+static Server* less_loaded(std::vector<Server*> const& candidates, Server* master)
+{
+    int n = int(candidates.size()) + (master == nullptr ? 0 : 1);
+    if (n == 1) {
+        return candidates.empty() ? master : candidates[0];
+    }
+    int a = util::randint(0, n);
+    int b = util::randint(0, n - 1);
+    if (a <= b) {
+        ++b;
+    }
+    Server* x = a < int(candidates.size()) ? candidates[a] : master;
+    Server* y = b < int(candidates.size()) ? candidates[b] : master;
+    return ::load_score(y) < ::load_score(x) ? y : x;
+}
+
+Server* Server::select_for_read()
+{
+    if (!::balance_reads || this->_read_replicas.empty()) {
+        return this;
+    }
+    return ::less_loaded(this->_read_replicas, ::balance_with_master ? this : nullptr);
+}
+
+Server* Server::select_for_stale_read()
+{
+    if (!::stale_reads) {
+        return nullptr;
+    }
+    std::vector<Server*> replicas;
+    for (Server* r: this->_replicas) {
+        if (r->connected() && !r->closed()) {
+            replicas.push_back(r);
+        }
+    }
+    if (replicas.empty()) {
+        return nullptr;
+    }
+    return ::less_loaded(replicas, nullptr);
+}
+
+Server* Server::_hedge_target()
+{
+    Server* node = this->_lane_of == nullptr ? this : this->_lane_of;
+    Server* master = node->_replica_of == nullptr ? node : node->_replica_of;
+    std::vector<Server*> candidates;
+    for (Server* r: master->_read_replicas) {
+        if (r != node && r->connected() && !r->closed()) {
+            candidates.push_back(r);
+        }
+    }
+    if (master == node || master->closed() || !master->connected()) {
+        master = nullptr;
+    }
+    if (candidates.empty() && master == nullptr) {
+        return nullptr;
+    }
+    return ::less_loaded(candidates, master);
+}
+
+void Server::hedge_slow_reads(Time now)
+{
+    /* average plus twice the mean deviation is about the 95th percentile */
+    Interval delay(std::max(this->_latency + 2 * this->_latency_dev, cerb_global::hedge_min_delay));
+    this->_hedge_sent(now, delay);
+    for (Server* lane: this->_lanes) {
+        lane->_hedge_sent(now, delay);
+    }
+}
+
+void Server::_hedge_sent(Time now, Interval delay)
+{
+    for (util::sref<DataCommand> c: this->_sent_commands) {
+        if (c.nul() || !c->readonly || c->hedged_to != nullptr) {
+            continue;
+        }
+        if (now - c->sent_time < delay) {
+            return;
+        }
+        Server* target = this->_hedge_target();
+        if (target == nullptr || !this->_proxy->spend_hedge_budget()) {
+            return;
+        }
+        LOG(DEBUG) << "Hedge reading command from " << this->str() << " to " << target->str();
+        c->hedged_from = this;
+        c->hedged_to = target->push_client_command(c);
+        this->_proxy->set_conn_poll_rw(c->hedged_to);
+    }
+}
+
+void Server::_settle_hedge(util::sref<DataCommand> c)
+{
+    if (c->hedged_to == this) {
+        this->_proxy->hedge_won();
+        c->hedged_from->_drop_command(c);
+    } else {
+        c->hedged_to->_drop_command(c);
+    }
+    c->hedged_from = nullptr;
+    c->hedged_to = nullptr;
+}
+
+/* the late reply to the command, if it is sent already, is discarded */
+void Server::_drop_command(util::sref<DataCommand> cmd)
+{
+    this->_inflight_bytes -= cmd->buffer->size();
+    util::erase_if(this->_commands, [&](util::sref<DataCommand> c) { return c.is(cmd); });
+    for (util::sref<DataCommand>& c: this->_sent_commands) {
+        if (c.is(cmd)) {
+            c.reset();
+        }
+    }
 }
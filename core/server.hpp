@@ -9,29 +9,83 @@
 #include "connection.hpp"
 #include "utils/pointer.h"
 #include "utils/address.hpp"
+#include "utils/ring_queue.hpp"
 
 namespace cerb {
 
     class Client;
     class DataCommand;
+    struct SharedReply;
 
     class Server
         : public ProxyConnection
     {
         Proxy* _proxy;
+        bool _connected;
+        /* the node connection this is an extra lane of */
+        Server* _lane_of;
+        /* extra connections to the same node, including the bulk lane if any */
+        std::vector<Server*> _lanes;
+        Server* _bulk_lane;
+        /* bytes of commands queued or sent but not responded yet */
+        std::size_t _inflight_bytes;
+        /* changed on close, so that replies of shared backends to the last use are dropped */
+        unsigned long _epoch;
+        /* sent commands forwarded to the shared backend */
+        std::size_t _forwarded;
+        /* READONLY sent, as a replica to read from */
+        bool _readonly;
+        Server* _replica_of;
+        std::vector<Server*> _replicas;
+        /* replicas not lagging too far behind */
+        std::vector<Server*> _read_replicas;
+        bool _lagging;
+        Interval _latency;
+        /* moving average of the deviation from the latency average */
+        Interval _latency_dev;
+        /* responses received on this connection, to tell which one is of INFO replication */
+        unsigned long _responses;
+        bool _probing_replication;
+        unsigned long _replication_rsp;
         Buffer _buffer;
         BufferSet _output_buffer_set;
 
         std::vector<util::sref<DataCommand>> _commands;
-        std::vector<util::sref<DataCommand>> _sent_commands;
+        util::ring_queue<util::sref<DataCommand>> _sent_commands;
 
         void _recv_from();
+        bool _on_response(Buffer::iterator begin, Buffer::iterator end,
+                          bool error, bool retry, Time now);
+        void _forward();
         void _reconnect(util::Address const& addr, Proxy* p);
         void _push_to_buffer_set();
+        void _open_lanes();
+        Server* _select_lane(util::sref<DataCommand> cmd);
+        void _hedge_sent(Time now, Interval delay);
+        void _send_readonly();
+        void _detach_replica(Server* r);
+        void _on_replication_info(Buffer::iterator begin, Buffer::iterator end);
+        Server* _hedge_target();
+        void _settle_hedge(util::sref<DataCommand> c);
+        void _drop_command(util::sref<DataCommand> cmd);
 
         Server()
             : ProxyConnection(-1)
             , _proxy(nullptr)
+            , _connected(false)
+            , _lane_of(nullptr)
+            , _bulk_lane(nullptr)
+            , _inflight_bytes(0)
+            , _epoch(0)
+            , _forwarded(0)
+            , _readonly(false)
+            , _replica_of(nullptr)
+            , _lagging(false)
+            , _latency(0)
+            , _latency_dev(0)
+            , _responses(0)
+            , _probing_replication(false)
+            , _replication_rsp(0)
             , addr("", 0)
         {}
 
@@ -40,13 +94,27 @@ namespace cerb {
         util::Address addr;
         std::set<ProxyConnection*> attached_long_connections;
 
-        static void send_readonly_for_each_conn();
+        /*
+         * balance: reading commands are balanced over replicas, and the master if include_master
+         * stale: reading commands go to replicas while the master is unreachable
+         */
+        static void set_read_policy(bool balance, bool include_master, bool stale);
+        /*
+         * Each node is connected by conns connections per thread, and an extra one
+         * for bulk commands and requests of at least bulk_bytes if bulk_lane
+         */
+        static void set_lanes(int conns, bool bulk_lane, std::size_t bulk_bytes);
         static Server* get_server(util::Address addr, Proxy* p);
         static std::map<util::Address, Server*>::iterator addr_begin();
         static std::map<util::Address, Server*>::iterator addr_end();
+        /* close the connections of the calling thread to every node, as it retires */
+        static void close_all();
+        /* close_all and free the servers of the calling thread, as it exits */
+        static void delete_all();
 
         void on_events(int events);
-        void after_events(std::set<Connection*>&);
+        void after_events();
+        void on_shared_reply(SharedReply const& reply);
         std::string str() const;
 
         void on_error()
@@ -54,8 +122,68 @@ namespace cerb {
             this->close_conn();
         }
 
+        /* whether the non-blocking connect has completed */
+        bool connected() const
+        {
+            return this->_connected;
+        }
+
+        /* commands queued or sent but not responded yet, over all lanes */
+        std::size_t outstanding() const
+        {
+            std::size_t n = this->_commands.size() + this->_sent_commands.size();
+            for (Server* lane: this->_lanes) {
+                n += lane->_commands.size() + lane->_sent_commands.size();
+            }
+            return n;
+        }
+
+        std::vector<Server*> const& lanes() const
+        {
+            return this->_lanes;
+        }
+
+        /* moving average of response time */
+        Interval latency() const
+        {
+            return this->_latency;
+        }
+
+        std::vector<Server*> const& replicas() const
+        {
+            return this->_replicas;
+        }
+
+        void set_replicas(std::vector<Server*> replicas);
+
+        /* too far behind its master, as of the last INFO replication of the master */
+        bool lagging() const
+        {
+            return this->_lagging;
+        }
+
+        /* ask this master for INFO replication to find out lagging replicas */
+        void probe_replication();
+
+        /*
+         * Pick the less loaded of two random replicas, by outstanding commands
+         * weighted by latency; the master itself if it has no replica not lagging
+         */
+        Server* select_for_read();
+
+        /* a connected replica of this unreachable master, if stale reads allowed */
+        Server* select_for_stale_read();
+
+        /*
+         * Send reading commands awaiting response for longer than about the
+         * 95th percentile latency to another replica or the master as well
+         */
+        void hedge_slow_reads(Time now);
+
         void close_conn();
-        void push_client_command(util::sref<DataCommand> cmd);
+        /* returns the lane the command is queued on */
+        Server* push_client_command(util::sref<DataCommand> cmd);
+        void push_asking_command(util::sref<DataCommand> cmd);
         void pop_client(Client* cli);
         std::vector<util::sref<DataCommand>> deliver_commands();
 
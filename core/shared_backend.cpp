@@ -0,0 +1,449 @@
+#include <map>
+#include <set>
+#include <deque>
+#include <thread>
+#include <cppformat/format.h>
+
+#include "shared_backend.hpp"
+#include "server.hpp"
+#include "proxy.hpp"
+#include "buffer.hpp"
+#include "response.hpp"
+#include "except/exceptions.hpp"
+#include "utils/logging.hpp"
+#include "utils/pointer.h"
+#include "syscalls/poll.h"
+#include "syscalls/cio.h"
+#include "syscalls/fctl.h"
+
+using namespace cerb;
+
+static void wake(int evfd)
+{
+    uint64_t one = 1;
+    cio::write(evfd, &one, sizeof one);
+}
+
+static void clear_wake(int evfd)
+{
+    uint64_t n;
+    cio::read(evfd, &n, sizeof n);
+}
+
+static long long ns_between(Time begin, Time end)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+SharedReplies::SharedReplies(Proxy* p)
+    : Connection(fctl::new_event_fd())
+    , _notified(false)
+    , depth(0)
+    , handoff_ns(0)
+    , handoffs(0)
+{
+    p->poll_add_ro(this);
+}
+
+SharedReplies::~SharedReplies()
+{
+    /* replies to a retired thread, of which the servers are gone */
+    SharedReply* r;
+    while (this->_queue.pop(r)) {
+        delete r;
+    }
+}
+
+void SharedReplies::push(SharedReply* r)
+{
+    this->_queue.push(r);
+    ++this->depth;
+}
+
+void SharedReplies::notify()
+{
+    if (!this->_notified.exchange(true)) {
+        ::wake(this->fd);
+    }
+}
+
+void SharedReplies::on_events(int)
+{
+    ::clear_wake(this->fd);
+    /* replies pushed from now on wake the thread again */
+    this->_notified.store(false);
+    Time now = Clock::now();
+    SharedReply* r;
+    while (this->_queue.pop(r)) {
+        std::unique_ptr<SharedReply> reply(r);
+        --this->depth;
+        this->handoff_ns += ::ns_between(reply->enqueued, now);
+        ++this->handoffs;
+        reply->origin->on_shared_reply(*reply);
+    }
+}
+
+std::string SharedReplies::str() const
+{
+    return fmt::format("SharedReplies({}@{})", this->fd, static_cast<void const*>(this));
+}
+
+namespace {
+
+    class SharedBackendThread;
+
+    /* One connection to a node, for the Servers of all listen threads */
+    class SharedConn
+        : public Connection
+    {
+        struct Awaiting {
+            std::shared_ptr<SharedReplies> reply_to;
+            Server* origin;
+            unsigned long epoch;
+        };
+
+        SharedBackendThread* const _thread;
+        bool _connected;
+        Buffer _buffer;
+        BufferSet _output;
+        /* not a ring, which would keep popped replies of a retired thread alive */
+        std::deque<Awaiting> _awaiting;
+    public:
+        util::Address const addr;
+
+        SharedConn(util::Address a, SharedBackendThread* t, int epfd);
+
+        void send(SharedRequest const& req);
+        void on_events(int events);
+        void on_error();
+        std::string str() const;
+    };
+
+    class SharedBackendThread
+        : public Connection
+    {
+        int _epfd;
+        util::mpsc_queue<SharedRequest*> _requests;
+        std::atomic<bool> _notified;
+        std::map<util::Address, SharedConn*> _conns;
+        std::vector<SharedConn*> _closed;
+        std::set<std::shared_ptr<SharedReplies>> _woken;
+
+        void _loop();
+        SharedConn* _conn_to(util::Address const& addr);
+    public:
+        std::atomic<long> conns;
+        std::atomic<long> depth;
+        std::atomic<long> max_depth;
+        std::atomic<long long> handoff_ns;
+        std::atomic<long> handoffs;
+
+        SharedBackendThread();
+
+        void start();
+        void push(SharedRequest* req);
+        int poll(int timeout);
+        void close_conns();
+
+        void reply(std::shared_ptr<SharedReplies> const& to, SharedReply* r)
+        {
+            to->push(r);
+            this->_woken.insert(to);
+        }
+
+        void conn_closed(SharedConn* c)
+        {
+            this->_conns.erase(c->addr);
+            this->_closed.push_back(c);
+            --this->conns;
+        }
+
+        void on_events(int);
+        void on_error() {}
+        std::string str() const;
+    };
+
+}
+
+SharedConn::SharedConn(util::Address a, SharedBackendThread* t, int epfd)
+    : Connection(fctl::new_stream_socket())
+    , _thread(t)
+    , _connected(false)
+    , addr(std::move(a))
+{
+    fctl::set_nonblocking(this->fd);
+    fctl::connect_fd(this->addr.host, this->addr.port, this->fd);
+    /* edge triggered, so writable events come only after the socket buffer was full */
+    if (poll::poll_add_write(epfd, this->fd, this)) {
+        throw SystemError("poll rw+" + this->str(), errno);
+    }
+    LOG(INFO) << "Open " << this->str();
+}
+
+void SharedConn::send(SharedRequest const& req)
+{
+    for (int i = 0; i < req.replies; ++i) {
+        this->_awaiting.push_back(Awaiting{req.reply_to, req.origin, req.epoch});
+    }
+    this->_output.append(std::make_shared<Buffer>(req.data));
+    if (this->_connected) {
+        this->_output.writev(this->fd);
+    }
+}
+
+void SharedConn::on_events(int events)
+{
+    if (poll::event_is_hup(events)) {
+        return this->on_error();
+    }
+    this->_connected = true;
+    if (poll::event_is_read(events)) {
+        if (this->_buffer.read(this->fd) == 0) {
+            throw ConnectionHungUp();
+        }
+        Time now = Clock::now();
+        bool unexpected_rsp = false;
+        split_server_response(
+            this->_buffer,
+            [&](Buffer::iterator begin, Buffer::iterator end, bool error, bool retry)
+            {
+                if (this->_awaiting.empty()) {
+                    unexpected_rsp = true;
+                    return false;
+                }
+                Awaiting a(this->_awaiting.front());
+                this->_awaiting.pop_front();
+                this->_thread->reply(a.reply_to, new SharedReply{
+                    a.origin, a.epoch, std::string(begin, end), error, retry, false, now});
+                return true;
+            });
+        if (unexpected_rsp) {
+            LOG(ERROR) << "+Error on split, no command awaiting response from " << this->str();
+            return this->on_error();
+        }
+    }
+    this->_output.writev(this->fd);
+}
+
+void SharedConn::on_error()
+{
+    if (this->closed()) {
+        return;
+    }
+    LOG(INFO) << "Close " << this->str();
+    Time now = Clock::now();
+    Server* last = nullptr;
+    for (Awaiting const& a: this->_awaiting) {
+        if (a.origin != last) {
+            this->_thread->reply(a.reply_to, new SharedReply{
+                a.origin, a.epoch, std::string(), false, false, true, now});
+            last = a.origin;
+        }
+    }
+    this->_awaiting.clear();
+    this->close();
+    this->_thread->conn_closed(this);
+}
+
+std::string SharedConn::str() const
+{
+    return fmt::format("SharedConn({}@{})[{}]", this->fd,
+                       static_cast<void const*>(this), this->addr.str());
+}
+
+SharedBackendThread::SharedBackendThread()
+    : Connection(fctl::new_event_fd())
+    , _epfd(poll::poll_create())
+    , _notified(false)
+    , conns(0)
+    , depth(0)
+    , max_depth(0)
+    , handoff_ns(0)
+    , handoffs(0)
+{
+    if (poll::poll_add_read(this->_epfd, this->fd, this)) {
+        throw SystemError("poll r+" + this->str(), errno);
+    }
+}
+
+void SharedBackendThread::start()
+{
+    std::thread(
+        [this]()
+        {
+            try {
+                this->_loop();
+            } catch (SystemError& e) {
+                LOG(ERROR) << e.stack_trace;
+                LOG(ERROR) << "Shared backend thread terminated by SystemError: " << e.what();
+                exit(1);
+            }
+        }).detach();
+}
+
+void SharedBackendThread::push(SharedRequest* req)
+{
+    this->_requests.push(req);
+    long d = ++this->depth;
+    long m = this->max_depth.load();
+    while (m < d && !this->max_depth.compare_exchange_weak(m, d))
+        ;
+    if (!this->_notified.exchange(true)) {
+        ::wake(this->fd);
+    }
+}
+
+SharedConn* SharedBackendThread::_conn_to(util::Address const& addr)
+{
+    auto i = this->_conns.find(addr);
+    if (i != this->_conns.end()) {
+        return i->second;
+    }
+    SharedConn* c = new SharedConn(addr, this, this->_epfd);
+    this->_conns.insert(std::make_pair(addr, c));
+    ++this->conns;
+    return c;
+}
+
+void SharedBackendThread::on_events(int)
+{
+    ::clear_wake(this->fd);
+    this->_notified.store(false);
+    Time now = Clock::now();
+    SharedRequest* r;
+    while (this->_requests.pop(r)) {
+        std::unique_ptr<SharedRequest> req(r);
+        --this->depth;
+        this->handoff_ns += ::ns_between(req->enqueued, now);
+        ++this->handoffs;
+        SharedConn* c = nullptr;
+        try {
+            c = this->_conn_to(req->addr);
+            c->send(*req);
+        } catch (RuntimeError& e) {
+            /* also an unknown host, failing before there is a connection */
+            LOG(ERROR) << "Fail to forward to " << req->addr.str() << " because " << e.what();
+            if (c == nullptr) {
+                this->reply(req->reply_to, new SharedReply{
+                    req->origin, req->epoch, std::string(), false, false, true, now});
+            } else {
+                c->on_error();
+            }
+        }
+    }
+}
+
+void SharedBackendThread::_loop()
+{
+    while (true) {
+        this->poll(-1);
+    }
+}
+
+int SharedBackendThread::poll(int timeout)
+{
+    poll::pevent events[poll::MAX_EVENTS];
+    int nfds = poll::poll_wait(this->_epfd, events, poll::MAX_EVENTS, timeout);
+    for (int i = 0; i < nfds; ++i) {
+        Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+        /* closed earlier in this pass, deleted after it */
+        if (conn->closed()) {
+            continue;
+        }
+        try {
+            conn->on_events(events[i].events);
+        } catch (IOErrorBase& e) {
+            LOG(ERROR) << "IOError: " << e.what() << " :: " << "Close " << conn->str();
+            conn->on_error();
+        } catch (BadRedisMessage& e) {
+            LOG(ERROR) << "Receive bad message from " << conn->str() << " because: " << e.what();
+            conn->on_error();
+        }
+    }
+    for (auto const& r: this->_woken) {
+        r->notify();
+    }
+    this->_woken.clear();
+    for (SharedConn* c: this->_closed) {
+        delete c;
+    }
+    this->_closed.clear();
+    return nfds;
+}
+
+void SharedBackendThread::close_conns()
+{
+    std::vector<SharedConn*> conns;
+    for (auto const& c: this->_conns) {
+        conns.push_back(c.second);
+    }
+    for (SharedConn* c: conns) {
+        c->on_error();
+    }
+    for (SharedConn* c: this->_closed) {
+        delete c;
+    }
+    this->_closed.clear();
+}
+
+std::string SharedBackendThread::str() const
+{
+    return fmt::format("SharedBackendThread({}@{})", this->fd, static_cast<void const*>(this));
+}
+
+static std::vector<util::sptr<SharedBackendThread>> backend_threads;
+
+void cerb::start_shared_backends(int threads)
+{
+    cerb::setup_shared_backends(threads);
+    for (auto& t: ::backend_threads) {
+        t->start();
+    }
+}
+
+void cerb::setup_shared_backends(int threads)
+{
+    for (int i = 0; i < threads; ++i) {
+        ::backend_threads.push_back(util::mkptr(new SharedBackendThread));
+    }
+}
+
+int cerb::poll_shared_backends()
+{
+    int n = 0;
+    for (auto& t: ::backend_threads) {
+        n += t->poll(0);
+    }
+    return n;
+}
+
+void cerb::close_shared_backends()
+{
+    for (auto& t: ::backend_threads) {
+        t->close_conns();
+    }
+    ::backend_threads.clear();
+}
+
+bool cerb::shared_backends_enabled()
+{
+    return !::backend_threads.empty();
+}
+
+void cerb::forward_to_shared_backend(SharedRequest* req)
+{
+    std::size_t h = std::hash<std::string>()(req->addr.host) * 31 + req->addr.port;
+    ::backend_threads[h % ::backend_threads.size()]->push(req);
+}
+
+std::vector<SharedBackendStat> cerb::shared_backend_stats()
+{
+    std::vector<SharedBackendStat> stats;
+    for (auto const& t: ::backend_threads) {
+        long handoffs = t->handoffs.load();
+        stats.push_back(SharedBackendStat{
+            t->conns.load(), t->depth.load(), t->max_depth.load(),
+            Interval(handoffs == 0 ? 0 : t->handoff_ns.load() / 1e9 / handoffs)});
+    }
+    return stats;
+}
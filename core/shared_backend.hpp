@@ -0,0 +1,96 @@
+#ifndef __CERBERUS_SHARED_BACKEND_HPP__
+#define __CERBERUS_SHARED_BACKEND_HPP__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "connection.hpp"
+#include "utils/address.hpp"
+#include "utils/mpsc_queue.hpp"
+
+namespace cerb {
+
+    class Proxy;
+    class Server;
+    class SharedReplies;
+
+    /*
+     * Commands a Server forwards at once to the connection shared by all threads;
+     * the replies are shared, as a thread may retire before they come
+     */
+    struct SharedRequest {
+        std::shared_ptr<SharedReplies> reply_to;
+        Server* origin;
+        unsigned long epoch;
+        util::Address addr;
+        std::string data;
+        int replies;
+        Time enqueued;
+    };
+
+    struct SharedReply {
+        Server* origin;
+        unsigned long epoch;
+        std::string data;
+        bool error;
+        bool retry;
+        /* the shared connection is lost, and no more replies are coming */
+        bool hangup;
+        Time enqueued;
+    };
+
+    /*
+     * Replies handed back to a listen thread by the shared backend threads,
+     * which write the eventfd polled by the thread to wake it
+     */
+    class SharedReplies
+        : public Connection
+    {
+        util::mpsc_queue<SharedReply*> _queue;
+        std::atomic<bool> _notified;
+    public:
+        std::atomic<long> depth;
+        std::atomic<long long> handoff_ns;
+        std::atomic<long> handoffs;
+
+        explicit SharedReplies(Proxy* p);
+        ~SharedReplies();
+
+        void push(SharedReply* r);
+        /* wake the thread if it isn't woken yet since it last took the replies */
+        void notify();
+
+        void on_events(int events);
+        void on_error() {}
+        std::string str() const;
+    };
+
+    struct SharedBackendStat {
+        long conns;
+        long queue_depth;
+        long max_queue_depth;
+        Interval handoff;
+    };
+
+    /* Start threads owning the backend connections; none is started by default */
+    void start_shared_backends(int threads);
+    /*
+     * Set up the backends without starting their threads; the calling thread
+     * then runs their polls with poll_shared_backends, like tests do
+     */
+    void setup_shared_backends(int threads);
+    /* Run a poll without waiting on each backend; returns the events handled */
+    int poll_shared_backends();
+    /* Close the connections of backends not started, and drop the backends */
+    void close_shared_backends();
+    bool shared_backends_enabled();
+    /* The thread owning the connection to the node takes the request */
+    void forward_to_shared_backend(SharedRequest* req);
+    std::vector<SharedBackendStat> shared_backend_stats();
+
+}
+
+#endif /* __CERBERUS_SHARED_BACKEND_HPP__ */
@@ -1,3 +1,5 @@
+#include <map>
+#include <cstdlib>
 #include <algorithm>
 #include <stdexcept>
 #include <cppformat/format.h>
@@ -7,6 +9,7 @@
 #include "fdutil.hpp"
 #include "proxy.hpp"
 #include "buffer.hpp"
+#include "message.hpp"
 #include "utils/random.hpp"
 #include "utils/logging.hpp"
 #include "utils/string.h"
@@ -23,34 +26,57 @@ SlotMap::SlotMap()
     fillServers(*this);
 }
 
+/*
+ * Map each range to its server and return servers no longer mapped to any
+ * slot; the old and new maps are only compared run by run
+ */
+static std::set<Server*> map_ranges(
+    Server* servers[], std::vector<std::pair<RedisNode const*, Server*>> const& node_servers)
+{
+    std::set<Server*> removed;
+    Server* last = nullptr;
+    std::for_each(servers, servers + CLUSTER_SLOT_COUNT,
+                  [&](Server* s)
+                  {
+                      if (s != last) {
+                          removed.insert(last = s);
+                      }
+                  });
+    for (auto const& ns: node_servers) {
+        for (auto const& rg: ns.first->slot_ranges) {
+            if (rg.first <= rg.second && rg.second < CLUSTER_SLOT_COUNT) {
+                std::fill(servers + rg.first, servers + rg.second + 1, ns.second);
+            }
+        }
+    }
+    last = nullptr;
+    std::for_each(servers, servers + CLUSTER_SLOT_COUNT,
+                  [&](Server* s)
+                  {
+                      if (s != last) {
+                          removed.erase(last = s);
+                      }
+                  });
+    removed.erase(nullptr);
+    return removed;
+}
+
 static std::function<std::set<Server*>(
         Server* servers[],
         std::vector<RedisNode> const& nodes,
         Proxy* proxy)> replace_map(
     [](Server* servers[], std::vector<RedisNode> const& nodes, Proxy* proxy)
     {
-        std::set<Server*> removed;
-        std::set<Server*> new_mapped;
+        std::vector<std::pair<RedisNode const*, Server*>> node_servers;
         for (auto const& node: nodes) {
             if (node.slot_ranges.empty()) {
                 continue;
             }
             Server* server = Server::get_server(node.addr, proxy);
             LOG(DEBUG) << "Get " << server->str() << " for " << node.addr.str();
-            for (auto const& rg: node.slot_ranges) {
-                for (slot s = rg.first; s <= rg.second; ++s) {
-                    removed.insert(servers[s]);
-                    new_mapped.insert(server);
-                    servers[s] = server;
-                }
-            }
+            node_servers.push_back(std::make_pair(&node, server));
         }
-        std::set<Server*> r;
-        std::set_difference(
-            removed.begin(), removed.end(), new_mapped.begin(), new_mapped.end(),
-            std::inserter(r, r.end()));
-        r.erase(nullptr);
-        return r;
+        return map_ranges(servers, node_servers);
     });
 
 void SlotMap::replace_map(std::vector<RedisNode> const& nodes, Proxy* proxy)
@@ -63,8 +89,14 @@ void SlotMap::replace_map(std::vector<RedisNode> const& nodes, Proxy* proxy)
 void SlotMap::clear()
 {
     std::set<Server*> r;
-    std::for_each(this->begin(), this->end(), [&](Server* s) {r.insert(s);});
-    r.erase(nullptr);
+    std::for_each(this->begin(), this->end(),
+                  [&](Server* s)
+                  {
+                      if (s != nullptr) {
+                          r.insert(s);
+                          r.insert(s->replicas().begin(), s->replicas().end());
+                      }
+                  });
     for (Server* s: r) {
         s->close_conn();
     }
@@ -134,57 +166,395 @@ std::vector<RedisNode> cerb::parse_slot_map(std::string const& nodes_info,
     return slot_map;
 }
 
+namespace {
+
+    /* Node of a parsed reply; CLUSTER SLOTS only contains arrays, integers and strings */
+    struct ReplyElement {
+        cerb::rint integer;
+        std::string str;
+        std::vector<ReplyElement> elements;
+
+        ReplyElement()
+            : integer(0)
+        {}
+    };
+
+    class ReplyTreeBuilder {
+        typedef Buffer::const_iterator Iterator;
+
+        std::vector<ReplyElement*> _open_arrays;
+        std::vector<cerb::rint> _missing_elements;
+
+        ReplyElement& _next_element()
+        {
+            if (this->_open_arrays.empty()) {
+                return this->root;
+            }
+            ReplyElement* arr = this->_open_arrays.back();
+            arr->elements.push_back(ReplyElement());
+            if (--this->_missing_elements.back() == 0) {
+                this->_open_arrays.pop_back();
+                this->_missing_elements.pop_back();
+            }
+            return arr->elements.back();
+        }
+    public:
+        ReplyElement root;
+
+        Iterator on_int(cerb::rint value, Iterator next)
+        {
+            this->_next_element().integer = value;
+            return next;
+        }
+
+        Iterator on_sstr(Iterator begin, Iterator end)
+        {
+            Iterator next = msg::parse_simple_str(begin, end);
+            this->_next_element().str = std::string(begin, next - msg::LENGTH_OF_CR_LF);
+            return next;
+        }
+
+        Iterator on_lstr(cerb::rint size, Iterator begin, Iterator end)
+        {
+            Iterator next = msg::parse_str(size, begin, end);
+            this->_next_element().str = std::string(begin, begin + size);
+            return next;
+        }
+
+        void on_arr(cerb::rint size, Iterator)
+        {
+            ReplyElement& e = this->_next_element();
+            if (size > 0) {
+                this->_open_arrays.push_back(&e);
+                this->_missing_elements.push_back(size);
+            }
+        }
+
+        Iterator on_nil(Iterator next)
+        {
+            this->_next_element();
+            return next;
+        }
+
+        Iterator on_err(Iterator begin, Iterator end)
+        {
+            Iterator next = msg::parse_simple_str(begin, end);
+            LOG(ERROR) << "Cluster slots error: "
+                       << std::string(begin, next - msg::LENGTH_OF_CR_LF);
+            this->_next_element();
+            return next;
+        }
+    };
+
+}
+
+/*
+ * Reply of CLUSTER SLOTS is an array of
+ *   [first slot, last slot, [master host, port, id], [replica host, port, id]...]
+ * and a master serving several ranges is listed once for each
+ */
+std::vector<RedisNode> cerb::parse_cluster_slots(Buffer const& rsp,
+                                                 std::string const& default_host)
+{
+    ReplyTreeBuilder builder;
+    msg::parse(rsp.cbegin(), rsp.cend(), builder);
+
+    std::vector<RedisNode> nodes;
+    std::map<std::string, msize_t> node_index;
+    for (ReplyElement const& range: builder.root.elements) {
+        if (range.elements.size() < 3) {
+            continue;
+        }
+        cerb::rint first = range.elements[0].integer;
+        cerb::rint last = range.elements[1].integer;
+        if (first < 0 || last < first || cerb::rint(CLUSTER_SLOT_COUNT) <= last) {
+            LOG(ERROR) << "Discard invalid slot range " << first << '-' << last;
+            continue;
+        }
+        std::string master_id;
+        for (msize_t i = 2; i < range.elements.size(); ++i) {
+            std::vector<ReplyElement> const& n = range.elements[i].elements;
+            if (n.size() < 2) {
+                continue;
+            }
+            util::Address addr(n[0].str.empty() ? default_host : n[0].str, n[1].integer);
+            /* node ids are not in the reply before Redis 4 */
+            std::string id(2 < n.size() && !n[2].str.empty() ? n[2].str : addr.str());
+            auto found = node_index.find(id);
+            if (found == node_index.end()) {
+                found = node_index.insert(std::make_pair(id, nodes.size())).first;
+                if (i == 2) {
+                    nodes.push_back(RedisNode(addr, id));
+                } else {
+                    nodes.push_back(RedisNode(addr, id, master_id));
+                }
+            }
+            if (i == 2) {
+                master_id = id;
+                nodes[found->second].slot_ranges.insert(std::make_pair(first, last));
+            }
+        }
+    }
+    return nodes;
+}
+
+static std::string const CLUSTER_SLOTS_CMD("*2\r\n$7\r\ncluster\r\n$5\r\nslots\r\n");
 static std::string const CLUSTER_NODES_CMD("*2\r\n$7\r\ncluster\r\n$5\r\nnodes\r\n");
 
 void cerb::write_slot_map_cmd_to(int fd)
+{
+    flush_string(fd, CLUSTER_SLOTS_CMD);
+}
+
+namespace {
+
+    std::string const SLOT_MAP_MAGIC("CERBSLOT\x01");
+
+    void encode_uint(std::string& out, unsigned value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i) {
+            out += char(value & 0xff);
+            value >>= 8;
+        }
+    }
+
+    void encode_str(std::string& out, std::string const& s)
+    {
+        encode_uint(out, unsigned(s.size()), 2);
+        out += s;
+    }
+
+    class SlotMapDecoder {
+        std::string const& _data;
+        std::string::size_type _pos;
+
+        void _require(std::string::size_type n)
+        {
+            if (this->_data.size() - this->_pos < n) {
+                throw std::runtime_error("Slot map data truncated");
+            }
+        }
+    public:
+        explicit SlotMapDecoder(std::string const& data)
+            : _data(data)
+            , _pos(0)
+        {}
+
+        unsigned uint(int bytes)
+        {
+            this->_require(bytes);
+            unsigned value = 0;
+            for (int i = bytes - 1; i >= 0; --i) {
+                value = (value << 8) | static_cast<unsigned char>(this->_data[this->_pos + i]);
+            }
+            this->_pos += bytes;
+            return value;
+        }
+
+        std::string str()
+        {
+            std::string::size_type n = this->uint(2);
+            this->_require(n);
+            std::string s(this->_data, this->_pos, n);
+            this->_pos += n;
+            return s;
+        }
+
+        void magic(std::string const& m)
+        {
+            this->_require(m.size());
+            if (this->_data.compare(0, m.size(), m) != 0) {
+                throw std::runtime_error("Not a slot map");
+            }
+            this->_pos += m.size();
+        }
+
+        bool end() const
+        {
+            return this->_pos == this->_data.size();
+        }
+    };
+
+}
+
+/*
+ * Magic with format version, node count, then for each node its host,
+ * port, node id, master id and slot ranges; integers are little endian
+ */
+std::string cerb::encode_slot_map(std::vector<RedisNode> const& nodes)
+{
+    std::string out(SLOT_MAP_MAGIC);
+    encode_uint(out, unsigned(nodes.size()), 2);
+    for (RedisNode const& node: nodes) {
+        encode_str(out, node.addr.host);
+        encode_uint(out, unsigned(node.addr.port), 2);
+        encode_str(out, node.node_id);
+        encode_str(out, node.master_id);
+        encode_uint(out, unsigned(node.slot_ranges.size()), 2);
+        for (auto const& rg: node.slot_ranges) {
+            encode_uint(out, rg.first, 2);
+            encode_uint(out, rg.second, 2);
+        }
+    }
+    return out;
+}
+
+std::vector<RedisNode> cerb::decode_slot_map(std::string const& data)
+{
+    SlotMapDecoder d(data);
+    d.magic(SLOT_MAP_MAGIC);
+    std::vector<RedisNode> nodes;
+    for (unsigned n = d.uint(2); n != 0; --n) {
+        std::string host(d.str());
+        int port = int(d.uint(2));
+        std::string node_id(d.str());
+        RedisNode node(util::Address(std::move(host), port), std::move(node_id), d.str());
+        for (unsigned r = d.uint(2); r != 0; --r) {
+            slot first = d.uint(2);
+            slot last = d.uint(2);
+            if (last < first || CLUSTER_SLOT_COUNT <= last) {
+                throw std::runtime_error("Invalid slot range in slot map");
+            }
+            node.slot_ranges.insert(std::make_pair(first, last));
+        }
+        nodes.push_back(std::move(node));
+    }
+    if (!d.end()) {
+        throw std::runtime_error("Unexpected data after slot map");
+    }
+    return nodes;
+}
+
+void cerb::write_topology_probe_cmd_to(int fd)
 {
     flush_string(fd, CLUSTER_NODES_CMD);
 }
 
+std::size_t cerb::topology_digest(std::string const& nodes_info, bool& master_failing)
+{
+    master_failing = false;
+    std::vector<std::string> lines;
+    for (std::string const& line: util::split_str(nodes_info, "\n", true)) {
+        std::vector<std::string> line_cont(util::split_str(line, " ", true));
+        if (line_cont.size() < 8) {
+            continue;
+        }
+        /* "fail?" is PFAIL; a failed master left without slots no longer matters */
+        if (line_cont.size() > 8 &&
+            line_cont[2].find("master") != std::string::npos &&
+            line_cont[2].find("fail") != std::string::npos) {
+            master_failing = true;
+        }
+        /* ping-sent, pong-recv and link-state change all the time without any failover */
+        line_cont.erase(line_cont.begin() + 7);
+        line_cont.erase(line_cont.begin() + 4, line_cont.begin() + 6);
+        lines.push_back(util::join(" ", line_cont));
+    }
+    /* order of lines is not stable between nodes */
+    std::sort(lines.begin(), lines.end());
+    return std::hash<std::string>()(util::join("\n", lines));
+}
+
+std::vector<ReplicaLag> cerb::parse_replication_info(std::string const& info,
+                                                     util::Address const& master)
+{
+    /*
+     * slave0:ip=127.0.0.1,port=7001,state=online,offset=3439,lag=0
+     * master_repl_offset:3439
+     */
+    long master_offset = 0;
+    std::vector<ReplicaLag> lags;
+    for (std::string const& line: util::split_str(info, "\r\n", true)) {
+        std::string::size_type colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string key(line.substr(0, colon));
+        if (key == "master_repl_offset") {
+            master_offset = std::atol(line.substr(colon + 1).c_str());
+            continue;
+        }
+        if (!util::stristartswith(key, "slave")) {
+            continue;
+        }
+        std::map<std::string, std::string> fields;
+        for (std::string const& f: util::split_str(line.substr(colon + 1), ",", true)) {
+            std::string::size_type eq = f.find('=');
+            if (eq != std::string::npos) {
+                fields[f.substr(0, eq)] = f.substr(eq + 1);
+            }
+        }
+        if (fields["ip"].empty()) {
+            continue;
+        }
+        lags.push_back(ReplicaLag(util::Address(fields["ip"], util::atoi(fields["port"])), master,
+                                  fields["state"] == "online", std::atol(fields["offset"].c_str()),
+                                  std::atol(fields["lag"].c_str())));
+    }
+    for (ReplicaLag& g: lags) {
+        g.offset_lag = std::max(master_offset - g.offset_lag, 0L);
+    }
+    return lags;
+}
+
 void SlotMap::select_slave_if_possible(std::string host_beginning)
 {
     ::replace_map =
         [=](Server* servers[], std::vector<RedisNode> const& nodes, Proxy* proxy)
         {
-            std::map<std::string, RedisNode const*> slave_of_map;
+            std::set<Server*> old_replicas;
+            Server* last = nullptr;
+            std::for_each(servers, servers + CLUSTER_SLOT_COUNT,
+                          [&](Server* s)
+                          {
+                              if (s != last && s != nullptr) {
+                                  old_replicas.insert(s->replicas().begin(), s->replicas().end());
+                                  s->set_replicas(std::vector<Server*>());
+                              }
+                              last = s;
+                          });
+
+            std::map<std::string, std::vector<RedisNode const*>> slaves_of_map;
             for (auto const& node: nodes) {
-                if (node.is_master()) {
-                    continue;
+                if (!node.is_master()) {
+                    slaves_of_map[node.master_id].push_back(&node);
                 }
-                auto s = slave_of_map.find(node.master_id);
-                if (s != slave_of_map.end()
-                        && util::stristartswith(s->second->addr.host, host_beginning))
-                {
-                    continue;
-                }
-                LOG(DEBUG) << fmt::format("Use slave {} instead of master {}",
-                                          node.addr.str(), node.master_id);
-                slave_of_map[node.master_id] = &node;
             }
-            std::set<Server*> removed;
-            std::set<Server*> new_mapped;
+            std::vector<std::pair<RedisNode const*, Server*>> node_servers;
+            std::set<Server*> new_servers;
             for (auto const& node: nodes) {
                 if (node.slot_ranges.empty()) {
                     continue;
                 }
-                auto slave_i = slave_of_map.find(node.node_id);
-                Server* server = Server::get_server(
-                    slave_i == slave_of_map.end() ? node.addr : slave_i->second->addr,
-                    proxy);
-                LOG(DEBUG) << "Select " << server->addr.str() << " for " << node.addr.str();
-                for (auto const& rg: node.slot_ranges) {
-                    for (slot s = rg.first; s <= rg.second; ++s) {
-                        removed.insert(servers[s]);
-                        new_mapped.insert(server);
-                        servers[s] = server;
+                Server* server = Server::get_server(node.addr, proxy);
+                node_servers.push_back(std::make_pair(&node, server));
+                new_servers.insert(server);
+
+                std::vector<RedisNode const*> const& slaves = slaves_of_map[node.node_id];
+                bool any_preferred = std::any_of(
+                    slaves.begin(), slaves.end(),
+                    [&](RedisNode const* s)
+                    {
+                        return util::stristartswith(s->addr.host, host_beginning);
+                    });
+                std::vector<Server*> replicas;
+                for (RedisNode const* s: slaves) {
+                    if (any_preferred && !util::stristartswith(s->addr.host, host_beginning)) {
+                        continue;
                     }
+                    LOG(DEBUG) << fmt::format("Read from slave {} of master {}",
+                                              s->addr.str(), node.addr.str());
+                    replicas.push_back(Server::get_server(s->addr, proxy));
+                    new_servers.insert(replicas.back());
                 }
+                server->set_replicas(std::move(replicas));
+            }
+            /* a master demoted to slave is still in use as a replica */
+            std::set<Server*> removed(map_ranges(servers, node_servers));
+            removed.insert(old_replicas.begin(), old_replicas.end());
+            for (Server* s: new_servers) {
+                removed.erase(s);
             }
-            std::set<Server*> r;
-            std::set_difference(
-                removed.begin(), removed.end(), new_mapped.begin(), new_mapped.end(),
-                std::inserter(r, r.end()));
-            r.erase(nullptr);
-            return r;
+            return removed;
         };
 }
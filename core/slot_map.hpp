@@ -2,6 +2,7 @@
 #define __CERBERUS_SLOT_MAP_HPP__
 
 #include <set>
+#include <vector>
 #include <string>
 
 #include "common.hpp"
@@ -11,6 +12,7 @@ namespace cerb {
 
     class Server;
     class Proxy;
+    class Buffer;
 
     struct RedisNode {
         util::Address addr;
@@ -49,6 +51,39 @@ namespace cerb {
         }
     };
 
+    /* Result of one topology update, published to every thread and never modified */
+    struct SlotMapSnapshot {
+        unsigned long const version;
+        bool const cluster_ok;
+        /* loaded from the file saved by the last run, not yet confirmed by the cluster */
+        bool const unverified;
+        std::vector<RedisNode> const nodes;
+
+        SlotMapSnapshot(unsigned long v, bool ok, bool u, std::vector<RedisNode> n)
+            : version(v)
+            , cluster_ok(ok)
+            , unverified(u)
+            , nodes(std::move(n))
+        {}
+    };
+
+    /* How far a slave is behind its master, as the master reports in INFO replication */
+    struct ReplicaLag {
+        util::Address addr;
+        util::Address master;
+        bool online;
+        long offset_lag;
+        long seconds_lag;
+
+        ReplicaLag(util::Address a, util::Address m, bool o, long ol, long sl)
+            : addr(std::move(a))
+            , master(std::move(m))
+            , online(o)
+            , offset_lag(ol)
+            , seconds_lag(sl)
+        {}
+    };
+
     class SlotMap {
         Server* _servers[CLUSTER_SLOT_COUNT];
     public:
@@ -80,17 +115,42 @@ namespace cerb {
             return _servers[s];
         }
 
+        void set_by_slot(slot s, Server* svr)
+        {
+            _servers[s] = svr;
+        }
+
         void replace_map(std::vector<RedisNode> const& nodes, Proxy* proxy);
         void clear();
         Server* random_addr() const;
 
+        /*
+         * Map slots to masters and attach their slaves as replicas to read from;
+         * if any slave of a master has a host starting with host_beginning, only those are used
+         */
         static void select_slave_if_possible(std::string host_beginning);
     };
 
     std::vector<RedisNode> parse_slot_map(std::string const& nodes_info,
                                           std::string const& default_host);
+    std::vector<RedisNode> parse_cluster_slots(Buffer const& rsp,
+                                               std::string const& default_host);
     void write_slot_map_cmd_to(int fd);
 
+    /* Compact binary form of a slot map; decoding throws std::runtime_error if corrupted */
+    std::string encode_slot_map(std::vector<RedisNode> const& nodes);
+    std::vector<RedisNode> decode_slot_map(std::string const& data);
+
+    /*
+     * Hash of the parts of CLUSTER NODES output that matter to the slot map:
+     * ids, addresses, flags, masters, config epochs and slots
+     */
+    std::size_t topology_digest(std::string const& nodes_info, bool& master_failing);
+    void write_topology_probe_cmd_to(int fd);
+
+    std::vector<ReplicaLag> parse_replication_info(std::string const& info,
+                                                   util::Address const& master);
+
 }
 
 #endif /* __CERBERUS_SLOT_MAP_HPP__ */
@@ -2,6 +2,8 @@
 
 #include "stats.hpp"
 #include "globals.hpp"
+#include "shared_backend.hpp"
+#include "background.hpp"
 #include "utils/string.h"
 
 using namespace cerb;
@@ -15,37 +17,81 @@ std::string cerb::stats_all()
 
     std::vector<std::string> clients_counts;
     std::vector<std::string> acceptings;
+    std::vector<std::string> readies;
     std::vector<std::string> long_conns_counts;
     std::vector<std::string> mem_buffer_allocs;
     std::vector<std::string> last_cmd_elapse;
     std::vector<std::string> last_remote_cost;
+    std::vector<std::string> loads;
+    std::vector<std::string> retirings;
+    std::vector<std::string> migrated_clients;
+    std::vector<std::string> slow_polls;
+    std::vector<std::string> max_poll_elapse;
+    std::vector<std::string> reply_depths;
+    long reply_handoffs = 0;
+    long long reply_handoff_ns = 0;
     long total_commands = 0;
+    long hedged_reads = 0;
+    long hedge_wins = 0;
     Interval total_cmd_elapse(0);
     Interval total_remote_cost(0);
-    for (auto const& thread: cerb_global::all_threads) {
-        util::sref<Proxy const> proxy(thread.get_proxy());
+    std::vector<std::shared_ptr<ListenThread>> threads(cerb_global::listen_threads());
+    for (auto const& thread: threads) {
+        util::sref<Proxy const> proxy(thread->get_proxy());
         clients_counts.push_back(util::str(proxy->clients_count()));
         acceptings.push_back(proxy->accepting() ? "1" : "0");
+        readies.push_back(proxy->ready() ? "1" : "0");
         long_conns_counts.push_back(util::str(proxy->long_conns_count()));
         total_commands += proxy->total_cmd();
         total_cmd_elapse += proxy->total_cmd_elapse();
         total_remote_cost += proxy->total_remote_cost();
-        mem_buffer_allocs.push_back(util::str(thread.buffer_allocated()));
+        hedged_reads += proxy->hedged_reads();
+        hedge_wins += proxy->hedge_wins();
+        mem_buffer_allocs.push_back(util::str(thread->buffer_allocated()));
         last_cmd_elapse.push_back(util::str(proxy->last_cmd_elapse()));
         last_remote_cost.push_back(util::str(proxy->last_remote_cost()));
+        loads.push_back(util::str(proxy->load()));
+        retirings.push_back(thread->retiring() ? "1" : "0");
+        migrated_clients.push_back(util::str(proxy->migrated_clients()));
+        slow_polls.push_back(util::str(proxy->slow_polls()));
+        max_poll_elapse.push_back(util::str(proxy->max_poll_elapse()));
+        if (proxy->shared_replies() != nullptr) {
+            reply_depths.push_back(util::str(proxy->shared_replies()->depth.load()));
+            reply_handoffs += proxy->shared_replies()->handoffs.load();
+            reply_handoff_ns += proxy->shared_replies()->handoff_ns.load();
+        }
+    }
+    std::vector<std::string> backend_conns;
+    std::vector<std::string> backend_depths;
+    std::vector<std::string> backend_handoffs;
+    for (SharedBackendStat const& b: shared_backend_stats()) {
+        backend_conns.push_back(util::str(b.conns));
+        backend_depths.push_back(util::str(b.queue_depth) + "/" + util::str(b.max_queue_depth));
+        backend_handoffs.push_back(util::str(b.handoff));
     }
     std::vector<std::string> remotes_addrs;
     for (util::Address const& a: cerb_global::get_remotes()) {
         remotes_addrs.push_back(a.str());
     }
+    std::vector<std::string> lags;
+    for (ReplicaLag const& g: cerb_global::replica_lags()) {
+        lags.push_back(util::join("", {
+            g.addr.str(), "=", g.online ? "online" : "offline",
+            "/", util::str(g.offset_lag), "/", util::str(g.seconds_lag)}));
+    }
+    BackgroundStat bg(background_stat());
     return util::join("", {
         "version:" VERSION
-        "\nthreads:", util::str(msize_t(cerb_global::all_threads.size())),
+        "\nthreads:", util::str(msize_t(threads.size())),
         "\ncluster_ok:", cerb_global::cluster_ok() ? "1" : "0",
         "\nread_slave:", ::read_slave ? "1" : "0",
         "\nclients_count:", util::join(",", clients_counts),
         "\naccepting:", util::join(",", acceptings),
+        "\nready:", util::join(",", readies),
+        "\nretiring:", util::join(",", retirings),
         "\nlong_connections_count:", util::join(",", long_conns_counts),
+        "\nthread_load:", util::join(",", loads),
+        "\nmigrated_clients:", util::join(",", migrated_clients),
         "\nused_cpu_sys:", util::str(res_usage.ru_stime.tv_sec +
                                      res_usage.ru_stime.tv_usec / 1000000.0),
         "\nused_cpu_user:", util::str(res_usage.ru_utime.tv_sec +
@@ -56,7 +102,22 @@ std::string cerb::stats_all()
         "\ntotal_remote_cost:", util::str(total_remote_cost),
         "\nlast_command_elapse:", util::join(",", last_cmd_elapse),
         "\nlast_remote_cost:", util::join(",", last_remote_cost),
+        "\nslow_polls:", util::join(",", slow_polls),
+        "\nmax_poll_elapse:", util::join(",", max_poll_elapse),
+        "\nbackground_tasks:", util::str(bg.tasks),
+        "\nbackground_queue_depth:", util::str(bg.queue_depth),
+        "\nbackground_task_elapse:", util::str(bg.task_elapse),
+        "\nbackground_task_max_elapse:", util::str(bg.max_task_elapse),
         "\nremotes:", util::join(",", remotes_addrs),
+        "\nreplica_lag:", util::join(",", lags),
+        "\nhedged_reads:", util::str(hedged_reads),
+        "\nhedge_wins:", util::str(hedge_wins),
+        "\nshared_backend_conns:", util::join(",", backend_conns),
+        "\nshared_backend_queue_depth:", util::join(",", backend_depths),
+        "\nshared_backend_handoff:", util::join(",", backend_handoffs),
+        "\nshared_reply_queue_depth:", util::join(",", reply_depths),
+        "\nshared_reply_handoff:", util::str(Interval(
+            reply_handoffs == 0 ? 0 : reply_handoff_ns / 1e9 / reply_handoffs)),
     });
 }
 
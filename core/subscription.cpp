@@ -49,10 +49,9 @@ Subscription::Subscription(Proxy* p, int clientfd, Server* peer, Buffer subs_cmd
     LOG(DEBUG) << "Start subscription " << this->str();
 }
 
-void Subscription::after_events(std::set<Connection*>& active_conns)
+void Subscription::after_events()
 {
     if (this->closed()) {
-        active_conns.erase(&this->_server);
         delete this;
     }
 }
@@ -92,10 +91,9 @@ void Subscription::ServerConn::on_events(int events)
     }
 }
 
-void Subscription::ServerConn::after_events(std::set<Connection*>& active_conns)
+void Subscription::ServerConn::after_events()
 {
     if (this->closed()) {
-        active_conns.erase(this->_peer);
         delete this->_peer;
     }
 }
@@ -116,10 +114,9 @@ BlockedListPop::BlockedListPop(Proxy* p, int clientfd, Server* peer, Buffer cmd)
     LOG(DEBUG) << "Start blocked pop " << this->str();
 }
 
-void BlockedListPop::after_events(std::set<Connection*>& active_conns)
+void BlockedListPop::after_events()
 {
     if (this->closed()) {
-        active_conns.erase(&this->_server);
         delete this;
     }
 }
@@ -188,10 +185,9 @@ void BlockedListPop::ServerConn::on_error()
     this->_peer->restore_client(Response::NIL, true);
 }
 
-void BlockedListPop::ServerConn::after_events(std::set<Connection*>& active_conns)
+void BlockedListPop::ServerConn::after_events()
 {
     if (this->closed()) {
-        active_conns.erase(this->_peer);
         delete this->_peer;
     }
 }
@@ -31,7 +31,7 @@ namespace cerb {
                        Subscription* peer);
 
             void on_events(int events);
-            void after_events(std::set<Connection*>& active_conns);
+            void after_events();
             std::string str() const;
         };
 
@@ -39,7 +39,7 @@ namespace cerb {
     public:
         Subscription(Proxy* proxy, int clientfd, Server* peer, Buffer subs_cmd);
 
-        void after_events(std::set<Connection*>& active_conns);
+        void after_events();
         std::string str() const;
     };
 
@@ -56,7 +56,7 @@ namespace cerb {
 
             void on_events(int events);
             void on_error();
-            void after_events(std::set<Connection*>& active_conns);
+            void after_events();
             std::string str() const;
         };
 
@@ -65,7 +65,7 @@ namespace cerb {
     public:
         BlockedListPop(Proxy* proxy, int clientfd, Server* peer, Buffer cmd);
 
-        void after_events(std::set<Connection*>& active_conns);
+        void after_events();
         std::string str() const;
         void restore_client(Buffer const& rsp, bool update_slot_map);
     };
@@ -1,14 +1,23 @@
 #include <unistd.h>
+#include <sys/stat.h>
 #include <csignal>
+#include <cstring>
+#include <cstdlib>
 #include <map>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <thread>
 
 #include "core/globals.hpp"
 #include "core/command.hpp"
+#include "core/client.hpp"
 #include "core/server.hpp"
+#include "core/shared_backend.hpp"
+#include "core/background.hpp"
+#include "core/handoff.hpp"
+#include "syscalls/fctl.h"
 #include "utils/logging.hpp"
 #include "utils/address.hpp"
 #include "utils/random.hpp"
@@ -17,6 +26,38 @@
 
 namespace {
 
+    int const WARM_UP_STAGGER_MS = 5;
+
+    /*
+     * Thread i of n runs on the i-th block of cpus / n contiguous CPUs,
+     * which lie on one NUMA node unless a block crosses the boundary of
+     * two; the CPUs left over go to the last thread. These are the very
+     * CPUs whose connections the reuseport program passes to its acceptor
+     */
+    std::vector<int> cpus_of_thread(int i, int thread_count, int cpus)
+    {
+        if (cpus < thread_count) {
+            return std::vector<int>({i % cpus});
+        }
+        int per_thread = cpus / thread_count;
+        int end = i == thread_count - 1 ? cpus : (i + 1) * per_thread;
+        std::vector<int> r;
+        for (int c = i * per_thread; c < end; ++c) {
+            r.push_back(c);
+        }
+        return r;
+    }
+
+    void steer_by_cpu(int listen_fd, int thread_count, int cpus)
+    {
+        /* a program attached to any socket applies to the whole reuseport group */
+        if (fctl::steer_reuseport_by_cpu(listen_fd, thread_count, cpus / thread_count) < 0) {
+            LOG(WARNING) << "Fail to steer connections by CPU: " << strerror(errno);
+            return;
+        }
+        LOG(INFO) << "Steer connections to the thread on the CPU receiving them";
+    }
+
     class Configuration {
         std::map<std::string, std::string> _config;
 
@@ -103,14 +144,80 @@ namespace {
 
     void run(Configuration const& config)
     {
+        bool balance_reads = true;
         if (config.get("read-slave", "") == "yes") {
             LOG(INFO) << "Readonly proxy, use slaves for reading if possible";
-            cerb::Server::send_readonly_for_each_conn();
             cerb::stats_set_read_slave();
-            cerb::SlotMap::select_slave_if_possible(config.get("read-slave-filter", ""));
         } else {
             LOG(INFO) << "Writable proxy";
             cerb::Command::allow_write_commands();
+            balance_reads = config.get("read-write-split", "") == "yes";
+            if (balance_reads) {
+                LOG(INFO) << "Writing commands go to masters, reading commands to slaves if possible";
+            }
+        }
+        bool stale_reads = config.get("stale-reads", "") == "yes";
+        if (stale_reads) {
+            LOG(INFO) << "Reading commands go to slaves while their master is unreachable";
+        }
+        if (balance_reads || stale_reads) {
+            cerb::SlotMap::select_slave_if_possible(config.get("read-slave-filter", ""));
+        }
+        int replication_probe_ms = util::atoi(config.get("replication-probe-interval-ms", "1000"));
+        if (replication_probe_ms < 0) {
+            LOG(ERROR) << "Invalid replication probe interval";
+            exit(1);
+        }
+        cerb_global::replication_probe_interval = std::chrono::milliseconds(replication_probe_ms);
+        cerb_global::replica_max_lag_bytes = util::atoi(config.get("replica-max-lag-bytes", "0"));
+        cerb_global::replica_max_lag_seconds = util::atoi(config.get("replica-max-lag-seconds", "0"));
+        int hedge_percent = util::atoi(config.get("hedge-reads-percent", "0"));
+        int hedge_min_delay_ms = util::atoi(config.get("hedge-min-delay-ms", "2"));
+        if (hedge_percent < 0 || hedge_min_delay_ms < 0) {
+            LOG(ERROR) << "Invalid hedged reads option";
+            exit(1);
+        }
+        if (hedge_percent != 0) {
+            LOG(INFO) << "Slow reading commands are also sent to another replica, up to "
+                      << hedge_percent << "% more reads";
+        }
+        cerb_global::hedge_read_budget = hedge_percent / 100.0;
+        cerb_global::hedge_min_delay = std::chrono::milliseconds(hedge_min_delay_ms);
+        cerb::Server::set_read_policy(
+            balance_reads, config.get("read-slave-include-master", "") == "yes", stale_reads);
+        cerb::Command::read_from_master(
+            util::split_str(config.get("read-master-commands", ""), ",", true),
+            util::split_str(config.get("read-master-key-prefixes", ""), ",", true));
+
+        int backend_conns = util::atoi(config.get("backend-connections", "1"));
+        int bulk_request_bytes = util::atoi(config.get("bulk-request-bytes", "65536"));
+        if (backend_conns <= 0 || bulk_request_bytes < 0) {
+            LOG(ERROR) << "Invalid backend connections option";
+            exit(1);
+        }
+        bool bulk_lane = config.get("bulk-lane", "") == "yes";
+        if (bulk_lane) {
+            LOG(INFO) << "Large requests and bulk commands go over a separate connection to each node";
+            std::string bulk_commands(config.get("bulk-commands", ""));
+            if (!bulk_commands.empty()) {
+                cerb::Command::set_bulk_commands(util::split_str(bulk_commands, ",", true));
+            }
+        }
+        cerb::Server::set_lanes(backend_conns, bulk_lane, std::size_t(bulk_request_bytes));
+
+        int shared_backend_threads = util::atoi(config.get("shared-backend-threads", "0"));
+        if (shared_backend_threads < 0) {
+            LOG(ERROR) << "Invalid shared backend threads count";
+            exit(1);
+        }
+        if (shared_backend_threads != 0) {
+            LOG(INFO) << "All threads share connections to each node, owned by "
+                      << shared_backend_threads << " backend thread(s)";
+            if (backend_conns != 1 || bulk_lane) {
+                LOG(WARNING) << "backend-connections and bulk-lane are ignored"
+                                " when connections are shared";
+            }
+            cerb::start_shared_backends(shared_backend_threads);
         }
 
         if (config.get("cluster-require-full-coverage", "") == "no") {
@@ -118,6 +225,11 @@ namespace {
             cerb_global::set_cluster_req_full_cov(false);
         }
 
+        if (config.get("fast-path", "") == "no") {
+            LOG(INFO) << "All commands go through command groups";
+            cerb::Client::set_fast_path(false);
+        }
+
         int slow_poll_ms = util::atoi(config.get("slow-poll-elapse-ms", "50"));
         if (slow_poll_ms <= 0) {
             LOG(ERROR) << "Invalid slow poll elapse";
@@ -125,12 +237,56 @@ namespace {
         }
         cerb_global::slow_poll_elapse = std::chrono::milliseconds(slow_poll_ms);
 
-        int bind_port = util::atoi(config.get("bind"));
+        int background_threads = util::atoi(config.get("background-threads", "1"));
+        if (background_threads < 0) {
+            LOG(ERROR) << "Invalid background threads count";
+            exit(1);
+        }
+        cerb::start_background_workers(background_threads);
+
+        int probe_ms = util::atoi(config.get("topology-probe-interval-ms", "1000"));
+        int probe_jitter_ms = util::atoi(config.get("topology-probe-jitter-ms", "100"));
+        if (probe_ms < 0 || probe_jitter_ms < 0) {
+            LOG(ERROR) << "Invalid topology probe interval";
+            exit(1);
+        }
+        cerb_global::set_topology_probe(std::chrono::milliseconds(probe_ms),
+                                        std::chrono::milliseconds(probe_jitter_ms));
+
+        int warm_up_ms = util::atoi(config.get("warm-up-timeout-ms", "0"));
+        if (warm_up_ms < 0) {
+            LOG(ERROR) << "Invalid warm up timeout";
+            exit(1);
+        }
+        cerb_global::warm_up_timeout = std::chrono::milliseconds(warm_up_ms);
+
+        int bind_port = util::atoi(config.get("bind", "0"));
+        std::string unix_socket(config.get("unix-socket", ""));
+        if (bind_port < 0 || (bind_port == 0 && unix_socket.empty())) {
+            LOG(ERROR) << "Invalid bind port, and no unix socket set";
+            exit(1);
+        }
         int thread_count = util::atoi(config.get("thread", "1"));
         if (thread_count <= 0) {
             LOG(ERROR) << "Invalid thread count";
             exit(1);
         }
+        if (config.get("balance-threads", "") == "yes") {
+            LOG(INFO) << "Threads much busier than the others hand clients over to them";
+            cerb_global::balance_threads = true;
+        }
+        int drain_ms = util::atoi(config.get("thread-drain-timeout-ms", "10000"));
+        if (drain_ms < 0) {
+            LOG(ERROR) << "Invalid thread drain timeout";
+            exit(1);
+        }
+        cerb_global::thread_drain_timeout = std::chrono::milliseconds(drain_ms);
+        bool cpu_affinity = config.get("cpu-affinity", "") == "yes";
+        bool cpu_steering = config.get("reuseport-cpu-steering", "") == "yes";
+        if (cpu_steering && !cpu_affinity) {
+            LOG(ERROR) << "reuseport-cpu-steering needs cpu-affinity set to \"yes\"";
+            exit(1);
+        }
 
         if (config.contains("node")) {
             cerb_global::set_remotes(util::Address::from_hosts_ports(config.get("node")));
@@ -139,16 +295,71 @@ namespace {
                             " use `SETREMOTES <host> <port>' in a redis-cli prompt";
         }
 
-        for (int i = 0; i < thread_count; ++i) {
-            cerb_global::all_threads.push_back(cerb::ListenThread(bind_port));
+        if (config.contains("slot-map-file") &&
+            cerb_global::load_slot_map_file(config.get("slot-map-file"))) {
+            LOG(INFO) << "Route by slot map saved in " << config.get("slot-map-file")
+                      << " until it is verified";
+        }
+
+        std::string handoff_path(config.get("handoff-socket", ""));
+        int handoff_conn = -1;
+        if (!handoff_path.empty()) {
+            handoff_conn = cerb::take_over(handoff_path);
+            if (cerb::inherited_listeners() > thread_count) {
+                /* each socket taken over has connections queued for an acceptor */
+                thread_count = cerb::inherited_listeners();
+            }
+        }
+
+        /* a unix socket taken over is listened to instead */
+        if (!unix_socket.empty() && cerb_global::unix_listen_fd == -1) {
+            cerb_global::unix_listen_fd = fctl::new_unix_listener(unix_socket);
+            if (config.contains("unix-socket-perm")) {
+                mode_t perm = mode_t(std::strtol(config.get("unix-socket-perm").data(), nullptr, 8));
+                if (::chmod(unix_socket.data(), perm) < 0) {
+                    LOG(WARNING) << "Fail to chmod " << unix_socket << ": " << strerror(errno);
+                }
+            }
         }
-        for (auto& t: cerb_global::all_threads) {
-            t.run();
+
+        int cpus = int(sysconf(_SC_NPROCESSORS_CONF));
+        if (cpu_affinity) {
+            LOG(INFO) << "Pin threads to CPUs, " << cpus << " in total";
+        }
+        if (cpu_steering && cpus < thread_count) {
+            LOG(WARNING) << "Not steering connections by CPU, as threads outnumber "
+                         << cpus << " CPUs";
+            cpu_steering = false;
+        }
+        for (int i = 0; i < thread_count; ++i) {
+            std::shared_ptr<cerb::ListenThread> t(std::make_shared<cerb::ListenThread>(
+                bind_port, cpu_affinity ? ::cpus_of_thread(i, thread_count, cpus)
+                                        : std::vector<int>()));
+            /* listed once run, as a pinned thread has no proxy until then */
+            t->run();
+            cerb_global::add_listen_thread(t);
+            if (i == 0 && cpu_steering) {
+                ::steer_by_cpu(t->get_proxy()->acceptor.fd, thread_count, cpus);
+            }
+            if (warm_up_ms != 0) {
+                /*
+                 * each thread connects to all its backends at once, starting
+                 * threads apart spreads the bursts over the nodes
+                 */
+                std::this_thread::sleep_for(std::chrono::milliseconds(WARM_UP_STAGGER_MS));
+            }
         }
         LOG(INFO) << "Started; listen to port " << bind_port
-                  << " thread=" << thread_count;
-        for (auto& t: cerb_global::all_threads) {
-            t.join();
+                  << " unix socket=" << unix_socket << " thread=" << thread_count;
+        if (handoff_conn != -1) {
+            cerb::finish_take_over(handoff_conn);
+        }
+        if (!handoff_path.empty()) {
+            cerb::serve_handoff(handoff_path, config.get("handoff-clients", "") == "yes");
+        }
+        /* threads are started and retired by THREADS command, none is joined */
+        while (true) {
+            ::pause();
         }
     }
 
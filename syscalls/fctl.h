@@ -8,8 +8,12 @@
 #include "except/exceptions.hpp"
 
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 namespace fctl {
 
@@ -42,6 +46,15 @@ namespace fctl {
         return fd;
     }
 
+    inline int new_event_fd()
+    {
+        int fd = ::eventfd(0, EFD_NONBLOCK);
+        if (fd < 0) {
+            throw cerb::SystemError("eventfd", errno);
+        }
+        return fd;
+    }
+
     inline void connect_fd(std::string const& host, int port, int fd)
     {
         set_tcpnodelay(fd);
@@ -81,6 +94,48 @@ namespace fctl {
         ::listen(fd, 20);
     }
 
+    /* Listen to a unix socket at path, replacing a file left there */
+    inline int new_unix_listener(std::string const& path)
+    {
+        struct sockaddr_un local;
+        ::bzero(&local, sizeof local);
+        local.sun_family = AF_UNIX;
+        if (path.size() >= sizeof local.sun_path) {
+            throw cerb::SystemError("unix socket path " + path, ENAMETOOLONG);
+        }
+        ::strcpy(local.sun_path, path.c_str());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw cerb::IOError("Socket create", errno);
+        }
+        ::unlink(path.c_str());
+        if (::bind(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof local) < 0) {
+            throw cerb::SystemError("bind " + path, errno);
+        }
+        ::listen(fd, SOMAXCONN);
+        set_nonblocking(fd);
+        return fd;
+    }
+
+    /*
+     * Have the kernel pass each connection to the socket of index
+     * (CPU the packet is received on) / cpus_per_group in the reuseport
+     * group, indexed by the order the sockets listened; the CPUs left over
+     * go to the last socket
+     */
+    inline int steer_reuseport_by_cpu(int fd, int groups, int cpus_per_group)
+    {
+        struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU)},
+            {BPF_ALU | BPF_DIV | BPF_K, 0, 0, static_cast<__u32>(cpus_per_group)},
+            {BPF_JMP | BPF_JGE | BPF_K, 0, 1, static_cast<__u32>(groups)},
+            {BPF_LD | BPF_IMM, 0, 0, static_cast<__u32>(groups - 1)},
+            {BPF_RET | BPF_A, 0, 0, 0},
+        };
+        struct sock_fprog prog = {sizeof code / sizeof code[0], code};
+        return ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+    }
+
 }
 
 #else /* _USE_CANDIDATE_FCTL_LIB */
@@ -88,10 +143,13 @@ namespace fctl {
 namespace fctl {
 
     int new_stream_socket();
+    int new_event_fd();
     int set_tcpnodelay(int sockfd);
     void set_nonblocking(int sockfd);
     void connect_fd(std::string const& host, int port, int fd);
     void bind_to(int fd, int port);
+    int new_unix_listener(std::string const& path);
+    int steer_reuseport_by_cpu(int fd, int groups, int cpus_per_group);
 
 }
 
@@ -66,6 +66,15 @@ namespace poll {
         return ::epoll_ctl(epfd, EPOLL_CTL_ADD, evtfd, &ev);
     }
 
+    /* for a socket polled by several threads, woken one at a time */
+    inline int poll_add_exclusive(int epfd, int evtfd, void* data)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLET | EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = data;
+        return ::epoll_ctl(epfd, EPOLL_CTL_ADD, evtfd, &ev);
+    }
+
     inline int poll_read(int epfd, int evtfd, void* data)
     {
         struct epoll_event ev;
@@ -113,6 +122,7 @@ namespace poll {
     int poll_wait(int epfd, pevent* events, int maxevents, int timeout);
     int poll_add_read(int epfd, int evtfd, void* data);
     int poll_add_write(int epfd, int evtfd, void* data);
+    int poll_add_exclusive(int epfd, int evtfd, void* data);
     int poll_read(int epfd, int evtfd, void* data);
     int poll_write(int epfd, int evtfd, void* data);
     void poll_del(int epfd, int evtfd);
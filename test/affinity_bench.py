@@ -0,0 +1,131 @@
+import os
+import time
+import socket
+import tempfile
+import subprocess
+import multiprocessing
+
+import cluster_launcher
+
+PORT = 27184
+THREADS = min(4, multiprocessing.cpu_count())
+CLIENTS = 32
+REQUESTS = 2000
+CONFIG = '''
+bind {port}
+node 127.0.0.1:8800
+thread {threads}
+warm-up-timeout-ms 3000
+cpu-affinity {affinity}
+reuseport-cpu-steering {steering}
+'''
+PERF_EVENTS = 'cache-misses,cache-references,cpu-migrations,context-switches'
+
+
+def run_client(index):
+    s = socket.create_connection(('127.0.0.1', PORT))
+    latencies = []
+    try:
+        for i in xrange(REQUESTS):
+            key = 'key-%d-%d' % (index, i % 100)
+            t = time.time()
+            s.sendall('*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n' % (len(key), key))
+            r = s.recv(1024)
+            latencies.append(time.time() - t)
+            if not r or r[0] == '-':
+                raise IOError(r)
+    finally:
+        s.close()
+    return latencies
+
+
+def wait_ready():
+    while True:
+        try:
+            s = socket.create_connection(('127.0.0.1', PORT))
+            s.sendall('*1\r\n$4\r\nPING\r\n')
+            if s.recv(1024).startswith('+PONG'):
+                s.close()
+                return
+            s.close()
+        except socket.error:
+            pass
+        time.sleep(0.01)
+
+
+def perf_available():
+    devnull = open(os.devnull, 'w')
+    try:
+        return subprocess.call(['perf', 'stat', '-e', PERF_EVENTS, 'true'],
+                               stdout=devnull, stderr=devnull) == 0
+    except OSError:
+        return False
+
+
+def read_perf(path):
+    counters = {}
+    with open(path, 'r') as f:
+        for line in f:
+            fields = line.strip().split(',')
+            if len(fields) > 2 and fields[0].isdigit():
+                counters[fields[2]] = int(fields[0])
+    return counters
+
+
+def measure(affinity, steering, use_perf):
+    conf = tempfile.NamedTemporaryFile(suffix='.conf', delete=False)
+    conf.write(CONFIG.format(port=PORT, threads=THREADS, affinity=affinity,
+                             steering=steering))
+    conf.close()
+    perf_out = tempfile.NamedTemporaryFile(suffix='.perf', delete=False)
+    perf_out.close()
+    args = ['./cerberus', conf.name]
+    if use_perf:
+        args = ['perf', 'stat', '-x,', '-e', PERF_EVENTS,
+                '-o', perf_out.name, '--'] + args
+    devnull = open(os.devnull, 'w')
+    c = subprocess.Popen(args, stdout=devnull, stderr=devnull)
+    try:
+        wait_ready()
+        pool = multiprocessing.Pool(CLIENTS)
+        start = time.time()
+        latencies = sum(pool.map(run_client, xrange(CLIENTS)), [])
+        elapse = time.time() - start
+        pool.close()
+        latencies.sort()
+    finally:
+        c.send_signal(2)
+        c.wait()
+        os.remove(conf.name)
+    counters = read_perf(perf_out.name) if use_perf else {}
+    os.remove(perf_out.name)
+    return (len(latencies) / elapse, latencies[len(latencies) / 2],
+            latencies[len(latencies) * 99 / 100], counters)
+
+
+def main():
+    use_perf = perf_available()
+    cluster_launcher.kill()
+    try:
+        cluster_launcher.launch()
+        time.sleep(1)
+        print '%d threads, %d clients sending %d GETs each' % (
+            THREADS, CLIENTS, REQUESTS)
+        if not use_perf:
+            print 'perf not available; cache misses not counted'
+        print '%-20s %10s %10s %10s %14s %10s' % (
+            'placement', 'req/s', 'p50', 'p99', 'cache-misses', 'migrations')
+        for name, affinity, steering in [('floating', 'no', 'no'),
+                                         ('pinned', 'yes', 'no'),
+                                         ('pinned+steered', 'yes', 'yes')]:
+            qps, p50, p99, counters = measure(affinity, steering, use_perf)
+            print '%-20s %10d %8.3fms %8.3fms %14s %10s' % (
+                name, qps, p50 * 1000, p99 * 1000,
+                counters.get('cache-misses', '-'),
+                counters.get('cpu-migrations', '-'))
+            time.sleep(0.5)
+    finally:
+        cluster_launcher.kill()
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,12 @@
+#include <thread>
+#include <memory>
 #include <gtest/gtest.h>
 
 #include "utils/alg.hpp"
+#include "utils/ring_queue.hpp"
+#include "utils/mpsc_queue.hpp"
+#include "utils/arena.hpp"
+#include "core/connection.hpp"
 
 TEST(Algorithm, MaxElement)
 {
@@ -14,3 +20,249 @@ TEST(Algorithm, MaxElement)
     ASSERT_EQ("dreadful rabbit", *util::max_element(
                     s, [](std::string const& m) { return m.size(); }));
 }
+
+TEST(Algorithm, RingQueue)
+{
+    util::ring_queue<int> q;
+    ASSERT_TRUE(q.empty());
+
+    for (int i = 0; i < 10; ++i) {
+        q.push_back(i);
+    }
+    for (int i = 0; i < 6; ++i) {
+        ASSERT_EQ(i, q.front());
+        q.pop_front();
+    }
+    for (int i = 10; i < 40; ++i) {
+        q.push_back(i);
+    }
+    ASSERT_EQ(34, q.size());
+
+    int expected = 6;
+    for (int x: q) {
+        ASSERT_EQ(expected++, x);
+    }
+    ASSERT_EQ(40, expected);
+
+    q.clear();
+    ASSERT_TRUE(q.empty());
+    q.push_back(100);
+    ASSERT_EQ(100, q.front());
+}
+
+namespace {
+
+    struct NopConnection
+        : cerb::Connection
+    {
+        NopConnection()
+            : cerb::Connection(-1)
+        {}
+
+        void on_events(int) {}
+        void on_error() {}
+
+        std::string str() const
+        {
+            return "";
+        }
+    };
+
+}
+
+TEST(Algorithm, ConnectionList)
+{
+    NopConnection a;
+    NopConnection b;
+    cerb::ActiveConnections active;
+    cerb::DirtyConnections dirty;
+    ASSERT_TRUE(active.empty());
+
+    active.push(&a);
+    active.push(&b);
+    active.push(&a);
+    dirty.push(&a);
+    ASSERT_EQ(&b, active.pop());
+    ASSERT_EQ(&a, active.pop());
+    ASSERT_EQ(nullptr, active.pop());
+    ASSERT_EQ(&a, dirty.pop());
+    ASSERT_TRUE(dirty.empty());
+
+    {
+        NopConnection c;
+        active.push(&a);
+        active.push(&c);
+        active.push(&b);
+    }
+    ASSERT_EQ(&b, active.pop());
+    ASSERT_EQ(&a, active.pop());
+    ASSERT_TRUE(active.empty());
+}
+
+TEST(Algorithm, MPSCQueue)
+{
+    util::mpsc_queue<int> q;
+    int x;
+    ASSERT_FALSE(q.pop(x));
+    q.push(1);
+    q.push(2);
+    ASSERT_TRUE(q.pop(x));
+    ASSERT_EQ(1, x);
+    ASSERT_TRUE(q.pop(x));
+    ASSERT_EQ(2, x);
+    ASSERT_FALSE(q.pop(x));
+
+    int const PRODUCERS = 4;
+    int const EACH = 10000;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; ++p) {
+        producers.push_back(std::thread(
+            [&q, p, EACH]()
+            {
+                for (int i = 0; i < EACH; ++i) {
+                    q.push(p * EACH + i);
+                }
+            }));
+    }
+    std::vector<int> next(PRODUCERS, 0);
+    int popped = 0;
+    while (popped < PRODUCERS * EACH) {
+        if (!q.pop(x)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_EQ(next[x / EACH], x % EACH);
+        ++next[x / EACH];
+        ++popped;
+    }
+    for (auto& t: producers) {
+        t.join();
+    }
+    ASSERT_FALSE(q.pop(x));
+}
+
+TEST(Algorithm, ArenaAllocateRelease)
+{
+    std::size_t const SIZE = 1000;
+    std::vector<char*> objects;
+    for (int i = 0; i < 8; ++i) {
+        char* p = static_cast<char*>(util::arena::allocate(SIZE));
+        ASSERT_EQ(0, reinterpret_cast<std::uintptr_t>(p) % alignof(std::max_align_t));
+        std::fill(p, p + SIZE, char(i));
+        objects.push_back(p);
+    }
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_EQ(char(i), objects[i][0]);
+        ASSERT_EQ(char(i), objects[i][SIZE - 1]);
+        util::arena::release(objects[i]);
+    }
+
+    /* too large for a block */
+    char* large = static_cast<char*>(util::arena::allocate(1024 * 1024));
+    large[1024 * 1024 - 1] = 'x';
+    util::arena::release(large);
+    util::arena::release(nullptr);
+}
+
+TEST(Algorithm, ArenaBlockReuse)
+{
+    std::size_t const SIZE = 1000;
+    std::vector<void*> partial;
+    std::vector<char*> first;
+    for (int i = 0; i < 4; ++i) {
+        first.push_back(static_cast<char*>(util::arena::allocate(SIZE)));
+        partial.push_back(first.back());
+    }
+    /* objects follow each other at the same distance in a block; at most one of these is apart */
+    std::ptrdiff_t stride = first[1] - first[0] == first[2] - first[1]
+        ? first[1] - first[0] : first[3] - first[2];
+    char* last = first.back();
+    /* returns the first object in the next block */
+    auto allocate_block = [&](std::vector<void*>& objects)
+    {
+        while (true) {
+            char* p = static_cast<char*>(util::arena::allocate(SIZE));
+            bool next_block = p != last + stride;
+            last = p;
+            if (next_block) {
+                return p;
+            }
+            objects.push_back(p);
+        }
+    };
+
+    char* block_a = allocate_block(partial);
+    std::vector<void*> in_a({block_a});
+    char* block_b = allocate_block(in_a);
+    ASSERT_NE(block_a, block_b);
+    for (void* p: partial) {
+        util::arena::release(p);
+    }
+    for (void* p: in_a) {
+        util::arena::release(p);
+    }
+
+    /* every object of block a released, block b filled: block a is used again */
+    std::vector<void*> in_b({block_b});
+    char* next = allocate_block(in_b);
+    ASSERT_EQ(block_a, next);
+    util::arena::release(next);
+    for (void* p: in_b) {
+        util::arena::release(p);
+    }
+}
+
+TEST(Algorithm, ArenaAllocateShared)
+{
+    /* the string and its count follow the object allocated before, unless that filled a block */
+    char* before = nullptr;
+    std::shared_ptr<std::string> s;
+    for (int i = 0; i < 2; ++i) {
+        util::arena::release(before);
+        before = static_cast<char*>(util::arena::allocate(16));
+        s = std::allocate_shared<std::string>(util::arena_allocator<std::string>(), "arena");
+        char* p = reinterpret_cast<char*>(s.operator->());
+        if (before < p && p < before + 1024) {
+            break;
+        }
+        ASSERT_EQ(0, i);
+    }
+    ASSERT_EQ("arena", *s);
+
+    std::shared_ptr<std::string> copy(s);
+    s.reset();
+    ASSERT_EQ("arena", *copy);
+    copy.reset();
+    util::arena::release(before);
+}
+
+TEST(Algorithm, ArenaReleaseOnAnotherThread)
+{
+    int const COUNT = 100000;
+    std::size_t const SIZE = 200;
+    util::mpsc_queue<std::pair<int, unsigned char*>> q;
+    std::thread consumer(
+        [&]()
+        {
+            int released = 0;
+            std::pair<int, unsigned char*> obj;
+            while (released < COUNT) {
+                if (!q.pop(obj)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                /* a block recycled while in use would have its objects overwritten */
+                for (std::size_t i = 0; i < SIZE; ++i) {
+                    ASSERT_EQ(static_cast<unsigned char>(obj.first), obj.second[i]);
+                }
+                util::arena::release(obj.second);
+                ++released;
+            }
+        });
+    for (int i = 0; i < COUNT; ++i) {
+        unsigned char* p = static_cast<unsigned char*>(util::arena::allocate(SIZE));
+        std::fill(p, p + SIZE, static_cast<unsigned char>(i));
+        q.push(std::make_pair(i, p));
+    }
+    consumer.join();
+}
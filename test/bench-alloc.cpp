@@ -0,0 +1,191 @@
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+
+#include "core/proxy.hpp"
+#include "core/server.hpp"
+#include "core/client.hpp"
+#include "utils/logging.hpp"
+#include "mock-poll.hpp"
+
+using namespace cerb;
+
+static long allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    ++::allocations;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+static Proxy fake_proxy(0);
+
+namespace {
+
+    /* Do not touch the heap when reading or writing, or it is counted */
+    struct FixedBufferIO
+        : CIOImplement
+    {
+        static int const MAX_FD = 8;
+
+        char const* pending[MAX_FD];
+        size_t pending_len[MAX_FD];
+        size_t written[MAX_FD];
+        int fd_iter;
+
+        FixedBufferIO()
+            : fd_iter(0)
+        {
+            std::memset(pending, 0, sizeof pending);
+            std::memset(pending_len, 0, sizeof pending_len);
+            std::memset(written, 0, sizeof written);
+        }
+
+        void feed(int fd, char const* data)
+        {
+            pending[fd] = data;
+            pending_len[fd] = std::strlen(data);
+        }
+
+        ssize_t read(int fd, void* buf, size_t count)
+        {
+            if (pending_len[fd] == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            size_t n = std::min(count, pending_len[fd]);
+            std::memcpy(buf, pending[fd], n);
+            pending[fd] += n;
+            pending_len[fd] -= n;
+            return n;
+        }
+
+        ssize_t write(int fd, void const*, size_t count)
+        {
+            written[fd] += count;
+            return count;
+        }
+
+        int close(int)
+        {
+            return 0;
+        }
+
+        int new_stream_socket()
+        {
+            return ++fd_iter;
+        }
+    };
+
+    struct AllocBench
+        : testing::Test
+    {
+        static Server* server;
+        static util::sref<FixedBufferIO> io_obj;
+
+        void SetUp()
+        {
+            PollNotImplement::set_impl(util::mkptr(new ManualPoller));
+            util::sptr<FixedBufferIO> io(new FixedBufferIO);
+            AllocBench::io_obj = *io;
+            CIOImplement::set_impl(std::move(io));
+        }
+
+        void TearDown()
+        {
+            AllocBench::server->close_conn();
+            AllocBench::server = nullptr;
+            AllocBench::io_obj.reset();
+            CIOImplement::set_impl(util::mkptr(new CIOImplement));
+            PollNotImplement::set_impl(util::mkptr(new PollNotImplement));
+        }
+
+        static void set_polls()
+        {
+            poll::pevent e;
+            fake_proxy.handle_events(&e, 0);
+        }
+
+        /* Returns average allocations per command for `rounds` requests */
+        static double run(Client* client, char const* request, char const* response,
+                          int commands_per_request, int rounds)
+        {
+            long before = ::allocations;
+            for (int i = 0; i < rounds; ++i) {
+                io_obj->feed(client->fd, request);
+                client->on_events(ManualPoller::EV_READ);
+                set_polls();
+                server->on_events(ManualPoller::EV_WRITE);
+                set_polls();
+                io_obj->feed(server->fd, response);
+                server->on_events(ManualPoller::EV_READ);
+                set_polls();
+                client->on_events(ManualPoller::EV_WRITE);
+                set_polls();
+            }
+            return double(::allocations - before) / (rounds * commands_per_request);
+        }
+    };
+
+    Server* AllocBench::server(nullptr);
+    util::sref<FixedBufferIO> AllocBench::io_obj(nullptr);
+
+}
+
+Server* Proxy::get_server_by_slot(slot)
+{
+    return AllocBench::server;
+}
+
+Server* Proxy::get_read_server_by_slot(slot s)
+{
+    return this->get_server_by_slot(s);
+}
+
+TEST_F(AllocBench, AllocationsPerCommand)
+{
+    int const ROUNDS = 10000;
+    AllocBench::server = Server::get_server(util::Address("", 0), &::fake_proxy);
+    Client* client = new Client(AllocBench::io_obj->new_stream_socket(), &::fake_proxy);
+
+    char const* single_request = "*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n";
+    char const* single_response = "$10\r\nnaganohara\r\n";
+    char const* pipe_request = "*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n*2\r\n$3\r\nGET\r\n$4\r\nyuko\r\n";
+    char const* pipe_response = "$10\r\nnaganohara\r\n$4\r\naioi\r\n";
+
+    /* debug logging formats strings on the heap */
+    el::Loggers::reconfigureAllLoggers(el::Level::Debug, el::ConfigurationType::Enabled, "false");
+    /* warm up the connections so that their first-time containers are not counted */
+    AllocBench::run(client, single_request, single_response, 1, 16);
+    AllocBench::run(client, pipe_request, pipe_response, 2, 16);
+
+    size_t client_written = AllocBench::io_obj->written[client->fd];
+    double fast = AllocBench::run(client, single_request, single_response, 1, ROUNDS);
+    ASSERT_EQ(client_written + ROUNDS * std::strlen(single_response),
+              AllocBench::io_obj->written[client->fd]);
+
+    client_written = AllocBench::io_obj->written[client->fd];
+    double pipelined = AllocBench::run(client, pipe_request, pipe_response, 2, ROUNDS);
+    ASSERT_EQ(client_written + ROUNDS * std::strlen(pipe_response),
+              AllocBench::io_obj->written[client->fd]);
+
+    std::cout << "Allocations per command: single " << fast
+              << " / pipelined " << pipelined << std::endl;
+    EXPECT_EQ(0, fast);
+    EXPECT_LT(fast, pipelined);
+
+    el::Loggers::reconfigureAllLoggers(el::Level::Debug, el::ConfigurationType::Enabled, "true");
+    client->close();
+    client->after_events();
+}
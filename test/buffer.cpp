@@ -23,6 +23,42 @@ TEST_F(BufferTest, AsString)
     ASSERT_EQ(std::string("need a lightghost reporting"), buffer.to_string());
 }
 
+TEST_F(BufferTest, InlineAndHeapStorage)
+{
+    std::string large(Buffer::INLINE_SIZE * 3, 'x');
+    Buffer buffer("+OK\r\n");
+    Buffer cuffer(large);
+
+    buffer.append_from(cuffer.begin(), cuffer.end());
+    ASSERT_EQ("+OK\r\n" + large, buffer.to_string());
+
+    cuffer.swap(buffer);
+    ASSERT_EQ(large, buffer.to_string());
+    ASSERT_EQ("+OK\r\n" + large, cuffer.to_string());
+
+    Buffer duffer(":1\r\n");
+    duffer.swap(buffer);
+    ASSERT_EQ(":1\r\n", buffer.to_string());
+    ASSERT_EQ(large, duffer.to_string());
+
+    Buffer moved(std::move(buffer));
+    ASSERT_TRUE(buffer.empty());
+    ASSERT_EQ(":1\r\n", moved.to_string());
+
+    moved = std::move(duffer);
+    ASSERT_TRUE(duffer.empty());
+    ASSERT_EQ(large, moved.to_string());
+
+    moved.truncate_from_begin(moved.begin() + large.size() - 2);
+    ASSERT_EQ("xx", moved.to_string());
+
+    moved.clear();
+    moved.append_header('*', 0);
+    moved.append_header(':', 1234567890123LL);
+    moved.append_header(':', -42);
+    ASSERT_EQ("*0\r\n:1234567890123\r\n:-42\r\n", moved.to_string());
+}
+
 TEST_F(BufferTest, IO)
 {
     Buffer buffer;
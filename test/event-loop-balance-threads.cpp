@@ -0,0 +1,162 @@
+#include <set>
+#include <thread>
+
+#include "core/server.hpp"
+#include "core/message.hpp"
+#include "core/globals.hpp"
+#include "core/concurrence.hpp"
+#include "event-loop-test.hpp"
+
+using namespace cerb;
+using cerb::msg::format_command;
+
+struct EventLoopBalanceThreadsTest
+    : EventLoopTest
+{
+    static int const OTHER_EPFD = -3;
+
+    /* a thread not started, to which clients are shed; polled by the test */
+    static std::shared_ptr<ListenThread> other;
+
+    void SetUp()
+    {
+        EventLoopTest::SetUp();
+        cerb_global::balance_threads = true;
+        EventLoopTest::poll_obj->next_epfd = OTHER_EPFD;
+        other = std::make_shared<ListenThread>(0);
+        EventLoopTest::poll_obj->next_epfd = 0;
+        cerb_global::add_listen_thread(other);
+    }
+
+    void TearDown()
+    {
+        std::set<Connection*> conns;
+        for (auto i: EventLoopTest::poll_obj->registered_data) {
+            conns.insert(static_cast<Connection*>(i.second));
+        }
+        for (Connection* c: conns) {
+            c->on_error();
+            c->after_events();
+        }
+        cerb_global::remove_listen_thread(other.get());
+        /* the proxy shedding holds the other thread, whose fds are all mocked */
+        EventLoopTest::proxy.reset(nullptr);
+        other.reset();
+        cerb_global::balance_threads = false;
+        EventLoopTest::TearDown();
+    }
+
+    /* the acceptor mock takes the last proxy made, which is the other one */
+    static int new_client()
+    {
+        int fd = ++EventLoopTest::io_obj->last_fd;
+        EventLoopTest::proxy->new_client(fd);
+        return fd;
+    }
+
+    static void run_other_polls()
+    {
+        poll::pevent events[poll::MAX_EVENTS];
+        int nfds;
+        while (0 != (nfds = EventLoopTest::poll_obj->poll_wait(events, poll::MAX_EVENTS, OTHER_EPFD))) {
+            other->get_proxy()->handle_events(events, nfds);
+        }
+    }
+
+    /* busy through a whole load window, while the other thread is idle */
+    static void overload()
+    {
+        ControlMailbox mailbox(EventLoopTest::proxy.operator->());
+        mailbox.post(
+            [](Proxy*)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(510));
+            });
+        EventLoopTest::run_poll();
+    }
+};
+
+std::shared_ptr<ListenThread> EventLoopBalanceThreadsTest::other;
+
+TEST_F(EventLoopBalanceThreadsTest, ShedNewClients)
+{
+    ASSERT_FALSE(EventLoopTest::proxy->take_client_migration());
+    overload();
+    ASSERT_LT(900, EventLoopTest::proxy->load());
+
+    int client = new_client();
+    ASSERT_EQ(0, EventLoopTest::proxy->clients_count());
+    ASSERT_EQ(1, EventLoopTest::proxy->migrated_clients());
+
+    run_other_polls();
+    ASSERT_EQ(1, other->get_proxy()->clients_count());
+    EventLoopTest::push_read_of(client, format_command("PING", {}));
+    run_other_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("+PONG\r\n", EventLoopTest::get_written_of(client, 0));
+}
+
+TEST_F(EventLoopBalanceThreadsTest, IdleMigrationBudget)
+{
+    std::vector<int> clients;
+    for (int i = 0; i < 20; ++i) {
+        clients.push_back(new_client());
+    }
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(20, EventLoopTest::proxy->clients_count());
+    overload();
+
+    /* each is idle once its reply is written, but only so many move in a window */
+    for (int c: clients) {
+        EventLoopTest::push_read_of(c, format_command("PING", {}));
+    }
+    EventLoopTest::run_all_polls();
+    for (int c: clients) {
+        ASSERT_EQ(1, EventLoopTest::write_buffer_size(c));
+        ASSERT_EQ("+PONG\r\n", EventLoopTest::get_written_of(c, 0));
+    }
+    ASSERT_EQ(16, EventLoopTest::proxy->migrated_clients());
+    ASSERT_EQ(4, EventLoopTest::proxy->clients_count());
+    ASSERT_FALSE(EventLoopTest::proxy->take_client_migration());
+
+    run_other_polls();
+    ASSERT_EQ(16, other->get_proxy()->clients_count());
+}
+
+TEST_F(EventLoopBalanceThreadsTest, KeepClientsWithCommandsInFlight)
+{
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 9000), "a30eb413929229fa34bf473c742c91cee391a908");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+
+    int client = new_client();
+    EventLoopTest::run_all_polls();
+    overload();
+
+    EventLoopTest::push_read_of(client, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server->fd));
+    ASSERT_EQ(0, EventLoopTest::proxy->migrated_clients());
+
+    /* a pipelined command read meanwhile doesn't make it idle either */
+    EventLoopTest::push_read_of(client, format_command("GET", {"b"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(0, EventLoopTest::proxy->migrated_clients());
+    ASSERT_EQ(1, EventLoopTest::proxy->clients_count());
+
+    /* the next command is sent once the first is answered */
+    EventLoopTest::push_read_of(server->fd, "$1\r\nA\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\nA\r\n", EventLoopTest::get_written_of(client, 0));
+    ASSERT_EQ(0, EventLoopTest::proxy->migrated_clients());
+
+    EventLoopTest::push_read_of(server->fd, "$1\r\nB\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\nB\r\n", EventLoopTest::get_written_of(client, 1));
+    ASSERT_EQ(1, EventLoopTest::proxy->migrated_clients());
+    ASSERT_EQ(0, EventLoopTest::proxy->clients_count());
+}
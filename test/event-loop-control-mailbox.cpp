@@ -0,0 +1,50 @@
+#include <thread>
+
+#include "core/concurrence.hpp"
+#include "event-loop-test.hpp"
+
+using namespace cerb;
+
+typedef EventLoopTest EventLoopControlMailboxTest;
+
+TEST_F(EventLoopControlMailboxTest, RunPostedActionsOnOwningLoop)
+{
+    Proxy* p = EventLoopTest::proxy.operator->();
+    ControlMailbox mailbox(p);
+    std::thread::id loop_thread(std::this_thread::get_id());
+
+    int runs = 0;
+    bool on_loop = true;
+    auto action =
+        [&](Proxy* proxy)
+        {
+            ++runs;
+            on_loop = on_loop && proxy == p && std::this_thread::get_id() == loop_thread;
+        };
+
+    std::thread([&]()
+                {
+                    for (int i = 0; i < 3; ++i) {
+                        mailbox.post(action);
+                    }
+                }).join();
+    /* woken once, the later posts see it notified */
+    ASSERT_EQ(1, EventLoopTest::read_buffer_size(mailbox.fd));
+    ASSERT_EQ(0, runs);
+
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(3, runs);
+    ASSERT_TRUE(on_loop);
+    ASSERT_TRUE(EventLoopTest::read_buffer_empty(mailbox.fd));
+
+    /* nothing runs twice */
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(3, runs);
+
+    /* taking the actions clears the notified state, so a later post wakes the loop again */
+    std::thread([&]() { mailbox.post(action); }).join();
+    ASSERT_EQ(1, EventLoopTest::read_buffer_size(mailbox.fd));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(4, runs);
+    ASSERT_TRUE(on_loop);
+}
@@ -1,3 +1,5 @@
+#include <thread>
+
 #include "core/server.hpp"
 #include "core/message.hpp"
 #include "core/globals.hpp"
@@ -82,6 +84,422 @@ TEST_F(EventLoopProxyDateTest, GeneralGet)
     ASSERT_EQ("$-1\r\n", EventLoopTest::get_written_of(client, 3));
 }
 
+TEST_F(EventLoopProxyDateTest, ReadFromLessLoadedReplica)
+{
+    Server::set_read_policy(true, false, false);
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* master = p->get_server_by_slot(0);
+    Server* replica_a = Server::get_server(util::Address("10.0.1.1", 8000), p);
+    Server* replica_b = Server::get_server(util::Address("10.0.1.2", 8000), p);
+    master->set_replicas({replica_a, replica_b});
+
+    int client_a = EventLoopTest::connect_client();
+    int client_b = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client_a, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    EventLoopTest::push_read_of(client_b, format_command("GET", {"world"}));
+    EventLoopTest::run_all_polls();
+
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(master->fd));
+    ASSERT_EQ(2, EventLoopTest::write_buffer_size(replica_a->fd));
+    ASSERT_EQ(2, EventLoopTest::write_buffer_size(replica_b->fd));
+    ASSERT_EQ("*1\r\n$8\r\nREADONLY\r\n", EventLoopTest::get_written_of(replica_a->fd, 0));
+    ASSERT_EQ("*1\r\n$8\r\nREADONLY\r\n", EventLoopTest::get_written_of(replica_b->fd, 0));
+    ASSERT_EQ(2, replica_a->outstanding());
+    ASSERT_EQ(2, replica_b->outstanding());
+    Server* first = EventLoopTest::get_written_of(replica_a->fd, 1) ==
+        format_command("GET", {"hello"}) ? replica_a : replica_b;
+    Server* second = first == replica_a ? replica_b : replica_a;
+
+    EventLoopTest::push_read_of(second->fd, "+OK\r\n$1\r\n2\r\n");
+    EventLoopTest::push_read_of(first->fd, "+OK\r\n$1\r\n1\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(0, replica_a->outstanding());
+    ASSERT_EQ(0, replica_b->outstanding());
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client_a));
+    ASSERT_EQ("$1\r\n1\r\n", EventLoopTest::get_written_of(client_a, 0));
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client_b));
+    ASSERT_EQ("$1\r\n2\r\n", EventLoopTest::get_written_of(client_b, 0));
+
+    replica_a->close_conn();
+    ASSERT_EQ(std::vector<Server*>({replica_b}), master->replicas());
+    replica_b->close_conn();
+    ASSERT_TRUE(master->replicas().empty());
+}
+
+TEST_F(EventLoopProxyDateTest, ReadWriteSplit)
+{
+    Server::set_read_policy(true, false, false);
+    Command::allow_write_commands();
+    Command::read_from_master({"hgetall"}, {"lock:"});
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* master = p->get_server_by_slot(0);
+    Server* replica = Server::get_server(util::Address("10.0.1.1", 8000), p);
+    master->set_replicas({replica});
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client, format_command("SET", {"hello", "world"}));
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::push_read_of(client, format_command("GET", {"lock:hello"}));
+    EventLoopTest::push_read_of(client, format_command("HGETALL", {"hello"}));
+    EventLoopTest::push_read_of(client, format_command("MGET", {"hello", "lock:world"}));
+    EventLoopTest::run_all_polls();
+
+    ASSERT_EQ(4, master->outstanding());
+    ASSERT_EQ(3, replica->outstanding());
+    auto all_written_of =
+        [](int fd)
+        {
+            std::string s;
+            for (size_t i = 0; i < EventLoopTest::write_buffer_size(fd); ++i) {
+                s += EventLoopTest::get_written_of(fd, i);
+            }
+            return s;
+        };
+    ASSERT_EQ(format_command("SET", {"hello", "world"}) +
+              format_command("GET", {"lock:hello"}) +
+              format_command("HGETALL", {"hello"}) +
+              format_command("GET", {"lock:world"}),
+              all_written_of(master->fd));
+    ASSERT_EQ("*1\r\n$8\r\nREADONLY\r\n" +
+              format_command("GET", {"hello"}) +
+              format_command("GET", {"hello"}),
+              all_written_of(replica->fd));
+
+    Command::read_from_master({}, {});
+}
+
+TEST_F(EventLoopProxyDateTest, SkipLaggingReplicas)
+{
+    Server::set_read_policy(true, false, false);
+    cerb_global::replication_probe_interval = std::chrono::milliseconds(1);
+    cerb_global::replica_max_lag_bytes = 1000;
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* master = p->get_server_by_slot(0);
+    Server* replica_a = Server::get_server(util::Address("10.0.1.1", 8000), p);
+    Server* replica_b = Server::get_server(util::Address("10.0.1.2", 8000), p);
+    master->set_replicas({replica_a, replica_b});
+    /* masters are probed only if any has replicas when the slot map is applied */
+    EventLoopTest::update_slots_map(nodes);
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("*2\r\n$4\r\nINFO\r\n$11\r\nreplication\r\n",
+              EventLoopTest::get_written_of(master->fd, 0));
+
+    std::string info(
+        "role:master\r\n"
+        "slave0:ip=10.0.1.1,port=8000,state=online,offset=1000,lag=0\r\n"
+        "slave1:ip=10.0.1.2,port=8000,state=online,offset=5000,lag=0\r\n"
+        "master_repl_offset:5000\r\n");
+    EventLoopTest::push_read_of(master->fd, "$" + util::str(int(info.size())) + "\r\n" + info + "\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(replica_a->lagging());
+    ASSERT_FALSE(replica_b->lagging());
+
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_EQ(replica_b, master->select_for_read());
+    }
+
+    std::vector<cerb::ReplicaLag> lags(cerb_global::replica_lags());
+    ASSERT_EQ(2, lags.size());
+    ASSERT_EQ(util::Address("10.0.1.1", 8000), lags[0].addr);
+    ASSERT_EQ(4000, lags[0].offset_lag);
+    ASSERT_EQ(util::Address("10.0.1.2", 8000), lags[1].addr);
+    ASSERT_EQ(0, lags[1].offset_lag);
+
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    /* READONLY not responded yet */
+    ASSERT_EQ(1, replica_a->outstanding());
+    ASSERT_EQ(2, replica_b->outstanding());
+    cerb_global::set_replica_lags(master->addr, std::vector<cerb::ReplicaLag>());
+}
+
+TEST_F(EventLoopProxyDateTest, StaleReadsWhenMasterDown)
+{
+    Server::set_read_policy(false, false, true);
+    Command::allow_write_commands();
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* master = p->get_server_by_slot(0);
+    Server* replica = Server::get_server(util::Address("10.0.1.1", 8000), p);
+    master->set_replicas({replica});
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(master->connected());
+    ASSERT_TRUE(replica->connected());
+
+    /* reads go to the master while it is up */
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, master->outstanding());
+    EventLoopTest::push_read_of(master->fd, "$1\r\n0\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\n0\r\n", EventLoopTest::get_written_of(client, 0));
+    EventLoopTest::clear_buffer_of(client);
+
+    master->close_conn();
+    ASSERT_EQ(std::vector<Server*>({replica}), master->replicas());
+    ASSERT_EQ(nullptr, p->get_server_by_slot(0));
+    ASSERT_EQ(replica, p->get_read_server_by_slot(0));
+
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    /* READONLY and GET */
+    ASSERT_EQ(2, replica->outstanding());
+    EventLoopTest::push_read_of(replica->fd, "+OK\r\n$1\r\n1\r\n");
+    EventLoopTest::run_poll();
+    EventLoopTest::run_poll();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("$1\r\n1\r\n", EventLoopTest::get_written_of(client, 0));
+
+    Server::set_read_policy(false, false, false);
+    ASSERT_EQ(nullptr, p->get_read_server_by_slot(0));
+}
+
+TEST_F(EventLoopProxyDateTest, HedgeSlowRead)
+{
+    Server::set_read_policy(true, false, false);
+    cerb_global::hedge_read_budget = 1;
+    cerb_global::hedge_min_delay = std::chrono::milliseconds(1);
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* master = p->get_server_by_slot(0);
+    Server* replica = Server::get_server(util::Address("10.0.1.1", 8000), p);
+    master->set_replicas({replica});
+    EventLoopTest::update_slots_map(nodes);
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(master->connected());
+    ASSERT_TRUE(replica->connected());
+
+    /* no budget before any reading command responded */
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(0, master->outstanding());
+    ASSERT_EQ(0, p->hedged_reads());
+    EventLoopTest::push_read_of(replica->fd, "+OK\r\n$1\r\n0\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\n0\r\n", EventLoopTest::get_written_of(client, 0));
+    EventLoopTest::clear_buffer_of(client);
+
+    Interval remote_cost(p->total_remote_cost());
+    EventLoopTest::push_read_of(client, format_command("GET", {"hello"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, replica->outstanding());
+    /* longer than the hedge delay, which is a fraction of the first reply latency */
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    /* hedged on a poll without events, sent to the master on the next one */
+    EventLoopTest::run_poll();
+    ASSERT_EQ(1, p->hedged_reads());
+    ASSERT_EQ(1, master->outstanding());
+    EventLoopTest::run_all_polls();
+    std::string master_written;
+    for (size_t i = 0; i < EventLoopTest::write_buffer_size(master->fd); ++i) {
+        master_written += EventLoopTest::get_written_of(master->fd, i);
+    }
+    ASSERT_EQ(format_command("GET", {"hello"}), master_written);
+
+    EventLoopTest::push_read_of(master->fd, "$1\r\n1\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, p->hedge_wins());
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("$1\r\n1\r\n", EventLoopTest::get_written_of(client, 0));
+    EventLoopTest::clear_buffer_of(client);
+    /* costs since sent to the replica, not to the master */
+    ASSERT_LE(std::chrono::milliseconds(10), p->total_remote_cost() - remote_cost);
+
+    /* the late reply from the replica is discarded */
+    ASSERT_EQ(1, replica->outstanding());
+    EventLoopTest::push_read_of(replica->fd, "$1\r\n0\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(0, replica->outstanding());
+    ASSERT_EQ(0, EventLoopTest::write_buffer_size(client));
+}
+
+TEST_F(EventLoopProxyDateTest, LanesOfNode)
+{
+    Server::set_lanes(2, true, 128);
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* node = p->get_server_by_slot(0);
+    ASSERT_EQ(2, node->lanes().size());
+    Server* lane = node->lanes()[0];
+    Server* bulk = node->lanes()[1];
+
+    int client_a = EventLoopTest::connect_client();
+    int client_b = EventLoopTest::connect_client();
+    int client_c = EventLoopTest::connect_client();
+    int client_d = EventLoopTest::connect_client();
+    int client_e = EventLoopTest::connect_client();
+    EventLoopTest::run_all_polls();
+
+    std::string long_key(128, 'k');
+    EventLoopTest::push_read_of(client_a, format_command("GET", {"a"}));
+    EventLoopTest::push_read_of(client_b, format_command("GET", {"b"}));
+    EventLoopTest::push_read_of(client_c, format_command("LRANGE", {"c", "0", "-1"}));
+    EventLoopTest::push_read_of(client_d, format_command("GET", {long_key}));
+    EventLoopTest::run_all_polls();
+
+    auto all_written_of =
+        [](int fd)
+        {
+            std::string s;
+            for (size_t i = 0; i < EventLoopTest::write_buffer_size(fd); ++i) {
+                s += EventLoopTest::get_written_of(fd, i);
+            }
+            return s;
+        };
+    ASSERT_EQ(format_command("GET", {"a"}), all_written_of(node->fd));
+    ASSERT_EQ(format_command("GET", {"b"}), all_written_of(lane->fd));
+    ASSERT_EQ(format_command("LRANGE", {"c", "0", "-1"}) + format_command("GET", {long_key}),
+              all_written_of(bulk->fd));
+    ASSERT_EQ(4, node->outstanding());
+
+    EventLoopTest::push_read_of(lane->fd, "$1\r\nb\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\nb\r\n", all_written_of(client_b));
+
+    /* the lane responded has less bytes in flight */
+    EventLoopTest::push_read_of(client_e, format_command("GET", {"e"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(format_command("GET", {"b"}) + format_command("GET", {"e"}), all_written_of(lane->fd));
+
+    bulk->close_conn();
+    ASSERT_EQ(std::vector<Server*>({lane}), node->lanes());
+    node->close_conn();
+    ASSERT_TRUE(lane->closed());
+}
+
+TEST_F(EventLoopProxyDateTest, LanesKeepPipelineOrder)
+{
+    Server::set_lanes(2, true, 128);
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 8000), "34bf473c742c91cee391a908a30eb413929229fa");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Proxy* p = (*EventLoopTest::proxy).operator->();
+    Server* node = p->get_server_by_slot(0);
+    ASSERT_EQ(2, node->lanes().size());
+    Server* lane = node->lanes()[0];
+    Server* bulk = node->lanes()[1];
+
+    int client_a = EventLoopTest::connect_client();
+    int client_b = EventLoopTest::connect_client();
+    EventLoopTest::run_all_polls();
+
+    auto all_written_of =
+        [](int fd)
+        {
+            std::string s;
+            for (size_t i = 0; i < EventLoopTest::write_buffer_size(fd); ++i) {
+                s += EventLoopTest::get_written_of(fd, i);
+            }
+            return s;
+        };
+
+    EventLoopTest::push_read_of(client_a, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(format_command("GET", {"a"}), all_written_of(node->fd));
+
+    /* the read would go to the node, which has less bytes in flight, and the LRANGE to the bulk lane */
+    EventLoopTest::push_read_of(client_b, format_command("SET", {"b", "value"}) +
+                                          format_command("GET", {"b"}) +
+                                          format_command("RPUSH", {"l", "x"}) +
+                                          format_command("LRANGE", {"l", "0", "-1"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(format_command("GET", {"a"}), all_written_of(node->fd));
+    ASSERT_EQ(format_command("SET", {"b", "value"}) + format_command("GET", {"b"}) +
+              format_command("RPUSH", {"l", "x"}) + format_command("LRANGE", {"l", "0", "-1"}),
+              all_written_of(lane->fd));
+    ASSERT_EQ(0, EventLoopTest::write_buffer_size(bulk->fd));
+
+    EventLoopTest::push_read_of(lane->fd, "+OK\r\n$5\r\nvalue\r\n:1\r\n*1\r\n$1\r\nx\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("+OK\r\n$5\r\nvalue\r\n:1\r\n*1\r\n$1\r\nx\r\n", all_written_of(client_b));
+    EventLoopTest::clear_buffer_of(client_b);
+
+    /* nothing in flight, lanes are selected again */
+    EventLoopTest::push_read_of(client_b, format_command("LRANGE", {"l", "0", "-1"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(format_command("LRANGE", {"l", "0", "-1"}), all_written_of(bulk->fd));
+}
+
+TEST_F(EventLoopProxyDateTest, AdoptMigratedClient)
+{
+    int client = ++EventLoopTest::io_obj->last_fd;
+    EventLoopTest::proxy->adopt_client(client, "*1\r\n$4\r\nPI");
+    ASSERT_EQ(1, EventLoopTest::proxy->clients_count());
+
+    EventLoopTest::push_read_of(client, "NG\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("+PONG\r\n", EventLoopTest::get_written_of(client, 0));
+    ASSERT_FALSE(EventLoopTest::proxy->take_client_migration());
+}
+
+TEST_F(EventLoopProxyDateTest, RetireDrainsClients)
+{
+    int client = ++EventLoopTest::io_obj->last_fd;
+    EventLoopTest::proxy->adopt_client(client, "*1\r\n$4\r\nPI");
+    ASSERT_EQ(1, EventLoopTest::proxy->clients_count());
+    ASSERT_FALSE(EventLoopTest::proxy->drained());
+
+    EventLoopTest::proxy->retire(cerb::Interval(10));
+    ASSERT_TRUE(EventLoopTest::proxy->take_client_migration());
+    ASSERT_FALSE(EventLoopTest::proxy->drained());
+
+    EventLoopTest::run_poll();
+    ASSERT_EQ(0, EventLoopTest::proxy->clients_count());
+    ASSERT_TRUE(EventLoopTest::proxy->drained());
+}
+
 TEST_F(EventLoopProxyDateTest, GetSuccessOnManualSlotsUpdate)
 {
     cerb_global::set_remotes({util::Address("10.0.0.1", 9000), util::Address("10.0.0.1", 9001)});
@@ -93,8 +511,9 @@ TEST_F(EventLoopProxyDateTest, GetSuccessOnManualSlotsUpdate)
     EventLoopTest::push_read_of(client_a, format_command("GET", {"hello"}));
     EventLoopTest::push_read_of(
         updater,
-        "+29fa34bf473c742c91cee391a908a30eb4139292 127.0.0.1:9005"
-        " master - 0 0 0 connected 0-16383\r\n");
+        EventLoopTest::cluster_slots({
+            {0, 16383, "127.0.0.1", 9005, "29fa34bf473c742c91cee391a908a30eb4139292"},
+        }));
     int nfd = EventLoopTest::run_poll();
     ASSERT_EQ(3, nfd);
     nfd = EventLoopTest::run_poll();
@@ -144,8 +563,9 @@ TEST_F(EventLoopProxyDateTest, SlotsMoved)
     EventLoopTest::push_read_of(client_a, format_command("GET", {"hello"}));
     EventLoopTest::push_read_of(
         updater,
-        "+29fa34bf473c742c91cee391a908a30eb4139292 10.0.0.1:9000"
-        " master - 0 0 0 connected 0-16383\r\n");
+        EventLoopTest::cluster_slots({
+            {0, 16383, "10.0.0.1", 9000, "29fa34bf473c742c91cee391a908a30eb4139292"},
+        }));
     int nfd = EventLoopTest::run_poll();
     ASSERT_EQ(2, nfd);
     nfd = EventLoopTest::run_poll();
@@ -179,33 +599,29 @@ TEST_F(EventLoopProxyDateTest, SlotsMoved)
     nfd = EventLoopTest::run_poll();
     ASSERT_EQ(1, nfd);
 
-    updater = EventLoopTest::last_fd();
-    EventLoopTest::push_read_of(
-        updater,
-        "+29fa34bf473c742c91cee391a908a30eb4139292 10.0.0.1:9001"
-        " master - 0 0 0 connected 0-8191\n"
-        "21952b372055dfdb5fa25b2761857831040472e1 10.0.0.1:9000"
-        " myself,master - 0 0 1 connected 8192-16383\r\n");
+    /* only slot 0 is patched and no slot map update is launched */
+    int server_b = EventLoopTest::last_fd();
+    ASSERT_NE(server_a, server_b);
+    ASSERT_EQ(4, EventLoopTest::poll_obj->registered_data.size());
 
-    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_b));
-    nfd = EventLoopTest::run_poll();
-    ASSERT_EQ(1, nfd);
-    nfd = EventLoopTest::run_poll();
-    ASSERT_EQ(1, nfd);
+    Server* s = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, s);
+    ASSERT_EQ(server_b, s->fd);
 
-    Server* s = EventLoopTest::proxy->get_server_by_slot(8192);
+    s = EventLoopTest::proxy->get_server_by_slot(1);
     ASSERT_NE(nullptr, s);
-    ASSERT_FALSE(s->closed());
     ASSERT_EQ(server_a, s->fd);
 
-    s = EventLoopTest::proxy->get_server_by_slot(0);
+    s = EventLoopTest::proxy->get_server_by_slot(16383);
     ASSERT_NE(nullptr, s);
-    ASSERT_FALSE(s->closed());
-    ASSERT_NE(server_a, s->fd);
+    ASSERT_EQ(server_a, s->fd);
 
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_b));
     nfd = EventLoopTest::run_poll();
     ASSERT_EQ(1, nfd);
-    int server_b = s->fd;
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server_b));
+    ASSERT_EQ(format_command("GET", {"h-893"}), EventLoopTest::get_written_of(server_b, 0));
+
     EventLoopTest::push_read_of(server_b, "$4\r\nBart\r\n");
     nfd = EventLoopTest::run_poll();
     ASSERT_EQ(1, nfd);
@@ -228,8 +644,9 @@ TEST_F(EventLoopProxyDateTest, ClientResetWhenSlotsMoved)
     EventLoopTest::push_read_of(client_a, format_command("GET", {"hello"}));
     EventLoopTest::push_read_of(
         updater,
-        "+29fa34bf473c742c91cee391a908a30eb4139292 10.0.0.1:9100"
-        " master - 0 0 0 connected 0-16383\r\n");
+        EventLoopTest::cluster_slots({
+            {0, 16383, "10.0.0.1", 9100, "29fa34bf473c742c91cee391a908a30eb4139292"},
+        }));
     int nfd = EventLoopTest::run_poll();
     ASSERT_EQ(2, nfd);
     nfd = EventLoopTest::run_poll();
@@ -259,27 +676,19 @@ TEST_F(EventLoopProxyDateTest, ClientResetWhenSlotsMoved)
     EventLoopTest::clear_buffer_of(client_a);
 
     EventLoopTest::push_read_of(server_a, "-MOVED 0 10.0.0.1:9101\r\n");
-    EventLoopTest::push_read_of(server_a, "-MOVED 0 10.0.0.1:9101\r\n");
+    EventLoopTest::push_read_of(server_a, "-MOVED 1 10.0.0.1:9101\r\n");
     nfd = EventLoopTest::run_poll();
     ASSERT_EQ(1, nfd);
 
-    updater = EventLoopTest::last_fd();
-    EventLoopTest::push_read_of(
-        updater,
-        "+29fa34bf473c742c91cee391a908a30eb4139292 10.0.0.1:9101"
-        " master - 0 0 0 connected 0-8191\n"
-        "21952b372055dfdb5fa25b2761857831040472e1 10.0.0.1:9100"
-        " myself,master - 0 0 1 connected 8192-16383\n\r\n");
-
+    int server_b = EventLoopTest::last_fd();
+    ASSERT_NE(server_a, server_b);
     ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_a));
     ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_b));
 
     EventLoopTest::reset_conn(client_b);
 
     nfd = EventLoopTest::run_poll();
-    ASSERT_EQ(1, nfd);
-    nfd = EventLoopTest::run_poll();
-    ASSERT_EQ(1, nfd);
+    ASSERT_EQ(2, nfd);
 
     ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_b));
     ASSERT_TRUE(EventLoopTest::read_buffer_empty(client_b));
@@ -292,11 +701,9 @@ TEST_F(EventLoopProxyDateTest, ClientResetWhenSlotsMoved)
     s = EventLoopTest::proxy->get_server_by_slot(0);
     ASSERT_NE(nullptr, s);
     ASSERT_FALSE(s->closed());
-    ASSERT_NE(server_a, s->fd);
+    ASSERT_EQ(server_b, s->fd);
+    ASSERT_EQ(format_command("GET", {"h-893"}), EventLoopTest::get_written_of(server_b, 0));
 
-    nfd = EventLoopTest::run_poll();
-    ASSERT_EQ(1, nfd);
-    int server_b = s->fd;
     EventLoopTest::push_read_of(server_b, "$6\r\nDalvin\r\n");
     nfd = EventLoopTest::run_poll();
     ASSERT_EQ(1, nfd);
@@ -348,12 +755,13 @@ TEST_F(EventLoopProxyDateTest, ServerResets)
     EventLoopTest::push_read_of(server_b->fd, "$6\r\nEmirin\r\n");
     EventLoopTest::run_all_polls();
     ASSERT_EQ(1, EventLoopTest::write_buffer_size(updater));
-    ASSERT_EQ(format_command("cluster", {"nodes"}), EventLoopTest::get_written_of(updater, 0));
+    ASSERT_EQ(format_command("cluster", {"slots"}), EventLoopTest::get_written_of(updater, 0));
 
     EventLoopTest::push_read_of(
         updater,
-        "+42c991cee139213eb4a908a309229fa34bf473c7 10.0.0.2:9001"
-        " master - 0 0 0 connected 0-16383\r\n");
+        EventLoopTest::cluster_slots({
+            {0, 16383, "10.0.0.2", 9001, "42c991cee139213eb4a908a309229fa34bf473c7"},
+        }));
     EventLoopTest::run_all_polls();
 
     ASSERT_TRUE(server_a->closed());
@@ -366,6 +774,103 @@ TEST_F(EventLoopProxyDateTest, ServerResets)
     ASSERT_EQ("$6\r\nEmirin\r\n", EventLoopTest::get_written_of(client, 1));
 }
 
+TEST_F(EventLoopProxyDateTest, RedirectToUnknownHost)
+{
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.3", 9000), "a30eb413929229fa34bf473c742c91cee391a908");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+    int client = EventLoopTest::connect_client();
+
+    /* h-893 is in slot 0 */
+    EventLoopTest::push_read_of(client, format_command("GET", {"h-893"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server->fd));
+    EventLoopTest::clear_buffer_of(server->fd);
+
+    /* the command is retried later, and the server replying isn't closed */
+    EventLoopTest::push_read_of(server->fd, "-MOVED 0 unknown.host:9001\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_FALSE(server->closed());
+    ASSERT_EQ(server, EventLoopTest::proxy->get_server_by_slot(0));
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client));
+
+    int client_b = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client_b, format_command("GET", {"h-893"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server->fd));
+    EventLoopTest::clear_buffer_of(server->fd);
+
+    EventLoopTest::push_read_of(server->fd, "-ASK 0 unknown.host:9001\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_FALSE(server->closed());
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_b));
+}
+
+TEST_F(EventLoopProxyDateTest, AskAndTryAgain)
+{
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.3", 9000), "a30eb413929229fa34bf473c742c91cee391a908");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Server* server_a = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server_a);
+
+    int client = EventLoopTest::connect_client();
+
+    /* h-893 is in slot 0 */
+    EventLoopTest::push_read_of(client, format_command("GET", {"h-893"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server_a->fd));
+    EventLoopTest::clear_buffer_of(server_a->fd);
+
+    int last_fd = EventLoopTest::last_fd();
+    EventLoopTest::push_read_of(server_a->fd, "-ASK 0 10.0.0.3:9001\r\n");
+    EventLoopTest::run_all_polls();
+
+    int server_b = EventLoopTest::last_fd();
+    ASSERT_NE(last_fd, server_b);
+    ASSERT_EQ(server_a, EventLoopTest::proxy->get_server_by_slot(0));
+    ASSERT_EQ(2, EventLoopTest::write_buffer_size(server_b));
+    ASSERT_EQ(format_command("ASKING", {}), EventLoopTest::get_written_of(server_b, 0));
+    ASSERT_EQ(format_command("GET", {"h-893"}), EventLoopTest::get_written_of(server_b, 1));
+
+    EventLoopTest::push_read_of(server_b, "+OK\r\n$4\r\nHiro\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("$4\r\nHiro\r\n", EventLoopTest::get_written_of(client, 0));
+    EventLoopTest::clear_buffer_of(client);
+
+    EventLoopTest::push_read_of(client, format_command("GET", {"h-893"}));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server_a->fd));
+    EventLoopTest::clear_buffer_of(server_a->fd);
+
+    EventLoopTest::push_read_of(server_a->fd, "-TRYAGAIN Multiple keys request during rehashing of slot\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(server_a->fd));
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client));
+    ASSERT_NE(-1, EventLoopTest::proxy->poll_timeout());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(EventLoopTest::proxy->poll_timeout() + 1));
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(-1, EventLoopTest::proxy->poll_timeout());
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(server_a->fd));
+    ASSERT_EQ(format_command("GET", {"h-893"}), EventLoopTest::get_written_of(server_a->fd, 0));
+
+    EventLoopTest::push_read_of(server_a->fd, "$4\r\nAndo\r\n");
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(client));
+    ASSERT_EQ("$4\r\nAndo\r\n", EventLoopTest::get_written_of(client, 0));
+}
+
 TEST_F(EventLoopProxyDateTest, PipeToClient)
 {
     std::vector<RedisNode> nodes;
@@ -80,10 +80,10 @@ TEST_F(EventLoopLongConnectionTest, BlockedPops)
 
     EventLoopTest::push_read_of(
         updater,
-        "+a34bf47213eb4a908a309223c742c991cee1399f 10.0.0.1:9001"
-        " master - 0 0 0 connected 0\n"
-        "f473c7430eb413929229fa32c91cee391a908a4b 10.0.0.1:9000"
-        " myself,master - 0 0 1 connected 1-16383\r\n");
+        EventLoopTest::cluster_slots({
+            {0, 0, "10.0.0.1", 9001, "a34bf47213eb4a908a309223c742c991cee1399f"},
+            {1, 16383, "10.0.0.1", 9000, "f473c7430eb413929229fa32c91cee391a908a4b"},
+        }));
     EventLoopTest::run_all_polls();
 
     ASSERT_FALSE(server9000->closed());
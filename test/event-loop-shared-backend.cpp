@@ -0,0 +1,179 @@
+#include "core/server.hpp"
+#include "core/message.hpp"
+#include "core/shared_backend.hpp"
+#include "event-loop-test.hpp"
+
+using namespace cerb;
+using cerb::msg::format_command;
+
+struct EventLoopSharedBackendTest
+    : EventLoopTest
+{
+    static int const BACKEND_EPFD = -2;
+
+    void SetUp()
+    {
+        EventLoopTest::SetUp();
+        EventLoopTest::poll_obj->next_epfd = BACKEND_EPFD;
+        cerb::setup_shared_backends(1);
+        EventLoopTest::poll_obj->next_epfd = 0;
+        /* replies are handed back to a proxy made after the backends */
+        EventLoopTest::proxy.reset(new cerb::Proxy(0));
+    }
+
+    void TearDown()
+    {
+        cerb::close_shared_backends();
+        EventLoopTest::TearDown();
+    }
+
+    /* the backend thread runs on this one, so each step is seen */
+    static void run_backend_polls()
+    {
+        while (0 != cerb::poll_shared_backends())
+            ;
+    }
+
+    static std::string all_written_of(int fd)
+    {
+        std::string s;
+        for (size_t i = 0; i < EventLoopTest::write_buffer_size(fd); ++i) {
+            s += EventLoopTest::get_written_of(fd, i);
+        }
+        return s;
+    }
+
+    static void map_all_slots_to(std::string const& host, int port)
+    {
+        std::vector<RedisNode> nodes;
+        RedisNode x(util::Address(host, port), "a30eb413929229fa34bf473c742c91cee391a908");
+        x.slot_ranges.insert(std::make_pair(0, 16383));
+        nodes.push_back(std::move(x));
+        EventLoopTest::update_slots_map(nodes);
+    }
+};
+
+TEST_F(EventLoopSharedBackendTest, ForwardAndReply)
+{
+    map_all_slots_to("10.0.0.1", 9000);
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+
+    int client_a = EventLoopTest::connect_client();
+    int client_b = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client_a, format_command("GET", {"a"}));
+    EventLoopTest::push_read_of(client_b, format_command("GET", {"b"}));
+    EventLoopTest::run_all_polls();
+    /* nothing written by the thread itself, the server is an eventfd */
+    ASSERT_EQ(0, EventLoopTest::write_buffer_size(server->fd));
+
+    int last_fd = EventLoopTest::last_fd();
+    run_backend_polls();
+    int conn = EventLoopTest::last_fd();
+    ASSERT_EQ(last_fd + 1, conn);
+    ASSERT_EQ(format_command("GET", {"a"}) + format_command("GET", {"b"}), all_written_of(conn));
+
+    /* replies are routed back in the order the commands were forwarded */
+    EventLoopTest::push_read_of(conn, "$1\r\nA\r\n$1\r\nB\r\n");
+    run_backend_polls();
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client_a));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\nA\r\n", all_written_of(client_a));
+    ASSERT_EQ("$1\r\nB\r\n", all_written_of(client_b));
+    EventLoopTest::clear_buffer_of(client_a);
+
+    /* the connection to the node is kept for later commands */
+    EventLoopTest::push_read_of(client_a, format_command("GET", {"c"}));
+    EventLoopTest::run_all_polls();
+    EventLoopTest::clear_buffer_of(conn);
+    run_backend_polls();
+    ASSERT_EQ(conn, EventLoopTest::last_fd());
+    ASSERT_EQ(format_command("GET", {"c"}), all_written_of(conn));
+    EventLoopTest::push_read_of(conn, "$1\r\nC\r\n");
+    run_backend_polls();
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ("$1\r\nC\r\n", all_written_of(client_a));
+}
+
+TEST_F(EventLoopSharedBackendTest, DropRepliesToLastEpoch)
+{
+    map_all_slots_to("10.0.0.1", 9000);
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    run_backend_polls();
+    int conn = EventLoopTest::last_fd();
+    ASSERT_EQ(format_command("GET", {"a"}), all_written_of(conn));
+
+    /* closed before the reply comes, so the reply is to the last use of the server */
+    server->close_conn();
+    EventLoopTest::push_read_of(conn, "$1\r\nA\r\n");
+    run_backend_polls();
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client));
+    ASSERT_EQ(0, server->outstanding());
+}
+
+TEST_F(EventLoopSharedBackendTest, HangUp)
+{
+    map_all_slots_to("10.0.0.1", 9000);
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    run_backend_polls();
+    int conn = EventLoopTest::last_fd();
+
+    /* node closes the shared connection, so every server awaiting it is closed */
+    EventLoopTest::push_read_of(conn, "");
+    run_backend_polls();
+    ASSERT_FALSE(server->closed());
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(server->closed());
+    ASSERT_TRUE(EventLoopTest::write_buffer_empty(client));
+}
+
+TEST_F(EventLoopSharedBackendTest, HangUpOnUnknownHost)
+{
+    map_all_slots_to(MultipleBuffersIO::UNKNOWN_HOST, 9000);
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    run_backend_polls();
+    EventLoopTest::run_all_polls();
+    ASSERT_TRUE(server->closed());
+    /* nor can the slot map be updated from there */
+    ASSERT_EQ("-CLUSTERDOWN The cluster is down\r\n", all_written_of(client));
+}
+
+TEST_F(EventLoopSharedBackendTest, ReplyAfterProxyGone)
+{
+    map_all_slots_to("10.0.0.1", 9000);
+    int client = EventLoopTest::connect_client();
+    EventLoopTest::push_read_of(client, format_command("GET", {"a"}));
+    EventLoopTest::run_all_polls();
+    EventLoopTest::push_read_of(client, "");
+    EventLoopTest::run_all_polls();
+
+    /* the thread retires with the request queued, which keeps the replies */
+    std::weak_ptr<SharedReplies> replies(EventLoopTest::proxy->shared_replies());
+    EventLoopTest::proxy.reset(nullptr);
+    ASSERT_FALSE(replies.expired());
+
+    run_backend_polls();
+    int conn = EventLoopTest::last_fd();
+    ASSERT_EQ(format_command("GET", {"a"}), all_written_of(conn));
+    ASSERT_FALSE(replies.expired());
+
+    EventLoopTest::push_read_of(conn, "$1\r\nA\r\n");
+    run_backend_polls();
+    ASSERT_TRUE(replies.expired());
+}
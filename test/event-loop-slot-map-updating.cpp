@@ -1,7 +1,12 @@
+#include <thread>
+#include <fstream>
+#include <cstdio>
+
 #include "utils/string.h"
 #include "core/server.hpp"
 #include "core/message.hpp"
 #include "core/globals.hpp"
+#include "core/concurrence.hpp"
 #include "event-loop-test.hpp"
 
 using namespace cerb;
@@ -51,11 +56,9 @@ TEST_F(EventLoopSlotMapUpdatingTest, ServerReadAfterUpdateFailed)
         updaters.insert(u);
         EventLoopTest::push_read_of(
             u,
-            "+391a908a30eb413929229fa34bf473c742c91cef 10.0.0.1:9000"
-            " master - 0 0 0 connected 1-16383\n"
-             "491a908a30eb413929229fa34bf473c742c91cd0 10.0.0.1:9001"
-            " master - 0 0 0 connected"
-            "\r\n");
+            EventLoopTest::cluster_slots({
+                {1, 16383, "10.0.0.1", 9000, "391a908a30eb413929229fa34bf473c742c91cef"},
+            }));
     }
     EventLoopTest::push_read_of(server_b->fd, "$1\r\nb\r\n");
     std::set<int> fds(updaters);
@@ -72,3 +75,221 @@ TEST_F(EventLoopSlotMapUpdatingTest, ServerReadAfterUpdateFailed)
     }
     EventLoopTest::proxy->handle_events(events, nfd);
 }
+
+TEST_F(EventLoopSlotMapUpdatingTest, ShareSlotMapBetweenProxies)
+{
+    /* polled apart from the proxy of the test, so its mailbox is left to check */
+    EventLoopTest::poll_obj->next_epfd = -3;
+    cerb::Proxy other(0);
+    auto mailbox = std::make_shared<ControlMailbox>(&other);
+    EventLoopTest::poll_obj->next_epfd = 0;
+    ASSERT_EQ(nullptr, other.get_server_by_slot(0));
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.1", 9000), "391a908a30eb413929229fa34bf473c742c91cef");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+    other.handle_events(nullptr, 0);
+    ASSERT_EQ(server, other.get_server_by_slot(0));
+    ASSERT_EQ(-1, other.poll_timeout());
+
+    int last_fd = EventLoopTest::last_fd();
+    EventLoopTest::proxy->update_slot_map();
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    int updater = EventLoopTest::last_fd();
+    ASSERT_NE(last_fd, updater);
+
+    /* while someone else is updating, wait without connecting to any node or polling */
+    size_t registered = EventLoopTest::poll_obj->registered_data.size();
+    ControlMailbox::bind_to_this_thread(mailbox);
+    other.update_slot_map();
+    other.handle_events(nullptr, 0);
+    ControlMailbox::bind_to_this_thread(nullptr);
+    ASSERT_EQ(registered, EventLoopTest::poll_obj->registered_data.size());
+    ASSERT_EQ(-1, other.poll_timeout());
+    ASSERT_TRUE(EventLoopTest::read_buffer_empty(mailbox->fd));
+
+    /* woken through its mailbox once the new map is published */
+    for (int u = last_fd + 1; u <= updater; ++u) {
+        EventLoopTest::push_read_of(
+            u,
+            EventLoopTest::cluster_slots({
+                {0, 16383, "10.0.0.1", 9001, "491a908a30eb413929229fa34bf473c742c91cd0"},
+            }));
+    }
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(1, EventLoopTest::read_buffer_size(mailbox->fd));
+
+    other.handle_events(nullptr, 0);
+    ASSERT_EQ(-1, other.poll_timeout());
+    ASSERT_EQ(EventLoopTest::proxy->get_server_by_slot(0), other.get_server_by_slot(0));
+    ASSERT_NE(server, other.get_server_by_slot(0));
+}
+
+TEST_F(EventLoopSlotMapUpdatingTest, ProbeTopology)
+{
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.4", 9000), "391a908a30eb413929229fa34bf473c742c91ce1");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    EventLoopTest::update_slots_map(nodes);
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(-1, EventLoopTest::proxy->poll_timeout());
+
+    cerb_global::set_topology_probe(std::chrono::milliseconds(1), cerb::Interval(0));
+    ASSERT_NE(-1, EventLoopTest::proxy->poll_timeout());
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    int last_fd = EventLoopTest::last_fd();
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    int probe = EventLoopTest::last_fd();
+    ASSERT_NE(last_fd, probe);
+    ASSERT_EQ(-1, EventLoopTest::proxy->poll_timeout());
+
+    EventLoopTest::run_poll();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(probe));
+    ASSERT_EQ(format_command("cluster", {"nodes"}), EventLoopTest::get_written_of(probe, 0));
+
+    std::string const nodes_info(
+        "391a908a30eb413929229fa34bf473c742c91ce1 10.0.0.4:9000 myself,master - 0 0 1 connected 0-16383\n");
+    std::string const probe_rsp("$" + util::str(int(nodes_info.size())) + "\r\n" +
+                                nodes_info + "\r\n");
+    EventLoopTest::push_read_of(probe, probe_rsp);
+    EventLoopTest::run_poll();
+
+    /* the first probe only records the topology */
+    ASSERT_EQ(probe, EventLoopTest::last_fd());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    probe = EventLoopTest::last_fd();
+    EventLoopTest::run_poll();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(probe));
+
+    std::string const moved_info(
+        "391a908a30eb413929229fa34bf473c742c91ce1 10.0.0.4:9001 myself,master - 0 0 1 connected 0-16383\n");
+    std::string const moved_rsp("$" + util::str(int(moved_info.size())) + "\r\n" +
+                                moved_info + "\r\n");
+    EventLoopTest::push_read_of(probe, moved_rsp);
+    EventLoopTest::run_poll();
+
+    /* the master moved, so the slot map is updated */
+    int updater = EventLoopTest::last_fd();
+    ASSERT_NE(probe, updater);
+    EventLoopTest::run_poll();
+    ASSERT_EQ(1, EventLoopTest::write_buffer_size(updater));
+    ASSERT_EQ(format_command("cluster", {"slots"}), EventLoopTest::get_written_of(updater, 0));
+    EventLoopTest::push_read_of(
+        updater,
+        EventLoopTest::cluster_slots({
+            {0, 16383, "10.0.0.4", 9001, "391a908a30eb413929229fa34bf473c742c91ce1"},
+        }));
+    EventLoopTest::run_all_polls();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    probe = EventLoopTest::last_fd();
+    ASSERT_NE(updater, probe);
+    EventLoopTest::run_poll();
+    EventLoopTest::push_read_of(probe, moved_rsp);
+    EventLoopTest::run_poll();
+
+    /* same topology, no update */
+    ASSERT_EQ(probe, EventLoopTest::last_fd());
+}
+
+TEST_F(EventLoopSlotMapUpdatingTest, RouteBySavedSlotMap)
+{
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.5", 9000), "591a908a30eb413929229fa34bf473c742c91ce2");
+    x.slot_ranges.insert(std::make_pair(0, 16383));
+    nodes.push_back(std::move(x));
+    std::string const path("test-saved-slot-map.tmp");
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << cerb::encode_slot_map(nodes);
+    }
+    cerb_global::set_remotes(std::set<util::Address>());
+    ASSERT_TRUE(cerb_global::load_slot_map_file(path));
+    ASSERT_EQ(std::set<util::Address>({util::Address("10.0.0.5", 9000)}),
+              cerb_global::get_remotes());
+
+    EventLoopTest::proxy.reset(new cerb::Proxy(0));
+    int last_fd = EventLoopTest::last_fd();
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+
+    /* routes at once, and also asks the cluster */
+    Server* server = EventLoopTest::proxy->get_server_by_slot(0);
+    ASSERT_NE(nullptr, server);
+    ASSERT_EQ(util::Address("10.0.0.5", 9000), server->addr);
+    int updater = EventLoopTest::last_fd();
+    ASSERT_EQ(last_fd + 2, updater);
+
+    EventLoopTest::run_poll();
+    ASSERT_EQ(format_command("cluster", {"slots"}), EventLoopTest::get_written_of(updater, 0));
+    EventLoopTest::push_read_of(
+        updater,
+        EventLoopTest::cluster_slots({
+            {0, 8191, "10.0.0.5", 9000, "591a908a30eb413929229fa34bf473c742c91ce2"},
+            {8192, 16383, "10.0.0.5", 9001, "691a908a30eb413929229fa34bf473c742c91ce3"},
+        }));
+    EventLoopTest::run_all_polls();
+    ASSERT_EQ(server, EventLoopTest::proxy->get_server_by_slot(0));
+    ASSERT_NE(server, EventLoopTest::proxy->get_server_by_slot(8192));
+
+    /* the verified map replaces the saved one */
+    std::ifstream in(path, std::ios::binary);
+    std::string saved((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(2, cerb::decode_slot_map(saved).size());
+
+    cerb_global::load_slot_map_file("");
+    ::remove(path.data());
+}
+
+TEST_F(EventLoopSlotMapUpdatingTest, WarmUpBeforeAccepting)
+{
+    cerb_global::warm_up_timeout = std::chrono::seconds(10);
+    EventLoopTest::proxy.reset(new cerb::Proxy(0));
+    ASSERT_FALSE(EventLoopTest::proxy->ready());
+    ASSERT_NE(-1, EventLoopTest::proxy->poll_timeout());
+
+    std::vector<RedisNode> nodes;
+    RedisNode x(util::Address("10.0.0.6", 9000), "791a908a30eb413929229fa34bf473c742c91ce4");
+    x.slot_ranges.insert(std::make_pair(0, 8191));
+    RedisNode y(util::Address("10.0.0.6", 9001), "891a908a30eb413929229fa34bf473c742c91ce5");
+    y.slot_ranges.insert(std::make_pair(8192, 16383));
+    nodes.push_back(std::move(x));
+    nodes.push_back(std::move(y));
+    EventLoopTest::update_slots_map(nodes);
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+
+    /* slot map is ready but backends are still connecting */
+    Server* server_a = EventLoopTest::proxy->get_server_by_slot(0);
+    Server* server_b = EventLoopTest::proxy->get_server_by_slot(8192);
+    ASSERT_NE(nullptr, server_a);
+    ASSERT_NE(nullptr, server_b);
+    ASSERT_FALSE(server_a->connected());
+    ASSERT_FALSE(EventLoopTest::proxy->ready());
+
+    ASSERT_EQ(2, EventLoopTest::run_poll());
+    ASSERT_TRUE(server_a->connected());
+    ASSERT_TRUE(server_b->connected());
+    ASSERT_TRUE(EventLoopTest::proxy->ready());
+    ASSERT_EQ(-1, EventLoopTest::proxy->poll_timeout());
+}
+
+TEST_F(EventLoopSlotMapUpdatingTest, WarmUpTimeout)
+{
+    cerb_global::set_remotes(std::set<util::Address>());
+    cerb_global::warm_up_timeout = std::chrono::milliseconds(50);
+    EventLoopTest::proxy.reset(new cerb::Proxy(0));
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    ASSERT_FALSE(EventLoopTest::proxy->ready());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(51));
+    EventLoopTest::proxy->handle_events(nullptr, 0);
+    ASSERT_TRUE(EventLoopTest::proxy->ready());
+}
@@ -1,3 +1,5 @@
+#include "core/globals.hpp"
+#include "core/server.hpp"
 #include "event-loop-test.hpp"
 
 int MultipleBuffersIO::close(int fd)
@@ -8,34 +10,41 @@ int MultipleBuffersIO::close(int fd)
     return 0;
 }
 
-int AutomaticPoller::poll_wait(int, poll::pevent* events, int maxevents, int)
+int AutomaticPoller::poll_wait(int epfd, poll::pevent* events, int maxevents, int)
 {
-    return this->poll_wait(events, maxevents);
+    return this->poll_wait(events, maxevents, epfd);
 }
 
-void AutomaticPoller::poll_add_read(int, int evtfd, void* data)
+void AutomaticPoller::poll_add_read(int epfd, int evtfd, void* data)
 {
     ManualPoller::poll_add_read(0, evtfd, data);
     registered_data[evtfd] = data;
+    epfd_of[evtfd] = epfd;
 }
 
-void AutomaticPoller::poll_add_write(int, int evtfd, void* data)
+void AutomaticPoller::poll_add_write(int epfd, int evtfd, void* data)
 {
     ManualPoller::poll_add_write(0, evtfd, data);
     registered_data[evtfd] = data;
+    epfd_of[evtfd] = epfd;
 }
 
 void AutomaticPoller::poll_del(int, int evtfd)
 {
     ManualPoller::poll_del(0, evtfd);
     registered_data.erase(evtfd);
+    epfd_of.erase(evtfd);
 }
 
-int AutomaticPoller::poll_wait(poll::pevent events[], int maxevents)
+int AutomaticPoller::poll_wait(poll::pevent events[], int maxevents, int epfd)
 {
     this->last_pollees.clear();
     int count = 0;
     for (auto& i: this->pollees) {
+        auto e = this->epfd_of.find(i.first);
+        if ((e == this->epfd_of.end() ? 0 : e->second) != epfd) {
+            continue;
+        }
         int flags = 0;
         if (this->event_is_write(i.second)) {
             flags = EV_WRITE;
@@ -57,6 +66,8 @@ int AutomaticPoller::poll_wait(poll::pevent events[], int maxevents)
     return count;
 }
 
+char const* const MultipleBuffersIO::UNKNOWN_HOST = "unknown.host";
+
 util::sptr<cerb::Proxy> EventLoopTest::proxy(nullptr);
 util::sref<AutomaticPoller> EventLoopTest::poll_obj(nullptr);
 util::sref<MultipleBuffersIO> EventLoopTest::io_obj(nullptr);
@@ -82,11 +93,14 @@ void EventLoopTest::TearDown()
     for (auto i: EventLoopTest::poll_obj->registered_data) {
         conns.insert(static_cast<cerb::Connection*>(i.second));
     }
+    cerb::ActiveConnections active;
     for (cerb::Connection* c: conns) {
         c->on_error();
+        active.push(c);
     }
-    for (cerb::Connection* c: conns) {
-        c->after_events(conns);
+    cerb::Connection* c;
+    while ((c = active.pop()) != nullptr) {
+        c->after_events();
     }
 
     EventLoopTest::io_obj.reset();
@@ -96,4 +110,14 @@ void EventLoopTest::TearDown()
     PollNotImplement::set_impl(util::mkptr(new PollNotImplement));
 
     EventLoopTest::proxy.reset(nullptr);
+    cerb_global::set_topology_probe(cerb::Interval(0), cerb::Interval(0));
+    cerb_global::warm_up_timeout = cerb::Interval(0);
+    cerb_global::replication_probe_interval = cerb::Interval(0);
+    cerb_global::replica_max_lag_bytes = 0;
+    cerb_global::replica_max_lag_seconds = 0;
+    cerb_global::hedge_read_budget = 0;
+    cerb_global::hedge_min_delay = cerb::Interval(0);
+    cerb_global::balance_threads = false;
+    cerb::Server::set_read_policy(false, false, false);
+    cerb::Server::set_lanes(1, false, 0);
 }
@@ -4,38 +4,75 @@
 #include "mock-poll.hpp"
 #include "mock-acceptor.hpp"
 #include "core/proxy.hpp"
+#include "except/exceptions.hpp"
+#include "utils/string.h"
 
 struct MultipleBuffersIO
     : CIOImplement
 {
+    static char const* const UNKNOWN_HOST;
+
     explicit MultipleBuffersIO(util::sref<ManualPoller> poll)
         : last_fd(0)
         , poll_impl(poll)
     {}
 
     std::map<int, BufferIO> buffers;
+    /* written to become readable, and a read takes all the writes, like an eventfd */
+    std::set<int> event_fds;
     int last_fd;
     util::sref<ManualPoller> poll_impl;
 
     ssize_t read(int fd, void* b, size_t count)
     {
         EXPECT_NE(-1, fd);
+        if (event_fds.find(fd) != event_fds.end()) {
+            return read_event_fd(fd, count);
+        }
         return buffers[fd].read(0, b, count);
     }
 
     ssize_t write(int fd, void const* buf, size_t count)
     {
         EXPECT_NE(-1, fd);
+        if (event_fds.find(fd) != event_fds.end()) {
+            buffers[fd].read_buffer.push_back(std::string(static_cast<char const*>(buf), count));
+            return count;
+        }
         return buffers[fd].write(0, buf, count);
     }
 
+    ssize_t read_event_fd(int fd, size_t count)
+    {
+        if (buffers[fd].read_buffer.empty()) {
+            errno = EAGAIN;
+            return -1;
+        }
+        buffers[fd].read_buffer.clear();
+        return count;
+    }
+
     int close(int fd);
 
+    /* like fctl::connect_fd, which takes no host name */
+    void connect_fd(std::string const& host, int, int)
+    {
+        if (host == UNKNOWN_HOST) {
+            throw cerb::UnknownHost(host);
+        }
+    }
+
     int new_stream_socket()
     {
         return ++this->last_fd;
     }
 
+    int new_event_fd()
+    {
+        event_fds.insert(++this->last_fd);
+        return this->last_fd;
+    }
+
     void push_writing_size(int fd, int sz)
     {
         buffers[fd].writing_sizes.push_back(sz);
@@ -49,10 +86,15 @@ struct AutomaticPoller
 
     AutomaticPoller()
         : buffers(nullptr)
+        , next_epfd(0)
     {}
 
-    int poll_create() {return 0;}
-    int poll_wait(int, poll::pevent* events, int maxevents, int);
+    /* proxies poll on 0, tests set it to tell others apart */
+    int next_epfd;
+    std::map<int, int> epfd_of;
+
+    int poll_create() {return next_epfd;}
+    int poll_wait(int epfd, poll::pevent* events, int maxevents, int);
     void poll_add_read(int, int evtfd, void* data);
     void poll_add_write(int, int evtfd, void* data);
     void poll_del(int, int evtfd);
@@ -60,7 +102,7 @@ struct AutomaticPoller
     std::map<int, void*> registered_data;
     std::set<int> last_pollees;
 
-    int poll_wait(poll::pevent events[], int maxevents);
+    int poll_wait(poll::pevent events[], int maxevents, int epfd=0);
 };
 
 struct EventLoopTest
@@ -147,6 +189,27 @@ struct EventLoopTest
             ;
     }
 
+    struct SlotsOfNode {
+        cerb::slot first;
+        cerb::slot last;
+        std::string host;
+        int port;
+        std::string node_id;
+    };
+
+    /* reply of CLUSTER SLOTS for masters without replicas */
+    static std::string cluster_slots(std::vector<SlotsOfNode> const& ranges)
+    {
+        std::string r('*' + util::str(int(ranges.size())) + "\r\n");
+        for (auto const& rg: ranges) {
+            r += "*3\r\n:" + util::str(int(rg.first)) + "\r\n:" + util::str(int(rg.last)) + "\r\n"
+                 "*3\r\n$" + util::str(int(rg.host.size())) + "\r\n" + rg.host + "\r\n"
+                 ":" + util::str(rg.port) + "\r\n"
+                 "$" + util::str(int(rg.node_id.size())) + "\r\n" + rg.node_id + "\r\n";
+        }
+        return r;
+    }
+
     static void update_slots_map(std::vector<cerb::RedisNode> const& nodes,
                                  cerb::msize_t covered_slots=cerb::CLUSTER_SLOT_COUNT)
     {
@@ -0,0 +1,206 @@
+#include <thread>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "core/handoff.hpp"
+
+using namespace cerb;
+
+namespace {
+
+    struct Conn {
+        int fds[2];
+
+        Conn()
+        {
+            EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+        }
+
+        ~Conn()
+        {
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+    };
+
+}
+
+TEST(Handoff, Framing)
+{
+    Conn c;
+    int pipe_fds[2];
+    ASSERT_EQ(0, ::pipe(pipe_fds));
+
+    send_handoff_record(c.fds[0], 'R', "", -1);
+    send_handoff_record(c.fds[0], 'L', "listen", pipe_fds[1]);
+    ::close(pipe_fds[1]);
+
+    HandoffRecord r(recv_handoff_record(c.fds[1]));
+    ASSERT_EQ('R', r.type);
+    ASSERT_EQ("", r.payload);
+    ASSERT_EQ(-1, r.fd);
+
+    /* the fd received is another one to the same pipe */
+    r = recv_handoff_record(c.fds[1]);
+    ASSERT_EQ('L', r.type);
+    ASSERT_EQ("listen", r.payload);
+    ASSERT_NE(-1, r.fd);
+    ASSERT_EQ(3, ::write(r.fd, "fd!", 3));
+    ::close(r.fd);
+    char buffer[8];
+    ASSERT_EQ(3, ::read(pipe_fds[0], buffer, sizeof buffer));
+    ASSERT_EQ("fd!", std::string(buffer, 3));
+    ::close(pipe_fds[0]);
+
+    ::close(c.fds[0]);
+    c.fds[0] = -1;
+    r = recv_handoff_record(c.fds[1]);
+    ASSERT_EQ('\0', r.type);
+}
+
+TEST(Handoff, MultipleRecordsMap)
+{
+    Conn c;
+    std::string map;
+    for (int i = 0; map.size() < 100000; ++i) {
+        map += "node-" + std::to_string(i) + " 127.0.0.1:7000 0-16383\n";
+    }
+    send_handoff_data(c.fds[0], 'm', 'M', map, -1);
+    send_handoff_data(c.fds[0], 'm', 'M', "", -1);
+
+    int parts = 0;
+    std::string received;
+    while (true) {
+        HandoffRecord r(recv_handoff_record(c.fds[1]));
+        received += r.payload;
+        if (r.type != 'm') {
+            ASSERT_EQ('M', r.type);
+            break;
+        }
+        ++parts;
+    }
+    ASSERT_LT(1, parts);
+    ASSERT_EQ(map, received);
+
+    /* an empty map is still a record */
+    HandoffRecord r(recv_handoff_data(c.fds[1], 'm'));
+    ASSERT_EQ('M', r.type);
+    ASSERT_EQ("", r.payload);
+
+    send_handoff_data(c.fds[0], 'm', 'M', map, -1);
+    r = recv_handoff_data(c.fds[1], 'm');
+    ASSERT_EQ('M', r.type);
+    ASSERT_EQ(map, r.payload);
+}
+
+TEST(Handoff, HandOverClients)
+{
+    Conn c;
+    Conn client;
+    std::string buffered("*2\r\n$3\r\nGET\r\n$1\r\na\r\n*1\r\n$4\r\nPI");
+    std::string large(70000, 'x');
+
+    send_handoff_data(c.fds[0], 'b', 'C', buffered, client.fds[0]);
+    send_handoff_data(c.fds[0], 'b', 'C', large, client.fds[0]);
+    send_handoff_data(c.fds[0], 'b', 'C', "", client.fds[0]);
+    send_handoff_record(c.fds[0], 'E', "", -1);
+
+    HandoffRecord r(recv_handoff_data(c.fds[1], 'b'));
+    ASSERT_EQ('C', r.type);
+    ASSERT_EQ(buffered, r.payload);
+    ASSERT_NE(-1, r.fd);
+
+    /* replies written to the fd adopted reach the client */
+    ASSERT_EQ(5, ::write(r.fd, "+OK\r\n", 5));
+    ::close(r.fd);
+    char buffer[8];
+    ASSERT_EQ(5, ::read(client.fds[1], buffer, sizeof buffer));
+    ASSERT_EQ("+OK\r\n", std::string(buffer, 5));
+
+    /* only the last part carries the fd */
+    r = recv_handoff_data(c.fds[1], 'b');
+    ASSERT_EQ('C', r.type);
+    ASSERT_EQ(large, r.payload);
+    ASSERT_NE(-1, r.fd);
+    ::close(r.fd);
+
+    r = recv_handoff_data(c.fds[1], 'b');
+    ASSERT_EQ('C', r.type);
+    ASSERT_EQ("", r.payload);
+    ASSERT_NE(-1, r.fd);
+    ::close(r.fd);
+
+    r = recv_handoff_data(c.fds[1], 'b');
+    ASSERT_EQ('E', r.type);
+    ASSERT_EQ(-1, r.fd);
+}
+
+TEST(Handoff, PeerOfSameUser)
+{
+    Conn c;
+    ASSERT_TRUE(handoff_peer_trusted(c.fds[0]));
+    ASSERT_TRUE(handoff_peer_trusted(c.fds[1]));
+
+    /* not a unix socket, so there is no peer to trust */
+    int pipe_fds[2];
+    ASSERT_EQ(0, ::pipe(pipe_fds));
+    ASSERT_FALSE(handoff_peer_trusted(pipe_fds[0]));
+    ::close(pipe_fds[0]);
+    ::close(pipe_fds[1]);
+}
+
+TEST(Handoff, ListenersInThreadOrder)
+{
+    std::string path("/tmp/cerberus-handoff-test-" + std::to_string(::getpid()));
+    int listener = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    ASSERT_NE(-1, listener);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.data());
+    ::unlink(path.data());
+    ASSERT_EQ(0, ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+    ASSERT_EQ(0, ::listen(listener, 1));
+
+    /* the old process lists the listening sockets of its threads 0, 1, 2 */
+    int pipes[3][2];
+    for (auto& p: pipes) {
+        ASSERT_EQ(0, ::pipe(p));
+    }
+    std::thread old_process(
+        [&]()
+        {
+            int conn = ::accept(listener, nullptr, nullptr);
+            for (auto& p: pipes) {
+                send_handoff_record(conn, 'L', "", p[1]);
+            }
+            send_handoff_record(conn, 'M', "", -1);
+            ::close(conn);
+        });
+    int conn = take_over(path);
+    old_process.join();
+    ASSERT_NE(-1, conn);
+    ::close(conn);
+    ::close(listener);
+    ::unlink(path.data());
+
+    /* thread i takes the socket of index i in the reuseport group */
+    ASSERT_EQ(3, inherited_listeners());
+    for (auto& p: pipes) {
+        int fd = take_inherited_listener();
+        ASSERT_NE(-1, fd);
+        struct stat taken;
+        struct stat listed;
+        ASSERT_EQ(0, ::fstat(fd, &taken));
+        ASSERT_EQ(0, ::fstat(p[1], &listed));
+        ASSERT_EQ(listed.st_ino, taken.st_ino);
+        ::close(fd);
+        ::close(p[0]);
+        ::close(p[1]);
+    }
+    ASSERT_EQ(-1, take_inherited_listener());
+}
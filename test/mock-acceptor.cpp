@@ -21,6 +21,7 @@ Acceptor* get_acceptor()
 Acceptor::Acceptor(Proxy* p, int)
     : Connection(0)
     , _proxy(p)
+    , _unix_socket(false)
 {
     ::acceptor = this;
 }
@@ -41,3 +42,9 @@ int last_client_fd()
 }
 
 void Acceptor::turn_on_accepting() {}
+void Acceptor::shut() {}
+
+Acceptor* Acceptor::of_unix_listener(Proxy*, int)
+{
+    return nullptr;
+}
@@ -78,6 +78,11 @@ int fctl::new_stream_socket()
     return CIOImplement::get_impl()->new_stream_socket();
 }
 
+int fctl::new_event_fd()
+{
+    return CIOImplement::get_impl()->new_event_fd();
+}
+
 int fctl::set_tcpnodelay(int fd)
 {
     return CIOImplement::get_impl()->set_tcpnodelay(fd);
@@ -98,6 +103,16 @@ void fctl::bind_to(int fd, int port)
     return CIOImplement::get_impl()->bind_to(fd, port);
 }
 
+int fctl::steer_reuseport_by_cpu(int fd, int groups, int cpus_per_group)
+{
+    return CIOImplement::get_impl()->steer_reuseport_by_cpu(fd, groups, cpus_per_group);
+}
+
+int fctl::new_unix_listener(std::string const& path)
+{
+    return CIOImplement::get_impl()->new_unix_listener(path);
+}
+
 void BufferIO::clear()
 {
     this->read_buffer.clear();
@@ -23,10 +23,13 @@ public:
     virtual int close(int fd);
 
     virtual int new_stream_socket() { return -1; }
+    virtual int new_event_fd() { return -1; }
     virtual int set_tcpnodelay(int) { return 0; }
     virtual void set_nonblocking(int) {}
     virtual void connect_fd(std::string const&, int, int) {}
     virtual void bind_to(int, int) {}
+    virtual int steer_reuseport_by_cpu(int, int, int) { return 0; }
+    virtual int new_unix_listener(std::string const&) { return -1; }
 };
 
 struct BufferIO
@@ -22,6 +22,12 @@ int PollNotImplement::poll_create() { return 0; }
 int PollNotImplement::poll_wait(int, poll::pevent*, int, int) { return 0; }
 void PollNotImplement::poll_add_read(int, int, void*) {}
 void PollNotImplement::poll_add_write(int, int, void*) {}
+
+void PollNotImplement::poll_add_exclusive(int epfd, int evtfd, void* data)
+{
+    this->poll_add_read(epfd, evtfd, data);
+}
+
 void PollNotImplement::poll_read(int, int, void*) {}
 void PollNotImplement::poll_write(int, int, void*) {}
 void PollNotImplement::poll_del(int, int) {}
@@ -63,6 +69,12 @@ int poll::poll_add_write(int epfd, int evtfd, void* data)
     return 0;
 }
 
+int poll::poll_add_exclusive(int epfd, int evtfd, void* data)
+{
+    PollNotImplement::get_impl()->poll_add_exclusive(epfd, evtfd, data);
+    return 0;
+}
+
 int poll::poll_read(int epfd, int evtfd, void* data)
 {
     PollNotImplement::get_impl()->poll_read(epfd, evtfd, data);
@@ -24,6 +24,7 @@ public:
     virtual int poll_wait(int epfd, poll::pevent* events, int maxevents, int timeout);
     virtual void poll_add_read(int epfd, int evtfd, void* data);
     virtual void poll_add_write(int epfd, int evtfd, void* data);
+    virtual void poll_add_exclusive(int epfd, int evtfd, void* data);
     virtual void poll_read(int epfd, int evtfd, void* data);
     virtual void poll_write(int epfd, int evtfd, void* data);
     virtual void poll_del(int epfd, int evtfd);
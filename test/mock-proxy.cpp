@@ -5,14 +5,35 @@ using namespace cerb;
 
 Proxy::Proxy(int)
     : _clients_count(0)
+    , _topology_probe(nullptr)
     , _total_cmd_elapse(0)
     , _total_remote_cost(0)
     , _total_cmd(0)
     , _last_cmd_elapse(0)
     , _last_remote_cost(0)
+    , _slow_polls(0)
+    , _max_poll_elapse(0)
     , _slot_map_expired(false)
+    , _has_replicas(false)
+    , _hedge_tokens(0)
+    , _hedged_reads(0)
+    , _hedge_wins(0)
+    , _busy(0)
+    , _load_window_start(Clock::now())
+    , _load(0)
+    , _shed_to(nullptr)
+    , _migration_budget(0)
+    , _migrated_clients(0)
+    , _retiring(false)
+    , _drain_timed_out(false)
+    , _drain_deadline(Clock::now())
+    , _updating_slot_map(false)
+    , _slot_map_version(0)
+    , _generation(0)
+    , _shared_replies(nullptr)
     , epfd(0)
     , acceptor(this, 0)
+    , unix_acceptor(nullptr)
 {}
 
 Proxy::~Proxy() {}
@@ -21,8 +42,16 @@ void Proxy::update_slot_map() {}
 void Proxy::new_client(int) {}
 void Proxy::pop_client(Client*) {}
 void Proxy::retry_move_ask_command_later(util::sref<DataCommand>) {}
+void Proxy::redirect_command(util::sref<DataCommand>, Redirection const&) {}
 void Proxy::stat_proccessed(Interval, Interval) {}
 void Proxy::inactivate_long_conn(cerb::Connection*) {}
+void Proxy::migrate_client(int, std::string) {}
+void Proxy::retire(Interval) {}
+
+int Proxy::poll_timeout() const
+{
+    return -1;
+}
 
 void Proxy::poll_add_ro(Connection* conn)
 {
@@ -51,16 +80,17 @@ void Proxy::poll_del(Connection* conn)
 
 void Proxy::handle_events(poll::pevent[], int)
 {
-    for (std::pair<Connection*, bool> conn_writable: this->_conn_poll_type) {
-        Connection* c = conn_writable.first;
+    Connection* c;
+    while ((c = this->_dirty_conns.pop()) != nullptr) {
+        bool writable = c->write_wanted;
+        c->write_wanted = false;
         if (c->closed()) {
             continue;
         }
-        if (conn_writable.second) {
+        if (writable) {
             this->poll_rw(c);
         } else {
             this->poll_ro(c);
         }
     }
-    this->_conn_poll_type.clear();
 }
@@ -75,10 +75,15 @@ Server* Server::get_server(util::Address addr, Proxy*)
 }
 
 void Server::on_events(int) {}
-void Server::after_events(std::set<Connection*>&) {}
+void Server::after_events() {}
 std::string Server::str() const {return "";}
 
 void Server::close_conn()
 {
     ::closed.insert(this);
 }
+
+void Server::set_replicas(std::vector<Server*> replicas)
+{
+    this->_replicas = std::move(replicas);
+}
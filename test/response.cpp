@@ -48,3 +48,75 @@ TEST(Response, Array)
                   r[1]->get_buffer().to_string());
     }
 }
+
+TEST(Response, Dispatch)
+{
+    Buffer b("+OK\r\n"
+             "-MOVED 1 127.0.0.1:7000\r\n"
+             "-ERR wrong type\r\n"
+             "*2\r\n"
+                 "$1\r\na\r\n"
+                 "$1\r\n");
+    std::vector<std::string> rsps;
+    std::vector<bool> errors;
+    std::vector<bool> retries;
+    cerb::split_server_response(
+        b,
+        [&](Buffer::iterator begin, Buffer::iterator end, bool error, bool retry)
+        {
+            rsps.push_back(std::string(begin, end));
+            errors.push_back(error);
+            retries.push_back(retry);
+            return true;
+        });
+    ASSERT_EQ(3, rsps.size());
+    ASSERT_EQ("+OK\r\n", rsps[0]);
+    ASSERT_FALSE(errors[0]);
+    ASSERT_FALSE(retries[0]);
+    ASSERT_TRUE(errors[1]);
+    ASSERT_TRUE(retries[1]);
+    ASSERT_EQ("-ERR wrong type\r\n", rsps[2]);
+    ASSERT_TRUE(errors[2]);
+    ASSERT_FALSE(retries[2]);
+    ASSERT_EQ("*2\r\n$1\r\na\r\n$1\r\n", b.to_string());
+
+    rsps.clear();
+    Buffer c("b\r\n:1\r\n");
+    b.append_from(c.cbegin(), c.cend());
+    cerb::split_server_response(
+        b,
+        [&](Buffer::iterator begin, Buffer::iterator end, bool, bool)
+        {
+            rsps.push_back(std::string(begin, end));
+            return false;
+        });
+    ASSERT_EQ(1, rsps.size());
+    ASSERT_EQ("*2\r\n$1\r\na\r\n$1\r\nb\r\n", rsps[0]);
+    ASSERT_EQ("*2\r\n$1\r\na\r\n$1\r\nb\r\n:1\r\n", b.to_string());
+}
+
+TEST(Response, Redirection)
+{
+    Buffer b("-MOVED 3999 127.0.0.1:6381\r\n"
+             "-ASK 16383 :7000\r\n"
+             "-TRYAGAIN Multiple keys request during rehashing of slot\r\n"
+             "-CLUSTERDOWN The cluster is down\r\n");
+    std::vector<cerb::Redirection> r;
+    cerb::split_server_response(
+        b,
+        [&](Buffer::iterator begin, Buffer::iterator end, bool, bool retry)
+        {
+            EXPECT_TRUE(retry);
+            r.push_back(cerb::Redirection(begin, end, "10.0.0.1"));
+            return true;
+        });
+    ASSERT_EQ(4, r.size());
+    ASSERT_EQ(cerb::Redirection::MOVED, r[0].kind);
+    ASSERT_EQ(3999, r[0].key_slot);
+    ASSERT_EQ(util::Address("127.0.0.1", 6381), r[0].addr);
+    ASSERT_EQ(cerb::Redirection::ASK, r[1].kind);
+    ASSERT_EQ(16383, r[1].key_slot);
+    ASSERT_EQ(util::Address("10.0.0.1", 7000), r[1].addr);
+    ASSERT_EQ(cerb::Redirection::TRYAGAIN, r[2].kind);
+    ASSERT_EQ(cerb::Redirection::CLUSTERDOWN, r[3].kind);
+}
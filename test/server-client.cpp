@@ -32,7 +32,7 @@ struct ServerClientTestIO
 struct ServerClientTest
     : testing::Test
 {
-    static std::set<Connection*> active_conns;
+    static ActiveConnections active_conns;
     static util::sref<ManualPoller> poll_obj;
     static util::sref<ServerClientTestIO> io_obj;
     static int fd_iter;
@@ -45,12 +45,14 @@ struct ServerClientTest
         }
         ServerClientTest::server = s;
         if (s != nullptr) {
-            ServerClientTest::active_conns.insert(s);
+            ServerClientTest::active_conns.push(s);
         }
     }
 
     void SetUp()
     {
+        /* cases below cover the command group path; fast path cases turn it back on */
+        Client::set_fast_path(false);
         ::fd_iter = 0;
         util::sptr<ManualPoller> p(new ManualPoller);
         ServerClientTest::poll_obj = *p;
@@ -63,13 +65,11 @@ struct ServerClientTest
 
     void TearDown()
     {
-        for (Connection* c: ServerClientTest::active_conns) {
+        Connection* c;
+        while ((c = ServerClientTest::active_conns.pop()) != nullptr) {
             c->close();
+            c->after_events();
         }
-        for (Connection* c: ServerClientTest::active_conns) {
-            c->after_events(ServerClientTest::active_conns);
-        }
-        ServerClientTest::active_conns.clear();
 
         ServerClientTest::io_obj.reset();
         CIOImplement::set_impl(util::mkptr(new CIOImplement));
@@ -77,6 +77,7 @@ struct ServerClientTest
         ServerClientTest::poll_obj.reset();
         PollNotImplement::set_impl(util::mkptr(new PollNotImplement));
         ServerClientTest::set_server(nullptr);
+        Client::set_fast_path(true);
     }
 
     static void set_polls()
@@ -86,7 +87,7 @@ struct ServerClientTest
     }
 };
 
-std::set<Connection*> ServerClientTest::active_conns;
+ActiveConnections ServerClientTest::active_conns;
 util::sref<ManualPoller> ServerClientTest::poll_obj(nullptr);
 util::sref<ServerClientTestIO> ServerClientTest::io_obj(nullptr);
 int ServerClientTest::fd_iter(0);
@@ -117,12 +118,17 @@ Server* Proxy::get_server_by_slot(slot)
     return ServerClientTest::server;
 }
 
+Server* Proxy::get_read_server_by_slot(slot s)
+{
+    return this->get_server_by_slot(s);
+}
+
 TEST_F(ServerClientTest, ClientReadWrite)
 {
     ServerClientTest::io_obj->read_buffer.push_back("+PING\r\n");
 
     Client* client = new Client(::next_fd(), &::fake_proxy);
-    ServerClientTest::active_conns.insert(client);
+    ServerClientTest::active_conns.push(client);
 
     ASSERT_RO_CONN(client);
     ServerClientTest::poll_obj->clear_pollee_events(client->fd);
@@ -142,7 +148,7 @@ TEST_F(ServerClientTest, ClientReadWrite)
 TEST_F(ServerClientTest, ClientReadWriteSegments)
 {
     Client* client = new Client(::next_fd(), &::fake_proxy);
-    ServerClientTest::active_conns.insert(client);
+    ServerClientTest::active_conns.push(client);
 
     ServerClientTest::io_obj->read_buffer.push_back("+PIN");
 
@@ -180,7 +186,7 @@ TEST_F(ServerClientTest, ClientReadWriteSegments)
 TEST_F(ServerClientTest, SimpleRemoteCommand)
 {
     Client* client = new Client(::next_fd(), &::fake_proxy);
-    ServerClientTest::active_conns.insert(client);
+    ServerClientTest::active_conns.push(client);
     Server* server = Server::get_server(util::Address("", 0), &::fake_proxy);
     ASSERT_NE(nullptr, server);
     ASSERT_FALSE(server->closed());
@@ -231,7 +237,7 @@ TEST_F(ServerClientTest, SimpleRemoteCommand)
 TEST_F(ServerClientTest, PipeRemoteCommands)
 {
     Client* client = new Client(::next_fd(), &::fake_proxy);
-    ServerClientTest::active_conns.insert(client);
+    ServerClientTest::active_conns.push(client);
     Server* server = Server::get_server(util::Address("", 0), &::fake_proxy);
     ASSERT_NE(nullptr, server);
     ASSERT_FALSE(server->closed());
@@ -344,7 +350,7 @@ TEST_F(ServerClientTest, MultipleClientsPipelineTest)
     for (int i = 0; i < CLIENT_COUNT; ++i) {
         Client* c = new Client(::next_fd(), &::fake_proxy);
         clients.push_back(c);
-        ServerClientTest::active_conns.insert(c);
+        ServerClientTest::active_conns.push(c);
     }
     Server* server = Server::get_server(util::Address("", 0), &::fake_proxy);
     ServerClientTest::poll_obj->clear_pollee_events(server->fd);
@@ -509,3 +515,101 @@ TEST_F(ServerClientTest, MultipleClientsPipelineTest)
         ASSERT_EQ(responses_z[i], ServerClientTest::io_obj->write_buffer[i]);
     }
 }
+
+TEST_F(ServerClientTest, FastPathSingleCommand)
+{
+    Client::set_fast_path(true);
+    Client* client = new Client(::next_fd(), &::fake_proxy);
+    ServerClientTest::active_conns.push(client);
+    Server* server = Server::get_server(util::Address("", 0), &::fake_proxy);
+    ServerClientTest::set_server(server);
+
+    ServerClientTest::poll_obj->clear_pollee_events(client->fd);
+    ServerClientTest::poll_obj->clear_pollee_events(server->fd);
+    ServerClientTest::io_obj->read_buffer.push_back("*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n");
+    client->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+
+    ASSERT_RO_CONN(client);
+    ASSERT_RW_CONN(server);
+
+    ServerClientTest::poll_obj->clear_pollee_events(server->fd);
+    server->on_events(ManualPoller::EV_WRITE);
+    ServerClientTest::set_polls();
+
+    ASSERT_EQ(1, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n", ServerClientTest::io_obj->write_buffer[0]);
+    ASSERT_RO_CONN(server);
+
+    ServerClientTest::io_obj->read_buffer.push_back("$10\r\nnaganohara\r\n");
+    ServerClientTest::poll_obj->clear_pollee_events(server->fd);
+    server->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+
+    /* written back at once, without waiting for the client to be writable */
+    ASSERT_RO_CONN(client);
+    ASSERT_RO_CONN(server);
+    ASSERT_EQ(2, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("$10\r\nnaganohara\r\n", ServerClientTest::io_obj->write_buffer[1]);
+
+    /* the client reuses the path for its next command */
+    ServerClientTest::io_obj->read_buffer.push_back("*2\r\n$3\r\nget\r\n$4\r\nyuko\r\n");
+    client->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+    ASSERT_RW_CONN(server);
+    server->on_events(ManualPoller::EV_WRITE);
+    ServerClientTest::set_polls();
+    ASSERT_EQ(3, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("*2\r\n$3\r\nget\r\n$4\r\nyuko\r\n", ServerClientTest::io_obj->write_buffer[2]);
+
+    ServerClientTest::io_obj->read_buffer.push_back("$4\r\naioi\r\n");
+    server->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+    ASSERT_RO_CONN(client);
+    ASSERT_EQ(4, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("$4\r\naioi\r\n", ServerClientTest::io_obj->write_buffer[3]);
+}
+
+TEST_F(ServerClientTest, FastPathSkipsPipelinedAndMultiKeyCommands)
+{
+    Client::set_fast_path(true);
+    Client* client = new Client(::next_fd(), &::fake_proxy);
+    ServerClientTest::active_conns.push(client);
+    Server* server = Server::get_server(util::Address("", 0), &::fake_proxy);
+    ServerClientTest::set_server(server);
+
+    /* two commands in one read go through command groups and are replied together */
+    ServerClientTest::io_obj->read_buffer.push_back(
+        "*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n*2\r\n$3\r\nGET\r\n$4\r\nyuko\r\n");
+    client->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+    server->on_events(ManualPoller::EV_WRITE);
+    ServerClientTest::set_polls();
+    ASSERT_EQ(2, ServerClientTest::io_obj->write_buffer.size());
+    ServerClientTest::io_obj->write_buffer.clear();
+
+    ServerClientTest::io_obj->read_buffer.push_back("$10\r\nnaganohara\r\n$4\r\naioi\r\n");
+    ServerClientTest::poll_obj->clear_pollee_events(client->fd);
+    server->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+    ASSERT_RW_CONN(client);
+    ASSERT_EQ(0, ServerClientTest::io_obj->write_buffer.size());
+    client->on_events(ManualPoller::EV_WRITE);
+    ServerClientTest::set_polls();
+    ASSERT_RO_CONN(client);
+    ASSERT_EQ(2, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("$10\r\nnaganohara\r\n", ServerClientTest::io_obj->write_buffer[0]);
+    ASSERT_EQ("$4\r\naioi\r\n", ServerClientTest::io_obj->write_buffer[1]);
+    ServerClientTest::io_obj->write_buffer.clear();
+
+    /* MGET isn't a single key command */
+    ServerClientTest::io_obj->read_buffer.push_back(
+        "*3\r\n$4\r\nMGET\r\n$3\r\nmio\r\n$4\r\nyuko\r\n");
+    client->on_events(ManualPoller::EV_READ);
+    ServerClientTest::set_polls();
+    server->on_events(ManualPoller::EV_WRITE);
+    ServerClientTest::set_polls();
+    ASSERT_EQ(2, ServerClientTest::io_obj->write_buffer.size());
+    ASSERT_EQ("*2\r\n$3\r\nGET\r\n$3\r\nmio\r\n", ServerClientTest::io_obj->write_buffer[0]);
+    ASSERT_EQ("*2\r\n$3\r\nGET\r\n$4\r\nyuko\r\n", ServerClientTest::io_obj->write_buffer[1]);
+}
@@ -2,6 +2,9 @@
 
 #include "mock-server.hpp"
 #include "core/slot_map.hpp"
+#include "core/buffer.hpp"
+
+typedef std::set<std::pair<cerb::slot, cerb::slot>> SlotRanges;
 
 struct SlotMapTest
     : testing::Test
@@ -240,6 +243,141 @@ TEST_F(SlotMapTest, ParseMap)
     }
 }
 
+TEST_F(SlotMapTest, ParseClusterSlots)
+{
+    std::vector<cerb::RedisNode> nodes(cerb::parse_cluster_slots(cerb::Buffer(
+        "*3\r\n"
+            "*4\r\n:0\r\n:5460\r\n"
+                "*3\r\n$9\r\n127.0.0.1\r\n:7000\r\n"
+                    "$40\r\n29fa34bf473c742c91cee391a908a30eb4139292\r\n"
+                "*4\r\n$9\r\n127.0.0.1\r\n:7003\r\n"
+                    "$40\r\n2f53d0fb4a59274e83e47b1dca02697384822ca5\r\n*0\r\n"
+            "*3\r\n:5461\r\n:10922\r\n"
+                "*2\r\n$0\r\n\r\n:7001\r\n"
+            "*3\r\n:10923\r\n:16383\r\n"
+                "*3\r\n$9\r\n127.0.0.1\r\n:7000\r\n"
+                    "$40\r\n29fa34bf473c742c91cee391a908a30eb4139292\r\n"),
+        "10.0.0.1"));
+    ASSERT_EQ(3, nodes.size());
+
+    ASSERT_EQ("127.0.0.1", nodes[0].addr.host);
+    ASSERT_EQ(7000, nodes[0].addr.port);
+    ASSERT_EQ("29fa34bf473c742c91cee391a908a30eb4139292", nodes[0].node_id);
+    ASSERT_TRUE(nodes[0].is_master());
+    ASSERT_EQ(SlotRanges({{0, 5460}, {10923, 16383}}), nodes[0].slot_ranges);
+
+    ASSERT_EQ("127.0.0.1", nodes[1].addr.host);
+    ASSERT_EQ(7003, nodes[1].addr.port);
+    ASSERT_EQ("29fa34bf473c742c91cee391a908a30eb4139292", nodes[1].master_id);
+    ASSERT_TRUE(nodes[1].slot_ranges.empty());
+
+    ASSERT_EQ("10.0.0.1", nodes[2].addr.host);
+    ASSERT_EQ(7001, nodes[2].addr.port);
+    ASSERT_EQ("10.0.0.1:7001", nodes[2].node_id);
+    ASSERT_TRUE(nodes[2].is_master());
+    ASSERT_EQ(SlotRanges({{5461, 10922}}), nodes[2].slot_ranges);
+
+    ASSERT_TRUE(cerb::parse_cluster_slots(cerb::Buffer("-ERR cluster support disabled\r\n"),
+                                          "10.0.0.1").empty());
+}
+
+TEST_F(SlotMapTest, TopologyDigest)
+{
+    std::string const master_a(
+        "29fa34bf473c742c91cee391a908a30eb4139292 127.0.0.1:7000 myself,master - 0 0 1 connected 0-8191\n");
+    std::string const master_b(
+        "21952b372055dfdb5fa25b2761857831040472e1 127.0.0.1:7001 master - 0 1428573582310 2 connected 8192-16383\n");
+    std::string const slave_b(
+        "2f53d0fb4a59274e83e47b1dca02697384822ca5 127.0.0.1:7002 slave 21952b372055dfdb5fa25b2761857831040472e1 0 1428573582311 2 connected\n");
+    bool failing = true;
+    std::size_t digest = cerb::topology_digest(master_a + master_b + slave_b, failing);
+    ASSERT_FALSE(failing);
+
+    /* pings, pongs, link states and line order make no difference */
+    ASSERT_EQ(digest, cerb::topology_digest(
+        slave_b + master_a +
+        "21952b372055dfdb5fa25b2761857831040472e1 127.0.0.1:7001 master - 1428573582999 1428573583310 2 disconnected 8192-16383\n",
+        failing));
+    ASSERT_FALSE(failing);
+
+    ASSERT_NE(digest, cerb::topology_digest(
+        master_a + slave_b +
+        "21952b372055dfdb5fa25b2761857831040472e1 127.0.0.1:7001 master,fail? - 0 1428573582310 2 connected 8192-16383\n",
+        failing));
+    ASSERT_TRUE(failing);
+
+    /* replica promoted with a new epoch */
+    ASSERT_NE(digest, cerb::topology_digest(
+        master_a +
+        "21952b372055dfdb5fa25b2761857831040472e1 127.0.0.1:7001 master,fail - 0 1428573582310 2 disconnected\n"
+        "2f53d0fb4a59274e83e47b1dca02697384822ca5 127.0.0.1:7002 master - 0 1428573582311 3 connected 8192-16383\n",
+        failing));
+    ASSERT_FALSE(failing);
+}
+
+TEST_F(SlotMapTest, ParseReplicationInfo)
+{
+    std::vector<cerb::ReplicaLag> lags(cerb::parse_replication_info(
+        "# Replication\r\n"
+        "role:master\r\n"
+        "connected_slaves:3\r\n"
+        "slave0:ip=127.0.0.1,port=7003,state=online,offset=3439,lag=0\r\n"
+        "slave1:ip=127.0.0.1,port=7004,state=online,offset=1024,lag=12\r\n"
+        "slave2:ip=10.0.0.1,port=7005,state=send_bulk,offset=0,lag=0\r\n"
+        "master_repl_offset:3500\r\n"
+        "repl_backlog_active:1\r\n",
+        util::Address("127.0.0.1", 7000)));
+    ASSERT_EQ(3, lags.size());
+
+    ASSERT_EQ(util::Address("127.0.0.1", 7003), lags[0].addr);
+    ASSERT_EQ(util::Address("127.0.0.1", 7000), lags[0].master);
+    ASSERT_TRUE(lags[0].online);
+    ASSERT_EQ(61, lags[0].offset_lag);
+    ASSERT_EQ(0, lags[0].seconds_lag);
+
+    ASSERT_EQ(util::Address("127.0.0.1", 7004), lags[1].addr);
+    ASSERT_TRUE(lags[1].online);
+    ASSERT_EQ(2476, lags[1].offset_lag);
+    ASSERT_EQ(12, lags[1].seconds_lag);
+
+    ASSERT_EQ(util::Address("10.0.0.1", 7005), lags[2].addr);
+    ASSERT_FALSE(lags[2].online);
+
+    ASSERT_TRUE(cerb::parse_replication_info(
+        "# Replication\r\nrole:slave\r\nmaster_host:127.0.0.1\r\n",
+        util::Address("127.0.0.1", 7003)).empty());
+}
+
+TEST_F(SlotMapTest, EncodeDecode)
+{
+    std::vector<cerb::RedisNode> nodes;
+    cerb::RedisNode a(util::Address("127.0.0.1", 7000), "29fa34bf473c742c91cee391a908a30eb4139292");
+    a.slot_ranges.insert(std::make_pair(0, 5460));
+    a.slot_ranges.insert(std::make_pair(10923, 16383));
+    nodes.push_back(std::move(a));
+    nodes.push_back(cerb::RedisNode(util::Address("127.0.0.1", 7003),
+                                    "2f53d0fb4a59274e83e47b1dca02697384822ca5",
+                                    "29fa34bf473c742c91cee391a908a30eb4139292"));
+    cerb::RedisNode b(util::Address("10.0.0.1", 65535), "10.0.0.1:65535");
+    b.slot_ranges.insert(std::make_pair(5461, 10922));
+    nodes.push_back(std::move(b));
+
+    std::string data(cerb::encode_slot_map(nodes));
+    std::vector<cerb::RedisNode> decoded(cerb::decode_slot_map(data));
+    ASSERT_EQ(3, decoded.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_EQ(nodes[i].addr, decoded[i].addr);
+        ASSERT_EQ(nodes[i].node_id, decoded[i].node_id);
+        ASSERT_EQ(nodes[i].master_id, decoded[i].master_id);
+        ASSERT_EQ(nodes[i].slot_ranges, decoded[i].slot_ranges);
+    }
+
+    ASSERT_TRUE(cerb::decode_slot_map(cerb::encode_slot_map({})).empty());
+    ASSERT_THROW(cerb::decode_slot_map(data.substr(0, data.size() - 1)), std::runtime_error);
+    ASSERT_THROW(cerb::decode_slot_map(data + "x"), std::runtime_error);
+    ASSERT_THROW(cerb::decode_slot_map("*3\r\n"), std::runtime_error);
+}
+
 TEST_F(SlotMapTest, ReplaceNodesAllMasters)
 {
     cerb::SlotMap slot_map;
@@ -371,7 +509,9 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
         cerb::Server* svr = slot_map.get_by_slot(s);
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.101", svr->addr.host) << " slot #" << s;
-        ASSERT_EQ(7007, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(7003, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(1, svr->replicas().size()) << " slot #" << s;
+        ASSERT_EQ(7007, svr->replicas()[0]->addr.port) << " slot #" << s;
     }
 
     for (cerb::slot s = 4096; s < 8192; ++s) {
@@ -379,13 +519,16 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.101", svr->addr.host) << " slot #" << s;
         ASSERT_EQ(7001, svr->addr.port) << " slot #" << s;
+        ASSERT_TRUE(svr->replicas().empty()) << " slot #" << s;
     }
 
     for (cerb::slot s = 8192; s < 12288; ++s) {
         cerb::Server* svr = slot_map.get_by_slot(s);
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.100", svr->addr.host) << " slot #" << s;
-        ASSERT_EQ(7006, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(7002, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(1, svr->replicas().size()) << " slot #" << s;
+        ASSERT_EQ(7006, svr->replicas()[0]->addr.port) << " slot #" << s;
     }
 
     for (cerb::slot s = 12288; s < 16384; ++s) {
@@ -396,7 +539,7 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
     }
 
     std::set<cerb::Server*> to_be_replaced;
-    to_be_replaced.insert(slot_map.get_by_slot(0));
+    to_be_replaced.insert(slot_map.get_by_slot(0)->replicas()[0]);
 
     slot_map.replace_map(cerb::parse_slot_map(
         "69853562969c74ff387f9e491d025b2a86ac478f 192.168.1.100:7002 master - 0 0 3 connected 8192-12287\n"
@@ -414,6 +557,7 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.101", svr->addr.host) << " slot #" << s;
         ASSERT_EQ(7003, svr->addr.port) << " slot #" << s;
+        ASSERT_TRUE(svr->replicas().empty()) << " slot #" << s;
     }
 
     for (cerb::slot s = 4096; s < 8192; ++s) {
@@ -421,13 +565,16 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.101", svr->addr.host) << " slot #" << s;
         ASSERT_EQ(7001, svr->addr.port) << " slot #" << s;
+        ASSERT_TRUE(svr->replicas().empty()) << " slot #" << s;
     }
 
     for (cerb::slot s = 8192; s < 12288; ++s) {
         cerb::Server* svr = slot_map.get_by_slot(s);
         ASSERT_NE(nullptr, svr) << " slot #" << s;
         ASSERT_EQ("192.168.1.100", svr->addr.host) << " slot #" << s;
-        ASSERT_EQ(7006, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(7002, svr->addr.port) << " slot #" << s;
+        ASSERT_EQ(1, svr->replicas().size()) << " slot #" << s;
+        ASSERT_EQ(7006, svr->replicas()[0]->addr.port) << " slot #" << s;
     }
 
     for (cerb::slot s = 12288; s < 16384; ++s) {
@@ -438,6 +585,34 @@ TEST_F(SlotMapTest, ReplaceNodesAlsoSlave)
     }
 }
 
+TEST_F(SlotMapTest, FilterSlaves)
+{
+    cerb::SlotMap::select_slave_if_possible("10.0.1");
+    cerb::SlotMap slot_map;
+
+    slot_map.replace_map(cerb::parse_slot_map(
+        "69853562969c74ff387f9e491d025b2a86ac478f 10.0.0.1:7000 master - 0 0 1 connected 0-8191\n"
+        "2f53d0fb4a59274e83e47b1dca02697384822ca5 10.0.1.1:7000 slave 69853562969c74ff387f9e491d025b2a86ac478f 0 0 1 connected\n"
+        "d3adf40539ad749d214609987563bf9903a57ffc 10.0.2.1:7000 slave 69853562969c74ff387f9e491d025b2a86ac478f 0 0 1 connected\n"
+        "8dbe8e1f5d4a2e1e3a1cb7a0a92fd21a7c13c3b2 10.0.1.2:7000 slave 69853562969c74ff387f9e491d025b2a86ac478f 0 0 1 connected\n"
+        "2560c867f9ca2ef4cc872eb85ce985373ad9e815 10.0.0.2:7000 master - 0 0 2 connected 8192-16383\n"
+        "933970b4fd2d1ad06166ab1d893e8cac7b129ebd 10.0.2.2:7000 slave 2560c867f9ca2ef4cc872eb85ce985373ad9e815 0 0 2 connected\n"
+        "6c001456aff0ae537ba242d4e86fb325c5babbea 10.0.3.2:7000 slave 2560c867f9ca2ef4cc872eb85ce985373ad9e815 0 0 2 connected\n",
+        "127.0.0.1"), nullptr);
+
+    cerb::Server* svr = slot_map.get_by_slot(0);
+    ASSERT_EQ("10.0.0.1", svr->addr.host);
+    ASSERT_EQ(2, svr->replicas().size());
+    ASSERT_EQ("10.0.1.1", svr->replicas()[0]->addr.host);
+    ASSERT_EQ("10.0.1.2", svr->replicas()[1]->addr.host);
+
+    svr = slot_map.get_by_slot(8192);
+    ASSERT_EQ("10.0.0.2", svr->addr.host);
+    ASSERT_EQ(2, svr->replicas().size());
+    ASSERT_EQ("10.0.2.2", svr->replicas()[0]->addr.host);
+    ASSERT_EQ("10.0.3.2", svr->replicas()[1]->addr.host);
+}
+
 TEST_F(SlotMapTest, NonsenseProof)
 {
     cerb::SlotMap slot_map;
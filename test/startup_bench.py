@@ -0,0 +1,78 @@
+import os
+import time
+import socket
+import tempfile
+import subprocess
+
+import cluster_launcher
+
+PORT = 27183
+CLIENTS = 64
+CONFIG = '''
+bind {port}
+node 127.0.0.1:8800
+thread 4
+warm-up-timeout-ms {warm_up}
+'''
+
+
+def get(key):
+    s = socket.create_connection(('127.0.0.1', PORT))
+    try:
+        s.sendall('*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n' % (len(key), key))
+        r = s.recv(1024)
+        if not r or r[0] == '-':
+            raise IOError(r)
+    finally:
+        s.close()
+
+
+def measure(warm_up_ms):
+    conf = tempfile.NamedTemporaryFile(suffix='.conf', delete=False)
+    conf.write(CONFIG.format(port=PORT, warm_up=warm_up_ms))
+    conf.close()
+    devnull = open(os.devnull, 'w')
+    start = time.time()
+    c = subprocess.Popen(['./cerberus', conf.name], stdout=devnull,
+                         stderr=devnull)
+    try:
+        while True:
+            try:
+                get('startup')
+                break
+            except (IOError, socket.error):
+                time.sleep(0.001)
+        first_reply = time.time() - start
+
+        latencies = []
+        for i in xrange(CLIENTS):
+            t = time.time()
+            get('key-%d' % i)
+            latencies.append(time.time() - t)
+        latencies.sort()
+        return (first_reply, latencies[len(latencies) / 2],
+                latencies[len(latencies) * 99 / 100], latencies[-1])
+    finally:
+        c.terminate()
+        c.wait()
+        os.remove(conf.name)
+
+
+def main():
+    cluster_launcher.kill()
+    try:
+        cluster_launcher.launch()
+        time.sleep(1)
+        print 'Startup of 4 threads against a local 4 nodes cluster'
+        print '%-16s %12s %12s %12s %12s' % (
+            'warm-up-ms', 'first reply', 'p50', 'p99', 'max')
+        for warm_up_ms in [0, 3000]:
+            r = measure(warm_up_ms)
+            print '%-16d %10.2fms %10.2fms %10.2fms %10.2fms' % (
+                (warm_up_ms,) + tuple(x * 1000 for x in r))
+            time.sleep(0.5)
+    finally:
+        cluster_launcher.kill()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,139 @@
+import os
+import time
+import socket
+import tempfile
+import subprocess
+import multiprocessing
+
+import cluster_launcher
+
+PORT = 27185
+UNIX_SOCKET = '/tmp/cerberus-bench-27185.sock'
+THREADS = 2
+CLIENTS = 16
+REQUESTS = 5000
+CONFIG = '''
+bind {port}
+unix-socket {unix_socket}
+node 127.0.0.1:8800
+thread {threads}
+warm-up-timeout-ms 3000
+'''
+
+
+def connect(transport):
+    if transport == 'unix':
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(UNIX_SOCKET)
+        return s
+    s = socket.create_connection(('127.0.0.1', PORT))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return s
+
+
+def command(*args):
+    return '*%d\r\n%s' % (len(args), ''.join(
+        '$%d\r\n%s\r\n' % (len(a), a) for a in args))
+
+
+def run_client(args):
+    transport, cmd, index = args
+    s = connect(transport)
+    latencies = []
+    try:
+        for i in xrange(REQUESTS):
+            if cmd == 'GET':
+                req = command('GET', 'key-%d-%d' % (index, i % 100))
+            else:
+                req = command('PING')
+            t = time.time()
+            s.sendall(req)
+            r = s.recv(1024)
+            latencies.append(time.time() - t)
+            if not r or r[0] == '-':
+                raise IOError(r)
+    finally:
+        s.close()
+    return latencies
+
+
+def proxy_cpu():
+    s = connect('tcp')
+    try:
+        s.sendall(command('PROXY'))
+        r = ''
+        while not r.endswith('\r\n'):
+            r += s.recv(65536)
+    finally:
+        s.close()
+    fields = dict(line.split(':', 1) for line in r[1:].split('\n')
+                  if ':' in line)
+    return float(fields['used_cpu_sys']), float(fields['used_cpu_user'])
+
+
+def wait_ready():
+    while True:
+        try:
+            s = connect('unix')
+            s.sendall(command('PING'))
+            if s.recv(1024).startswith('+PONG'):
+                s.close()
+                return
+            s.close()
+        except socket.error:
+            pass
+        time.sleep(0.01)
+
+
+def measure(transport, cmd):
+    sys_before, user_before = proxy_cpu()
+    pool = multiprocessing.Pool(CLIENTS)
+    start = time.time()
+    latencies = sum(pool.map(run_client, [(transport, cmd, i)
+                                          for i in xrange(CLIENTS)]), [])
+    elapse = time.time() - start
+    pool.close()
+    sys_after, user_after = proxy_cpu()
+    latencies.sort()
+    count = len(latencies)
+    return (count / elapse, latencies[count / 2], latencies[count * 99 / 100],
+            (sys_after - sys_before) / count, (user_after - user_before) / count)
+
+
+def main():
+    cluster_launcher.kill()
+    conf = tempfile.NamedTemporaryFile(suffix='.conf', delete=False)
+    conf.write(CONFIG.format(port=PORT, unix_socket=UNIX_SOCKET,
+                             threads=THREADS))
+    conf.close()
+    devnull = open(os.devnull, 'w')
+    c = None
+    try:
+        cluster_launcher.launch()
+        time.sleep(1)
+        c = subprocess.Popen(['./cerberus', conf.name], stdout=devnull,
+                             stderr=devnull)
+        wait_ready()
+        print '%d threads, %d clients sending %d requests each' % (
+            THREADS, CLIENTS, REQUESTS)
+        print 'PING is answered by the proxy; GET goes to the cluster'
+        print '%-12s %10s %10s %10s %14s %14s' % (
+            'transport', 'req/s', 'p50', 'p99', 'sys us/req', 'user us/req')
+        for cmd in ['PING', 'GET']:
+            for transport in ['tcp', 'unix']:
+                qps, p50, p99, sys_cpu, user_cpu = measure(transport, cmd)
+                print '%-12s %10d %8.3fms %8.3fms %14.2f %14.2f' % (
+                    '%s %s' % (cmd, transport), qps, p50 * 1000, p99 * 1000,
+                    sys_cpu * 1000000, user_cpu * 1000000)
+                time.sleep(0.5)
+    finally:
+        if c is not None:
+            c.send_signal(2)
+            c.wait()
+        os.remove(conf.name)
+        if os.path.exists(UNIX_SOCKET):
+            os.remove(UNIX_SOCKET)
+        cluster_launcher.kill()
+
+if __name__ == '__main__':
+    main()
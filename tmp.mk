@@ -0,0 +1,3 @@
+backtracpp/sig-handler.o: backtracpp/sig-handler.cpp backtracpp/sig-handler.h \
+ backtracpp/trace.h backtracpp/demangle.h
+	g++ -c backtracpp/sig-handler.cpp -Wall -Wextra -Wold-style-cast -Werror -o backtracpp/sig-handler.o
@@ -0,0 +1,153 @@
+#include <new>
+#include <atomic>
+#include <vector>
+
+#include "arena.hpp"
+
+using namespace util;
+
+namespace {
+
+    std::size_t const BLOCK_SIZE = 64 * 1024;
+    std::size_t const MAX_OBJECT_SIZE = BLOCK_SIZE / 8;
+    std::size_t const ALIGNMENT = alignof(std::max_align_t);
+    std::size_t const MAX_FREE_BLOCKS = 16;
+
+    struct ThreadArena;
+
+    struct Block {
+        ThreadArena* const owner;
+        /* only changed by the owner thread */
+        std::size_t used;
+        /* objects not released yet, and 1 more while the owner allocates from it */
+        std::atomic<std::size_t> live;
+        alignas(ALIGNMENT) char data[BLOCK_SIZE];
+
+        explicit Block(ThreadArena* o)
+            : owner(o)
+            , used(0)
+            , live(1)
+        {}
+    };
+
+    /* Each object is preceded by the block it is in, or nullptr if too large */
+    struct alignas(ALIGNMENT) Header {
+        Block* block;
+    };
+
+    std::size_t align_up(std::size_t n)
+    {
+        return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    /* Objects may still be released by static destructors after thread exit */
+    thread_local bool thread_arena_destroyed = false;
+
+    void release_block(Block* b);
+
+    struct ThreadArena {
+        Block* current;
+        std::vector<Block*> free_blocks;
+
+        ThreadArena()
+            : current(nullptr)
+        {}
+
+        /* Blocks still in use outlive the thread; the last release frees them */
+        ~ThreadArena()
+        {
+            thread_arena_destroyed = true;
+            for (Block* b: this->free_blocks) {
+                delete b;
+            }
+            if (this->current != nullptr) {
+                ::release_block(this->current);
+            }
+        }
+
+        Block* next_block()
+        {
+            if (this->free_blocks.empty()) {
+                return new Block(this);
+            }
+            Block* b = this->free_blocks.back();
+            this->free_blocks.pop_back();
+            b->live.store(1, std::memory_order_relaxed);
+            return b;
+        }
+
+        void* allocate(std::size_t size)
+        {
+            if (this->current == nullptr) {
+                this->current = this->next_block();
+            } else if (BLOCK_SIZE - this->current->used < size) {
+                Block* full = this->current;
+                this->current = this->next_block();
+                ::release_block(full);
+            }
+            void* p = this->current->data + this->current->used;
+            this->current->used += size;
+            this->current->live.fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+
+        /* b has no object left, and isn't allocated from any more */
+        void recycle(Block* b)
+        {
+            b->used = 0;
+            if (this->free_blocks.size() < MAX_FREE_BLOCKS) {
+                this->free_blocks.push_back(b);
+            } else {
+                delete b;
+            }
+        }
+    };
+
+    thread_local ThreadArena thread_arena;
+
+    /*
+     * Objects may be released on another thread than the one they were
+     * allocated on, after being passed between threads. Whichever thread
+     * drops the last reference owns the block then; only its owner puts
+     * it back in its free list, and other threads free it.
+     */
+    void release_block(Block* b)
+    {
+        if (b->live.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        if (thread_arena_destroyed || b->owner != &thread_arena) {
+            delete b;
+            return;
+        }
+        thread_arena.recycle(b);
+    }
+
+}
+
+void* arena::allocate(std::size_t size)
+{
+    std::size_t total = sizeof(Header) + align_up(size);
+    Header* h;
+    if (MAX_OBJECT_SIZE < total) {
+        h = static_cast<Header*>(::operator new(total));
+        h->block = nullptr;
+    } else {
+        h = static_cast<Header*>(thread_arena.allocate(total));
+        h->block = thread_arena.current;
+    }
+    return h + 1;
+}
+
+void arena::release(void* p)
+{
+    if (p == nullptr) {
+        return;
+    }
+    Header* h = static_cast<Header*>(p) - 1;
+    if (h->block == nullptr) {
+        ::operator delete(h);
+        return;
+    }
+    ::release_block(h->block);
+}
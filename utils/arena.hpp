@@ -0,0 +1,55 @@
+#ifndef __CERBERUS_UTILITY_ARENA_HPP__
+#define __CERBERUS_UTILITY_ARENA_HPP__
+
+#include <cstddef>
+
+namespace util {
+
+    /*
+     * Per-thread bump allocator. Objects are placed one after another in
+     * fixed size blocks, and a block is recycled as a whole once every
+     * object in it is released, so that objects created together (like
+     * command groups parsed from one read) go back in one step. An object
+     * may be released on another thread than the one it was allocated on.
+     */
+    struct arena {
+        static void* allocate(std::size_t size);
+        static void release(void* p);
+    };
+
+    /* For std::allocate_shared, so that an object shared with its count is in the arena too */
+    template <typename T>
+    struct arena_allocator {
+        typedef T value_type;
+
+        arena_allocator() = default;
+
+        template <typename U>
+        arena_allocator(arena_allocator<U> const&) {}
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(arena::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, std::size_t)
+        {
+            arena::release(p);
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(arena_allocator<T> const&, arena_allocator<U> const&)
+    {
+        return true;
+    }
+
+    template <typename T, typename U>
+    bool operator!=(arena_allocator<T> const&, arena_allocator<U> const&)
+    {
+        return false;
+    }
+
+}
+
+#endif /* __CERBERUS_UTILITY_ARENA_HPP__ */
@@ -0,0 +1,71 @@
+#ifndef __CERBERUS_UTILITY_MPSC_QUEUE_HPP__
+#define __CERBERUS_UTILITY_MPSC_QUEUE_HPP__
+
+#include <atomic>
+
+namespace util {
+
+    /*
+     * Unbounded FIFO that any number of threads push to without locking
+     * and only one thread pops from. A push is one atomic exchange; the
+     * elements from each producer are popped in the order it pushed them.
+     */
+    template <typename T>
+    class mpsc_queue {
+        struct node {
+            std::atomic<node*> next;
+            T value;
+
+            node()
+                : next(nullptr)
+                , value()
+            {}
+
+            explicit node(T v)
+                : next(nullptr)
+                , value(std::move(v))
+            {}
+        };
+
+        std::atomic<node*> _head;
+        node* _tail;
+    public:
+        mpsc_queue()
+            : _head(new node)
+            , _tail(_head.load())
+        {}
+
+        mpsc_queue(mpsc_queue const&) = delete;
+
+        ~mpsc_queue()
+        {
+            T t;
+            while (this->pop(t))
+                ;
+            delete this->_tail;
+        }
+
+        void push(T t)
+        {
+            node* n = new node(std::move(t));
+            node* prev = this->_head.exchange(n, std::memory_order_acq_rel);
+            prev->next.store(n, std::memory_order_release);
+        }
+
+        /* consumer only; false if empty or the latest push is not linked yet */
+        bool pop(T& t)
+        {
+            node* next = this->_tail->next.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                return false;
+            }
+            t = std::move(next->value);
+            delete this->_tail;
+            this->_tail = next;
+            return true;
+        }
+    };
+
+}
+
+#endif /* __CERBERUS_UTILITY_MPSC_QUEUE_HPP__ */
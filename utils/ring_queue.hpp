@@ -0,0 +1,149 @@
+#ifndef __CERBERUS_UTILITY_RING_QUEUE_HPP__
+#define __CERBERUS_UTILITY_RING_QUEUE_HPP__
+
+#include <vector>
+#include <cstddef>
+
+namespace util {
+
+    /*
+     * FIFO on a growable circular array. Popping from the front costs
+     * nothing and the storage is reused, so a steady flow of elements
+     * does not touch the heap once the capacity is reached.
+     */
+    template <typename T>
+    class ring_queue {
+        std::vector<T> _slots;
+        std::size_t _head;
+        std::size_t _size;
+
+        std::size_t _index(std::size_t i) const
+        {
+            return (this->_head + i) & (this->_slots.size() - 1);
+        }
+
+        void _grow(T const& filler)
+        {
+            std::vector<T> slots(this->_slots.empty() ? 16 : this->_slots.size() * 2, filler);
+            for (std::size_t i = 0; i < this->_size; ++i) {
+                slots[i] = this->_slots[this->_index(i)];
+            }
+            this->_slots.swap(slots);
+            this->_head = 0;
+        }
+    public:
+        template <typename Q, typename V>
+        class basic_iterator {
+            Q* _q;
+            std::size_t _i;
+        public:
+            basic_iterator(Q* q, std::size_t i)
+                : _q(q)
+                , _i(i)
+            {}
+
+            V& operator*() const
+            {
+                return (*this->_q)[this->_i];
+            }
+
+            V* operator->() const
+            {
+                return &(*this->_q)[this->_i];
+            }
+
+            basic_iterator& operator++()
+            {
+                ++this->_i;
+                return *this;
+            }
+
+            bool operator==(basic_iterator const& rhs) const
+            {
+                return this->_i == rhs._i;
+            }
+
+            bool operator!=(basic_iterator const& rhs) const
+            {
+                return !operator==(rhs);
+            }
+        };
+
+        typedef T value_type;
+        typedef basic_iterator<ring_queue, T> iterator;
+        typedef basic_iterator<ring_queue const, T const> const_iterator;
+
+        ring_queue()
+            : _head(0)
+            , _size(0)
+        {}
+
+        std::size_t size() const
+        {
+            return this->_size;
+        }
+
+        bool empty() const
+        {
+            return this->_size == 0;
+        }
+
+        T& operator[](std::size_t i)
+        {
+            return this->_slots[this->_index(i)];
+        }
+
+        T const& operator[](std::size_t i) const
+        {
+            return this->_slots[this->_index(i)];
+        }
+
+        T& front()
+        {
+            return this->_slots[this->_head];
+        }
+
+        void push_back(T const& t)
+        {
+            if (this->_size == this->_slots.size()) {
+                this->_grow(t);
+            }
+            this->_slots[this->_index(this->_size++)] = t;
+        }
+
+        void pop_front()
+        {
+            this->_head = this->_index(1);
+            --this->_size;
+        }
+
+        void clear()
+        {
+            this->_head = 0;
+            this->_size = 0;
+        }
+
+        iterator begin()
+        {
+            return iterator(this, 0);
+        }
+
+        iterator end()
+        {
+            return iterator(this, this->_size);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(this, 0);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator(this, this->_size);
+        }
+    };
+
+}
+
+#endif /* __CERBERUS_UTILITY_RING_QUEUE_HPP__ */